@@ -0,0 +1,551 @@
+/*
+ * bcache.c - write-back block buffer cache
+ *
+ * The cache is itself a blkdev, stacked on top of another one (e.g. the
+ * image device), so the file system keeps using disk->ops->read/write
+ * and never has to know whether a block came from memory or the disk.
+ *
+ * Single-block requests go through the cache: lookup is by hash on the
+ * block number, replacement is CLOCK, and writes just mark the buffer
+ * dirty. Multi-block requests are assumed to be bulk data and bypass
+ * the cache, keeping it coherent with any cached copies. Dirty blocks
+ * are written back (sorted and coalesced into runs) when evicted, on
+ * flush, and on close.
+ *
+ * One mutex covers the cache. It is dropped only for the device read
+ * of a bulk read, so those can run in parallel.
+ *
+ * If the device below takes asynchronous requests, so does the cache:
+ * reads are treated like bulk reads, writes are done on the spot.
+ * Writeback puts its runs in flight below us too, so those are the
+ * only writes the lower device ever completes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "blkdev.h"
+
+struct buf {
+    int64_t blk;                /* -1 if unused */
+    int   dirty;
+    int   ref;                  /* CLOCK reference bit */
+    struct buf *next;           /* hash chain */
+    char *data;
+};
+
+struct bcache_dev {
+    struct blkdev *lower;
+    int   bsize;                /* block size, the same as lower's */
+    int   nbufs;
+    int   hash_mask;
+    int   hand;                 /* CLOCK hand */
+    struct buf  *bufs;
+    struct buf **hash;
+    char *mem;
+    pthread_mutex_t lock;
+    struct blkdev_req *stash, **stash_tail;     /* completed, not yet returned */
+    pthread_mutex_t reap_lock;  /* for the rest, which 'lock' can't cover */
+    pthread_cond_t reaped;
+    int   waiters;              /* in lower->complete without 'lock' */
+    struct blkdev_req *wb_done; /* writeback completions they picked up */
+    struct blkdev_stats *st;
+};
+
+static int hashfn(struct bcache_dev *bc, int64_t blk)
+{
+    return ((uint64_t)blk * 2654435761u) & bc->hash_mask;
+}
+
+static struct buf *lookup(struct bcache_dev *bc, int64_t blk)
+{
+    struct buf *b;
+    for (b = bc->hash[hashfn(bc, blk)]; b != NULL; b = b->next)
+        if (b->blk == blk)
+            return b;
+    return NULL;
+}
+
+static void unhash(struct bcache_dev *bc, struct buf *b)
+{
+    struct buf **pp = &bc->hash[hashfn(bc, b->blk)];
+    while (*pp != b)
+        pp = &(*pp)->next;
+    *pp = b->next;
+    b->next = NULL;
+}
+
+static void stash(struct bcache_dev *bc, struct blkdev_req *req)
+{
+    req->next = NULL;
+    *bc->stash_tail = req;
+    bc->stash_tail = &req->next;
+}
+
+static int cmp_buf(const void *a, const void *b)
+{
+    const struct buf *x = *(struct buf **)a, *y = *(struct buf **)b;
+    return (x->blk > y->blk) - (x->blk < y->blk);
+}
+
+// reads that came back from the lower device see our dirty blocks
+static void overlay_dirty(struct bcache_dev *bc, struct blkdev_req **done, int n)
+{
+    struct buf *b;
+    int i, k;
+
+    for (i = 0; i < n; i++) {
+        struct blkdev_req *req = done[i];
+        if (req->write || req->result < 0)
+            continue;
+        for (k = 0; k < req->num_blks; k++)
+            if ((b = lookup(bc, req->first_blk + k)) != NULL && b->dirty)
+                memcpy((char *)req->buf + k*bc->bsize, b->data, bc->bsize);
+    }
+}
+
+// one of write_runs_async's requests is finished
+static void written(struct blkdev_req *req, int *val)
+{
+    struct buf **b = req->priv;
+    int k;
+
+    if (req->result < 0)
+        *val = req->result;
+    else
+        for (k = 0; k < req->num_blks; k++)
+            b[k]->dirty = 0;
+}
+
+/* write_runs for a device with asynchronous requests: all the runs are
+ * put in flight at once, and then we wait for them. A thread already
+ * waiting in bcache_complete may pick up some of them; it hands those
+ * over through wb_done. No one new can start waiting while we hold the
+ * lock, so once those threads are gone we wait on the device ourselves.
+ */
+static int write_runs_async(struct bcache_dev *bc, struct buf **list, int n)
+{
+    struct blkdev *lower = bc->lower;
+    struct blkdev_req *reqs = malloc(n * sizeof(*reqs));
+    struct blkdev_req **ptrs = malloc(n * sizeof(*ptrs));
+    char *tmp = malloc((size_t)n * bc->bsize);
+    struct blkdev_req *req;
+    int i, j, k, got, left, nreqs = 0, val = SUCCESS;
+
+    for (i = 0; i < n; i = j) {
+        for (j = i + 1; j < n && list[j]->blk == list[j-1]->blk + 1; j++)
+            ;
+        for (k = i; k < j; k++)
+            memcpy(tmp + (size_t)k * bc->bsize, list[k]->data, bc->bsize);
+        reqs[nreqs] = (struct blkdev_req){.write = 1, .first_blk = list[i]->blk,
+                                          .num_blks = j - i,
+                                          .buf = tmp + (size_t)i * bc->bsize,
+                                          .priv = &list[i]};
+        ptrs[nreqs] = &reqs[nreqs];
+        nreqs++;
+    }
+
+    if ((val = lower->ops->submit(lower, ptrs, nreqs)) < 0)
+        nreqs = 0;      /* nothing to wait for */
+    for (left = nreqs; left > 0; ) {
+        pthread_mutex_lock(&bc->reap_lock);
+        while (bc->wb_done == NULL && bc->waiters > 0)
+            pthread_cond_wait(&bc->reaped, &bc->reap_lock);
+        req = bc->wb_done;
+        bc->wb_done = NULL;
+        pthread_mutex_unlock(&bc->reap_lock);
+        if (req != NULL) {
+            for (; req != NULL; req = req->next, left--)
+                written(req, &val);
+            continue;
+        }
+        if ((got = lower->ops->complete(lower, ptrs, 1, left)) <= 0)
+            break;
+        for (j = 0; j < got; j++)
+            if (!ptrs[j]->write) {      /* a read submitted through us */
+                overlay_dirty(bc, &ptrs[j], 1);
+                stash(bc, ptrs[j]);
+            } else {
+                written(ptrs[j], &val);
+                left--;
+            }
+    }
+
+    free(tmp);
+    free(ptrs);
+    free(reqs);
+    return val;
+}
+
+/* write back a sorted list of dirty buffers, merging runs of
+ * consecutive block numbers into a single multi-block write.
+ */
+static int write_runs(struct bcache_dev *bc, struct buf **list, int n)
+{
+    int i, j, k, val;
+    char *tmp = NULL;
+
+    if (n > 1 && bc->lower->ops->submit != NULL)
+        return write_runs_async(bc, list, n);
+
+    for (i = 0; i < n; i = j) {
+        for (j = i + 1; j < n && list[j]->blk == list[j-1]->blk + 1; j++)
+            ;
+        if (j - i == 1)
+            val = bc->lower->ops->write(bc->lower, list[i]->blk, 1,
+                                        list[i]->data);
+        else {
+            tmp = realloc(tmp, (j - i) * bc->bsize);
+            for (k = i; k < j; k++)
+                memcpy(tmp + (k - i) * bc->bsize, list[k]->data, bc->bsize);
+            val = bc->lower->ops->write(bc->lower, list[i]->blk, j - i, tmp);
+        }
+        if (val < 0) {
+            free(tmp);
+            return val;
+        }
+        for (k = i; k < j; k++)
+            list[k]->dirty = 0;
+    }
+    free(tmp);
+    return SUCCESS;
+}
+
+/* write back every dirty buffer in [first, first+n)
+ */
+static int writeback(struct bcache_dev *bc, int64_t first, int64_t n)
+{
+    int i, ndirty = 0, val;
+    struct buf *b, **list = malloc(bc->nbufs * sizeof(*list));
+
+    if (n < bc->nbufs) {        /* small range - look the blocks up */
+        for (i = 0; i < n; i++)
+            if ((b = lookup(bc, first + i)) != NULL && b->dirty)
+                list[ndirty++] = b;
+    } else
+        for (i = 0; i < bc->nbufs; i++) {
+            b = &bc->bufs[i];
+            if (b->blk >= first && b->blk < first + n && b->dirty)
+                list[ndirty++] = b;
+        }
+    qsort(list, ndirty, sizeof(*list), cmp_buf);
+    val = write_runs(bc, list, ndirty);
+    free(list);
+    return val;
+}
+
+/* find a victim with CLOCK, write it back if necessary, and rehash it
+ * to 'blk'. The contents are not filled in.
+ */
+static struct buf *get_buf(struct bcache_dev *bc, int64_t blk)
+{
+    struct buf *b;
+
+    for (;;) {
+        b = &bc->bufs[bc->hand];
+        bc->hand = (bc->hand + 1) % bc->nbufs;
+        if (b->blk == -1)
+            break;
+        if (b->ref) {
+            b->ref = 0;
+            continue;
+        }
+        if (b->dirty) {
+            int val = bc->lower->ops->write(bc->lower, b->blk, 1, b->data);
+            if (val < 0)
+                return NULL;
+            b->dirty = 0;
+        }
+        unhash(bc, b);
+        break;
+    }
+
+    int h = hashfn(bc, blk);
+    b->blk = blk;
+    b->ref = 1;
+    b->next = bc->hash[h];
+    bc->hash[h] = b;
+    return b;
+}
+
+static int64_t bcache_num_blocks(struct blkdev *dev)
+{
+    struct bcache_dev *bc = dev->private;
+    return bc->lower->ops->num_blocks(bc->lower);
+}
+
+static int bcache_read(struct blkdev *dev, int64_t first, int n, void *buf)
+{
+    struct bcache_dev *bc = dev->private;
+    struct buf *b;
+    int i, val;
+
+    blkdev_stats_io(bc->st, 0, n);
+    if (n > 1) {
+        /* bulk read straight from the device, then overlay anything
+         * newer that is sitting in the cache. Dirty blocks in the range
+         * are written back first: otherwise one could be evicted while
+         * the read is in progress, and we'd miss it both ways.
+         */
+        pthread_mutex_lock(&bc->lock);
+        val = writeback(bc, first, n);
+        pthread_mutex_unlock(&bc->lock);
+        if (val < 0)
+            return val;
+        if ((val = bc->lower->ops->read(bc->lower, first, n, buf)) < 0)
+            return val;
+        pthread_mutex_lock(&bc->lock);
+        for (i = 0; i < n; i++)
+            if ((b = lookup(bc, first + i)) != NULL && b->dirty)
+                memcpy(buf + i*bc->bsize, b->data, bc->bsize);
+        pthread_mutex_unlock(&bc->lock);
+        return SUCCESS;
+    }
+
+    pthread_mutex_lock(&bc->lock);
+    blkdev_stats_hit(bc->st, (b = lookup(bc, first)) != NULL);
+    if (b == NULL) {
+        if ((b = get_buf(bc, first)) == NULL) {
+            pthread_mutex_unlock(&bc->lock);
+            return E_UNAVAIL;
+        }
+        if ((val = bc->lower->ops->read(bc->lower, first, 1, b->data)) < 0) {
+            unhash(bc, b);
+            b->blk = -1;
+            pthread_mutex_unlock(&bc->lock);
+            return val;
+        }
+    }
+    b->ref = 1;
+    memcpy(buf, b->data, bc->bsize);
+    pthread_mutex_unlock(&bc->lock);
+    return SUCCESS;
+}
+
+// bcache_write, with the lock held
+static int write_locked(struct bcache_dev *bc, int64_t first, int n, void *buf)
+{
+    struct buf *b;
+    int i, val = SUCCESS;
+
+    if (n > 1) {
+        /* write-through; cached copies become clean copies of the new
+         * data. The lock is held throughout so that an older copy
+         * can't be written back over the new data.
+         */
+        for (i = 0; i < n; i++)
+            if ((b = lookup(bc, first + i)) != NULL) {
+                memcpy(b->data, buf + i*bc->bsize, bc->bsize);
+                b->dirty = 0;
+            }
+        val = bc->lower->ops->write(bc->lower, first, n, buf);
+    } else if ((b = lookup(bc, first)) == NULL && (b = get_buf(bc, first)) == NULL)
+        val = E_UNAVAIL;
+    else {
+        memcpy(b->data, buf, bc->bsize);
+        b->dirty = b->ref = 1;
+    }
+    return val;
+}
+
+static int bcache_write(struct blkdev *dev, int64_t first, int n, void *buf)
+{
+    struct bcache_dev *bc = dev->private;
+    blkdev_stats_io(bc->st, 1, n);
+    pthread_mutex_lock(&bc->lock);
+    int val = write_locked(bc, first, n, buf);
+    pthread_mutex_unlock(&bc->lock);
+    return val;
+}
+
+/* asynchronous requests. Reads go to the device once any dirty blocks
+ * in their range are written back, and get dirty blocks overlaid when
+ * they complete, the same as bulk reads; writes are done right away.
+ */
+static int bcache_submit(struct blkdev *dev, struct blkdev_req **reqs, int n)
+{
+    struct bcache_dev *bc = dev->private;
+    struct blkdev_req **rd = malloc(n * sizeof(*rd));
+    int i, nrd = 0, val = SUCCESS;
+
+    pthread_mutex_lock(&bc->lock);
+    for (i = 0; i < n; i++) {
+        struct blkdev_req *req = reqs[i];
+        blkdev_stats_io(bc->st, req->write, req->num_blks);
+        if (req->write) {
+            req->result = write_locked(bc, req->first_blk, req->num_blks, req->buf);
+            stash(bc, req);
+        } else if ((req->result = writeback(bc, req->first_blk, req->num_blks)) < 0)
+            stash(bc, req);
+        else
+            rd[nrd++] = req;
+    }
+    if (nrd > 0 && (val = bc->lower->ops->submit(bc->lower, rd, nrd)) < 0)
+        for (i = 0; i < nrd; i++) {
+            rd[i]->result = val;
+            stash(bc, rd[i]);
+        }
+    pthread_mutex_unlock(&bc->lock);
+    free(rd);
+    return SUCCESS;
+}
+
+/* what's already done is collected under the lock; if that isn't 'min'
+ * requests, the wait for the rest happens with it dropped, so cache
+ * hits in other threads don't stall behind a disk read. Writeback's
+ * completions that turn up then go back to it, which can leave us
+ * with fewer than 'min'.
+ */
+static int bcache_complete(struct blkdev *dev, struct blkdev_req **done, int min, int max)
+{
+    struct bcache_dev *bc = dev->private;
+    int i, k, n = 0, m;
+
+    pthread_mutex_lock(&bc->lock);
+    while (n < max && bc->stash != NULL) {
+        done[n++] = bc->stash;
+        bc->stash = bc->stash->next;
+    }
+    if (bc->stash == NULL)
+        bc->stash_tail = &bc->stash;
+    if (n < max) {
+        m = bc->lower->ops->complete(bc->lower, done + n, 0, max - n);
+        overlay_dirty(bc, done + n, m);
+        n += m;
+    }
+    if (n < min && n < max) {
+        pthread_mutex_lock(&bc->reap_lock);
+        bc->waiters++;
+        pthread_mutex_unlock(&bc->reap_lock);
+        pthread_mutex_unlock(&bc->lock);
+
+        m = bc->lower->ops->complete(bc->lower, done + n, min - n, max - n);
+
+        pthread_mutex_lock(&bc->reap_lock);
+        for (i = k = 0; i < m; i++)
+            if (done[n+i]->write) {
+                done[n+i]->next = bc->wb_done;
+                bc->wb_done = done[n+i];
+            } else
+                done[n + k++] = done[n+i];
+        bc->waiters--;
+        pthread_cond_broadcast(&bc->reaped);
+        pthread_mutex_unlock(&bc->reap_lock);
+
+        pthread_mutex_lock(&bc->lock);
+        overlay_dirty(bc, done + n, k);
+        n += k;
+    }
+    pthread_mutex_unlock(&bc->lock);
+    return n;
+}
+
+static int bcache_flush(struct blkdev *dev, int64_t first, int64_t n)
+{
+    struct bcache_dev *bc = dev->private;
+    blkdev_stats_flush(bc->st);
+    pthread_mutex_lock(&bc->lock);
+    int val = writeback(bc, first, n);
+    pthread_mutex_unlock(&bc->lock);
+    if (val < 0)
+        return val;
+    return bc->lower->ops->flush(bc->lower, first, n);
+}
+
+/* lend out the lower device's copy, which is only current if we don't
+ * hold a dirty one.
+ */
+static void *bcache_map(struct blkdev *dev, int64_t blk)
+{
+    struct bcache_dev *bc = dev->private;
+    void *p = NULL;
+
+    pthread_mutex_lock(&bc->lock);
+    struct buf *b = lookup(bc, blk);
+    if ((b == NULL || !b->dirty) && bc->lower->ops->map != NULL)
+        p = bc->lower->ops->map(bc->lower, blk);
+    pthread_mutex_unlock(&bc->lock);
+    return p;
+}
+
+static void bcache_close(struct blkdev *dev)
+{
+    struct bcache_dev *bc = dev->private;
+
+    writeback(bc, 0, bcache_num_blocks(dev));
+    bc->lower->ops->close(bc->lower);
+    free(bc->mem);
+    free(bc->bufs);
+    free(bc->hash);
+    pthread_mutex_destroy(&bc->lock);
+    pthread_mutex_destroy(&bc->reap_lock);
+    pthread_cond_destroy(&bc->reaped);
+    free(bc);
+    dev->private = NULL;
+    free(dev);
+}
+
+struct blkdev_ops bcache_ops = {
+    .num_blocks = bcache_num_blocks,
+    .read = bcache_read,
+    .write = bcache_write,
+    .flush = bcache_flush,
+    .close = bcache_close,
+    .map = bcache_map
+};
+
+struct blkdev_ops bcache_async_ops = {
+    .num_blocks = bcache_num_blocks,
+    .read = bcache_read,
+    .write = bcache_write,
+    .flush = bcache_flush,
+    .close = bcache_close,
+    .map = bcache_map,
+    .submit = bcache_submit,
+    .complete = bcache_complete
+};
+
+/* create a cache of 'nbufs' blocks on top of 'lower'. Closing the
+ * cache writes it back and closes the lower device as well.
+ */
+struct blkdev *bcache_create(struct blkdev *lower, int nbufs)
+{
+    struct blkdev *dev = malloc(sizeof(*dev));
+    struct bcache_dev *bc = calloc(1, sizeof(*bc));
+    int i, nhash = 1;
+
+    if (dev == NULL || bc == NULL || nbufs < 1)
+        return NULL;
+
+    while (nhash < nbufs)
+        nhash <<= 1;
+
+    bc->lower = lower;
+    bc->bsize = lower->block_size;
+    bc->nbufs = nbufs;
+    bc->hash_mask = nhash - 1;
+    pthread_mutex_init(&bc->lock, NULL);
+    pthread_mutex_init(&bc->reap_lock, NULL);
+    pthread_cond_init(&bc->reaped, NULL);
+    bc->stash_tail = &bc->stash;
+    bc->st = blkdev_stats_register("cache", bc->bsize);
+    bc->bufs = calloc(nbufs, sizeof(struct buf));
+    bc->hash = calloc(nhash, sizeof(struct buf *));
+    bc->mem = malloc((size_t)nbufs * bc->bsize);
+    if (bc->bufs == NULL || bc->hash == NULL || bc->mem == NULL) {
+        fprintf(stderr, "can't allocate %d cache blocks\n", nbufs);
+        return NULL;
+    }
+
+    for (i = 0; i < nbufs; i++) {
+        bc->bufs[i].blk = -1;
+        bc->bufs[i].data = bc->mem + (size_t)i * bc->bsize;
+    }
+
+    dev->private = bc;
+    dev->ops = (lower->ops->submit != NULL) ? &bcache_async_ops : &bcache_ops;
+    dev->block_size = lower->block_size;
+    return dev;
+}
@@ -0,0 +1,521 @@
+/*
+ * bench.c - benchmark driver, calling the file system through fs_ops
+ *
+ * Links main.c directly, like the -cmdline mode of misc.c, so there is
+ * no FUSE or kernel in the way:
+ *
+ *   gcc -O2 -o bench bench.c main.c image.c image-aio.c bcache.c journal.c stats.c lz.c \
+ *       -lfuse -lpthread
+ *
+ * usage: bench [options] [workload ...] scratch.img
+ *   -size #       image size (K/M/G/T suffixes; default 64M)
+ *   -journal #    journal blocks, passed to mkfs-x6
+ *   -block #      block size in bytes, passed to mkfs-x6 (default 1K)
+ *   -mkfs path    mkfs-x6 to format the image with (default ./mkfs-x6)
+ *   -cache KB     buffer cache size (default 1024)
+ *   -mmap | -aio | -direct     image backend, as for homework
+ *   -compress     compress the files created (mkfs-x6 and homework -compress)
+ *   -n #          files for create/stat/unlink (default 2000)
+ *   -filesize #   file for seqwrite/seqread/randread (default 8M)
+ *   -io #         bytes per read/write call (default 4K)
+ *   -reads #      random reads (default 2000)
+ *   -depth #      directory depth for lookup (default 16)
+ *   -entries #    entries in the directory for readdir (default 5000)
+ *   -iters #      repetitions for lookup and readdir (default 2000, 50)
+ *
+ * Workloads (all of them, in this order, if none are named): create,
+ * stat, unlink, seqwrite, seqread, randread, lookup, readdir. The
+ * image is formatted once and the workloads run one after another.
+ * Results go to stdout as JSON: per workload the number of operations,
+ * elapsed time, ops/sec, MB/s (for I/O workloads) and p50/p99/p99.9
+ * latency in microseconds.
+ */
+#define FUSE_USE_VERSION 27
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fuse.h>
+
+#include "blkdev.h"
+
+extern struct fuse_operations fs_ops;
+extern int fs_image_block_size(char *path);
+extern int compress_files;
+
+struct blkdev *disk;
+int homework_part;
+
+struct opts {
+    long size;
+    int  journal;               /* -1: mkfs-x6's default */
+    int  block_size;
+    char *mkfs;
+    int  cache_kb;
+    int  mmap, aio, direct;
+    int  compress;
+    int  n_files;
+    long file_size;
+    int  io_size;
+    int  n_reads;
+    int  depth;
+    int  entries;
+    int  lookup_iters, readdir_iters;
+} o = {
+    .size = 64 << 20, .journal = -1, .block_size = BLOCK_SIZE, .mkfs = "./mkfs-x6", .cache_kb = 1024,
+    .n_files = 2000, .file_size = 8 << 20, .io_size = 4096, .n_reads = 2000,
+    .depth = 16, .entries = 5000, .lookup_iters = 2000, .readdir_iters = 50,
+};
+
+/* handle K/M/G/T
+ */
+static long parseint(char *s)
+{
+    long n = strtol(s, &s, 0);
+    if (tolower(*s) == 'k')
+        return n * 1024;
+    if (tolower(*s) == 'm')
+        return n * 1024 * 1024;
+    if (tolower(*s) == 'g')
+        return n * 1024 * 1024 * 1024;
+    if (tolower(*s) == 't')
+        return n * 1024 * 1024 * 1024 * 1024;
+    return n;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* one workload's measurements: the latency of each operation, in
+ * seconds, plus the total time and bytes moved.
+ */
+struct result {
+    const char *name;
+    double *lat;
+    int  n, max;
+    double start, elapsed;
+    long bytes;
+};
+
+static void begin(struct result *r, const char *name, int max)
+{
+    r->name = name;
+    r->lat = malloc(max * sizeof(double));
+    r->n = 0;
+    r->max = max;
+    r->bytes = 0;
+    r->start = now();
+}
+
+// time one call of 'expr', failing the run if it returns < 0
+#define TIMED(r, expr) do {                                             \
+        double _t = now();                                              \
+        int _v = (expr);                                                \
+        if (_v < 0) {                                                   \
+            fprintf(stderr, "%s: %s: %s\n", (r)->name, #expr, strerror(-_v)); \
+            exit(1);                                                    \
+        }                                                               \
+        (r)->lat[(r)->n++] = now() - _t;                                \
+    } while (0)
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(double *)a, y = *(double *)b;
+    return (x > y) - (x < y);
+}
+
+static double pct(struct result *r, double p)
+{
+    int i = (int)(p * r->n);
+    return r->lat[i < r->n ? i : r->n - 1] * 1e6;
+}
+
+static int n_results;
+
+static void report(struct result *r)
+{
+    r->elapsed = now() - r->start;
+    qsort(r->lat, r->n, sizeof(double), cmp_double);
+    printf("%s    {\"name\": \"%s\", \"ops\": %d, \"secs\": %.6f, "
+           "\"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f, "
+           "\"p50_us\": %.2f, \"p99_us\": %.2f, \"p999_us\": %.2f}",
+           n_results++ ? ",\n" : "", r->name, r->n, r->elapsed,
+           r->n / r->elapsed, r->bytes / r->elapsed / (1 << 20),
+           pct(r, 0.50), pct(r, 0.99), pct(r, 0.999));
+    free(r->lat);
+}
+
+/* small files: create (with one block of data), stat, unlink
+ */
+static char *small_name(int i)
+{
+    static char path[64];
+    sprintf(path, "/small/f%d", i);
+    return path;
+}
+
+/* building the files a workload runs against: give up if that fails,
+ * rather than timing operations on a half-made tree
+ */
+static void setup(const char *what, const char *path, int v)
+{
+    if (v < 0) {
+        fprintf(stderr, "%s: %s: %s\n", what, path, strerror(-v));
+        exit(1);
+    }
+}
+
+static void bench_create(void)
+{
+    struct result r;
+    char data[1024];
+    int i;
+
+    memset(data, 'x', sizeof(data));
+    setup("create", "/small", fs_ops.mkdir("/small", 0755));
+    begin(&r, "create", o.n_files);
+    for (i = 0; i < o.n_files; i++) {
+        double t = now();
+        int v = fs_ops.mknod(small_name(i), 0100644, 0);
+        if (v >= 0)
+            v = fs_ops.write(small_name(i), data, sizeof(data), 0, NULL);
+        if (v < 0) {
+            fprintf(stderr, "create: %s: %s\n", small_name(i), strerror(-v));
+            exit(1);
+        }
+        r.lat[r.n++] = now() - t;
+        r.bytes += sizeof(data);
+    }
+    report(&r);
+}
+
+// the files, for stat/unlink run without create
+static void make_small(void)
+{
+    struct stat sb;
+    int i;
+    if (fs_ops.getattr("/small", &sb) == 0)
+        return;
+    setup("stat", "/small", fs_ops.mkdir("/small", 0755));
+    for (i = 0; i < o.n_files; i++)
+        setup("stat", small_name(i), fs_ops.mknod(small_name(i), 0100644, 0));
+}
+
+static void bench_stat(void)
+{
+    struct result r;
+    struct stat sb;
+    int i;
+
+    make_small();
+    begin(&r, "stat", o.n_files);
+    for (i = 0; i < o.n_files; i++)
+        TIMED(&r, fs_ops.getattr(small_name(i), &sb));
+    report(&r);
+}
+
+static void bench_unlink(void)
+{
+    struct result r;
+    int i;
+
+    make_small();
+    begin(&r, "unlink", o.n_files);
+    for (i = 0; i < o.n_files; i++)
+        TIMED(&r, fs_ops.unlink(small_name(i)));
+    report(&r);
+}
+
+/* one big file: sequential write and read, then random reads, all in
+ * -io sized calls through an open file
+ */
+static void bench_seqwrite(void)
+{
+    struct result r;
+    struct fuse_file_info fi = {0};
+    char *buf = malloc(o.io_size);
+    long off;
+
+    memset(buf, 'y', o.io_size);
+    fs_ops.unlink("/big");
+    setup("seqwrite", "/big", fs_ops.mknod("/big", 0100644, 0));
+    setup("seqwrite", "/big", fs_ops.open("/big", &fi));
+    begin(&r, "seqwrite", o.file_size / o.io_size + 1);
+    for (off = 0; off + o.io_size <= o.file_size; off += o.io_size) {
+        TIMED(&r, fs_ops.write("/big", buf, o.io_size, off, &fi));
+        r.bytes += o.io_size;
+    }
+    fs_ops.fsync("/big", 0, &fi);
+    report(&r);
+    fs_ops.release("/big", &fi);
+    free(buf);
+}
+
+// the file, for seqread/randread run without seqwrite
+static void make_big(void)
+{
+    struct fuse_file_info fi = {0};
+    struct stat sb;
+    char *buf;
+    long off;
+
+    if (fs_ops.getattr("/big", &sb) == 0)
+        return;
+    buf = calloc(1, o.io_size);
+    setup("read", "/big", fs_ops.mknod("/big", 0100644, 0));
+    setup("read", "/big", fs_ops.open("/big", &fi));
+    for (off = 0; off + o.io_size <= o.file_size; off += o.io_size)
+        setup("read", "/big", fs_ops.write("/big", buf, o.io_size, off, &fi));
+    fs_ops.release("/big", &fi);
+    free(buf);
+}
+
+static void bench_seqread(void)
+{
+    struct result r;
+    struct fuse_file_info fi = {0};
+    char *buf = malloc(o.io_size);
+    long off;
+
+    make_big();
+    setup("seqread", "/big", fs_ops.open("/big", &fi));
+    begin(&r, "seqread", o.file_size / o.io_size + 1);
+    for (off = 0; off + o.io_size <= o.file_size; off += o.io_size) {
+        TIMED(&r, fs_ops.read("/big", buf, o.io_size, off, &fi));
+        r.bytes += o.io_size;
+    }
+    report(&r);
+    fs_ops.release("/big", &fi);
+    free(buf);
+}
+
+static void bench_randread(void)
+{
+    struct result r;
+    struct fuse_file_info fi = {0};
+    char *buf = malloc(o.io_size);
+    long n = o.file_size / o.io_size;
+    unsigned seed = 1;
+    int i;
+
+    make_big();
+    setup("randread", "/big", fs_ops.open("/big", &fi));
+    begin(&r, "randread", o.n_reads);
+    for (i = 0; i < o.n_reads && n > 0; i++) {
+        long off = (rand_r(&seed) % n) * o.io_size;
+        TIMED(&r, fs_ops.read("/big", buf, o.io_size, off, &fi));
+        r.bytes += o.io_size;
+    }
+    report(&r);
+    fs_ops.release("/big", &fi);
+    free(buf);
+}
+
+/* getattr of a file at the bottom of -depth directories
+ */
+static void bench_lookup(void)
+{
+    struct result r;
+    struct stat sb;
+    char *path = malloc(o.depth * 8 + 16);
+    int i;
+
+    strcpy(path, "");
+    for (i = 0; i < o.depth; i++) {
+        sprintf(path + strlen(path), "/d%d", i);
+        setup("lookup", path, fs_ops.mkdir(path, 0755));
+    }
+    strcat(path, "/leaf");
+    setup("lookup", path, fs_ops.mknod(path, 0100644, 0));
+
+    begin(&r, "lookup", o.lookup_iters);
+    for (i = 0; i < o.lookup_iters; i++)
+        TIMED(&r, fs_ops.getattr(path, &sb));
+    report(&r);
+    free(path);
+}
+
+/* listing a directory of -entries files
+ */
+static int count_entry(void *buf, const char *name, const struct stat *sb, off_t off)
+{
+    (*(int *)buf)++;
+    return 0;
+}
+
+static int list_big(int *count)
+{
+    struct fuse_file_info fi = {0};
+    int v;
+    *count = 0;
+    if (fs_ops.opendir != NULL && (v = fs_ops.opendir("/bigdir", &fi)) < 0)
+        return v;
+    v = fs_ops.readdir("/bigdir", count, count_entry, 0, &fi);
+    if (fs_ops.releasedir != NULL)
+        fs_ops.releasedir("/bigdir", &fi);
+    return v;
+}
+
+static void bench_readdir(void)
+{
+    struct result r;
+    char path[64];
+    int i, count = 0;
+
+    setup("readdir", "/bigdir", fs_ops.mkdir("/bigdir", 0755));
+    for (i = 0; i < o.entries; i++) {
+        sprintf(path, "/bigdir/entry-%d", i);
+        setup("readdir", path, fs_ops.mknod(path, 0100644, 0));
+    }
+    begin(&r, "readdir", o.readdir_iters);
+    for (i = 0; i < o.readdir_iters; i++)
+        TIMED(&r, list_big(&count));
+    report(&r);
+    if (count != o.entries)
+        fprintf(stderr, "readdir: listed %d entries, expected %d\n", count, o.entries);
+}
+
+struct workload {
+    const char *name;
+    void (*fn)(void);
+} workloads[] = {
+    {"create", bench_create},
+    {"stat", bench_stat},
+    {"unlink", bench_unlink},
+    {"seqwrite", bench_seqwrite},
+    {"seqread", bench_seqread},
+    {"randread", bench_randread},
+    {"lookup", bench_lookup},
+    {"readdir", bench_readdir},
+};
+#define N_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: bench [-size #] [-journal #] [-block #] [-mkfs path] [-cache KB]\n"
+            "    [-mmap | -aio | -direct] [-compress] [-n #] [-filesize #] [-io #]\n"
+            "    [-reads #] [-depth #] [-entries #] [-iters #] [workload ...] scratch.img\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    char *want[N_WORKLOADS];
+    int i, j, n_want = 0;
+
+    for (argv++, argc--; argc > 1; argv++, argc--) {
+        char *a = argv[0];
+        if (a[0] != '-') {
+            if (n_want == N_WORKLOADS)
+                usage();
+            want[n_want++] = a;
+            continue;
+        }
+        if (!strcmp(a, "-mmap"))
+            o.mmap = 1;
+        else if (!strcmp(a, "-aio"))
+            o.aio = 1;
+        else if (!strcmp(a, "-direct"))
+            o.direct = 1;
+        else if (!strcmp(a, "-compress"))
+            o.compress = 1;
+        else if (argc < 3)
+            usage();
+        else {
+            char *v = *++argv;
+            argc--;
+            if (!strcmp(a, "-size"))
+                o.size = parseint(v);
+            else if (!strcmp(a, "-journal"))
+                o.journal = parseint(v);
+            else if (!strcmp(a, "-block"))
+                o.block_size = parseint(v);
+            else if (!strcmp(a, "-mkfs"))
+                o.mkfs = v;
+            else if (!strcmp(a, "-cache"))
+                o.cache_kb = parseint(v);
+            else if (!strcmp(a, "-n"))
+                o.n_files = parseint(v);
+            else if (!strcmp(a, "-filesize"))
+                o.file_size = parseint(v);
+            else if (!strcmp(a, "-io"))
+                o.io_size = parseint(v);
+            else if (!strcmp(a, "-reads"))
+                o.n_reads = parseint(v);
+            else if (!strcmp(a, "-depth"))
+                o.depth = parseint(v);
+            else if (!strcmp(a, "-entries"))
+                o.entries = parseint(v);
+            else if (!strcmp(a, "-iters"))
+                o.lookup_iters = o.readdir_iters = parseint(v);
+            else
+                usage();
+        }
+    }
+    if (argc != 1 || o.io_size <= 0)
+        usage();
+    char *image = argv[0];
+    for (i = 0; i < n_want; i++) {
+        for (j = 0; j < N_WORKLOADS && strcmp(want[i], workloads[j].name); j++)
+            ;
+        if (j == N_WORKLOADS) {
+            fprintf(stderr, "unknown workload: %s\n", want[i]);
+            usage();
+        }
+    }
+
+    /* a fresh image every run */
+    char cmd[1024], jopt[32] = "";
+    if (o.journal >= 0)
+        sprintf(jopt, "-journal %d", o.journal);
+    unlink(image);
+    snprintf(cmd, sizeof(cmd), "%s -size %ld -block %d %s %s %s >/dev/null", o.mkfs,
+             o.size, o.block_size, jopt, o.compress ? "-compress" : "", image);
+    if (system(cmd) != 0) {
+        fprintf(stderr, "failed: %s\n", cmd);
+        exit(1);
+    }
+
+    int bsize = fs_image_block_size(image);
+    if (o.mmap)
+        disk = image_mmap_create(image, bsize);
+    else if (o.aio)
+        disk = image_aio_create(image, bsize);
+    else if (o.direct)
+        disk = image_direct_create(image, bsize);
+    else
+        disk = image_create(image, bsize);
+    if (disk == NULL || (disk = bcache_create(disk, o.cache_kb * 1024 / bsize)) == NULL) {
+        fprintf(stderr, "cannot open image file '%s': %s\n", image, strerror(errno));
+        exit(1);
+    }
+    compress_files = o.compress;
+    fs_ops.init(NULL);
+
+    printf("{\"image_size\": %ld, \"block_size\": %d, \"cache_kb\": %d, \"backend\": \"%s\", "
+           "\"compress\": %d, \"io_size\": %d,\n \"workloads\": [\n", o.size, bsize,
+           o.cache_kb, o.mmap ? "mmap" : o.aio ? "aio" : o.direct ? "direct" : "image",
+           o.compress, o.io_size);
+    for (j = 0; j < N_WORKLOADS; j++) {
+        for (i = 0; i < n_want && strcmp(want[i], workloads[j].name); i++)
+            ;
+        if (n_want == 0 || i < n_want)
+            workloads[j].fn();
+    }
+    printf("\n]}\n");
+
+    fs_ops.destroy(NULL);
+    disk->ops->close(disk);
+    return 0;
+}
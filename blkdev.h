@@ -1,23 +1,125 @@
 #ifndef __BLKDEV_H__
 #define __BLKDEV_H__
 
-#define BLOCK_SIZE 1024
+#include <stdint.h>
+
+/* block sizes are a power of two in this range. Each device has its
+ * own, fixed when the bottom one is opened; the layers stacked on it
+ * take the same.
+ */
+#define BLOCK_SIZE 1024         /* the smallest, and the default */
+#define MAX_BLOCK_SIZE 65536
 
 struct blkdev {
     struct blkdev_ops *ops;
     void *private;
+    int   block_size;           /* bytes */
+};
+
+/* an asynchronous request - see 'submit' and 'complete' below
+ */
+struct blkdev_req {
+    int   write;                /* 0 = read, 1 = write */
+    int64_t first_blk;
+    int   num_blks;
+    void *buf;
+    void *priv;                 /* for the submitter */
+    int   result;               /* SUCCESS or an error, once complete */
+    struct blkdev_req *next;    /* private to the device */
 };
 
+/* block numbers are 64-bit, so devices can be any size; one read or
+ * write moves an int's worth of blocks at most, but a flush can cover
+ * the whole device.
+ */
 struct blkdev_ops {
-    int  (*num_blocks)(struct blkdev *dev);
-    int  (*read)(struct blkdev *dev, int first_blk, int num_blks, void *buf);
-    int  (*write)(struct blkdev *dev, int first_blk, int num_blks, void *buf);
-    int  (*flush)(struct blkdev *dev, int first_blk, int num_blks);
+    int64_t (*num_blocks)(struct blkdev *dev);
+    int  (*read)(struct blkdev *dev, int64_t first_blk, int num_blks, void *buf);
+    int  (*write)(struct blkdev *dev, int64_t first_blk, int num_blks, void *buf);
+    int  (*flush)(struct blkdev *dev, int64_t first_blk, int64_t num_blks);
     void (*close)(struct blkdev *dev);
+    /* optional: a read-only pointer to block 'blk', valid until the
+     * next write to it, or NULL if it can't be lent out right now.
+     */
+    void *(*map)(struct blkdev *dev, int64_t blk);
+    /* optional: queue 'n' requests without waiting for them, and wait
+     * until at least 'min' have finished (fewer if that's all there
+     * is in flight), returning up to 'max' of them in 'done'.
+     */
+    int  (*submit)(struct blkdev *dev, struct blkdev_req **reqs, int n);
+    int  (*complete)(struct blkdev *dev, struct blkdev_req **done, int min, int max);
 };
 
 enum {SUCCESS = 0, E_BADADDR = -1, E_UNAVAIL = -2, E_SIZE = -3};
 
-extern struct blkdev *image_create(char *path);
+extern struct blkdev *image_create(char *path, int block_size);
+extern struct blkdev *image_mmap_create(char *path, int block_size);
+extern struct blkdev *image_aio_create(char *path, int block_size);
+extern struct blkdev *image_direct_create(char *path, int block_size);
+extern struct blkdev *bcache_create(struct blkdev *lower, int nbufs);
+
+/* metadata journal (journal.c): the log is blocks [start, start+nblks)
+ * of 'lower'. Metadata is written with journal_write_meta, and each
+ * file system operation is bracketed by journal_begin/journal_end.
+ */
+extern struct blkdev *journal_create(struct blkdev *lower, int64_t start, int nblks);
+extern void journal_begin(struct blkdev *dev);
+extern void journal_end(struct blkdev *dev);
+extern int journal_write_meta(struct blkdev *dev, int64_t first, int n, void *buf);
+extern int journal_seq(struct blkdev *dev);
+extern int journal_dirty(struct blkdev *lower, int64_t start);
+
+/* block I/O traces (trace.c, replay.c). A trace file is a header and
+ * then one record per request, all little-endian as on the host.
+ */
+#define TRACE_MAGIC 0x65636172746b6c62ull      /* "blktrace" */
+#define TRACE_VERSION 2
+
+struct trace_hdr {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t num_blocks;        /* size of the traced device */
+    uint64_t start_time;        /* seconds since the epoch */
+};
+
+enum {TRACE_READ = 1, TRACE_WRITE = 2, TRACE_FLUSH = 3};
+
+struct trace_rec {
+    uint64_t time_ns;           /* start, from the beginning of the trace */
+    int64_t  first_blk;
+    uint32_t lat_ns;
+    int32_t  num_blks;
+    uint8_t  op;                /* TRACE_READ etc. */
+    uint8_t  error;             /* it failed */
+    uint8_t  pad[6];
+};
+
+extern struct blkdev *trace_create(struct blkdev *lower, const char *path);
+
+/* run-time statistics (stats.c). A device's counters are registered
+ * under a name, and all of them show up in stats_format.
+ */
+struct blkdev_stats {
+    char name[16];
+    int  block_size;
+    unsigned long reads, writes, flushes;
+    unsigned long blks_read, blks_written;
+    unsigned long hits, misses;         /* caches only */
+    struct blkdev_stats *next;
+};
+
+extern struct blkdev_stats *blkdev_stats_register(const char *name, int block_size);
+extern void blkdev_stats_io(struct blkdev_stats *s, int write, int nblks);
+extern void blkdev_stats_flush(struct blkdev_stats *s);
+extern void blkdev_stats_hit(struct blkdev_stats *s, int hit);
+extern struct blkdev *stats_create(struct blkdev *lower, const char *name);
+
+struct op_stats;
+extern struct op_stats *op_stats_register(const char *name);
+extern int op_stats_done(struct op_stats *s, uint64_t start, int ret);
+extern uint64_t stats_now(void);
+extern int stats_format(char **text);
+extern void stats_reset(void);
 
 #endif
@@ -0,0 +1,582 @@
+/*
+ * fsck-x6.c - file system checker
+ *
+ *   gcc -O2 -o fsck-x6 fsck-x6.c image.c journal.c stats.c -lpthread
+ *
+ * usage: fsck-x6 [-repair] [-j #] [-v] file.img
+ *   -repair   fix what can be fixed (see below), writing to the image
+ *   -j #      worker threads (default: one per CPU)
+ *   -v        list every problem, not just the first few of each kind
+ *
+ * The image is mmap'd, not read in, and checked in three passes, each
+ * split across the workers:
+ *   1. walk the directory tree from the root, a level at a time,
+ *      claiming each inode found. An inode claimed twice is in two
+ *      directories (or in a loop), which is an error.
+ *   2. walk the block pointers or extent tree of every inode found,
+ *      marking the blocks in use and catching pointers out of range or
+ *      to a block some other pointer already claimed.
+ *   3. compare what was found against the inode and block bitmaps.
+ *
+ * -repair makes both bitmaps match what was found: leaked inodes and
+ * blocks (allocated but unreachable) are freed, and ones in use but
+ * marked free are allocated. It also clears block pointers out of
+ * range, drops extents out of range and pointers to bad extent tree
+ * nodes, cuts inline files down to what their inode holds, clears
+ * directory entries for impossible inode numbers, and fixes entries
+ * whose type doesn't match the inode. Blocks in two files
+ * are only reported. A journal left by an unclean shutdown is
+ * replayed first; without -repair it is only reported, as the image
+ * isn't consistent until it has been replayed.
+ *
+ * Exit status: 0 if clean, 1 if everything found was repaired, 4 if
+ * problems remain, 8 if the image couldn't be checked at all.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+
+#include "fsx600.h"
+#include "blkdev.h"
+
+#define PTRS_PER_BLK (bs / sizeof(uint32_t))
+#define DIRENTS_PER_BLK (bs / sizeof(struct fs_dirent))
+#define MAX_REPORT 10           /* of each kind, without -v */
+
+int repair, verbose, n_threads;
+
+char *disk;
+int bs;                         /* block size, from the superblock */
+struct fs_super *sb;
+fd_set *inode_map, *block_map;
+char *inodes;
+int inode_size, inline_max;     /* see FS_FEAT_INLINE */
+int n_inodes, data_start;
+#define INODE(n) ((struct fs_inode *)(inodes + (size_t)(n) * inode_size))
+
+uint64_t *used;                 /* blocks found in use */
+uint8_t *found;                 /* inodes found in the tree */
+
+/* problems, by kind. The 'fixed' ones are repaired with -repair.
+ */
+enum {P_RANGE, P_DUP, P_EXTENT, P_INLINE, P_DIRENT, P_TYPE, P_LINKED, P_INDEX, P_IFREE,
+      P_BFREE, P_ILEAK, P_BLEAK, P_JOURNAL, N_PROBLEMS};
+
+struct {
+    const char *what;
+    int fixed;
+    long count;
+} problems[N_PROBLEMS] = {
+    [P_RANGE]   = {"block pointers out of range", 1},
+    [P_DUP]     = {"blocks in more than one place", 0},
+    [P_EXTENT]  = {"bad extent tree nodes", 1},
+    [P_INLINE]  = {"inline files too big for their inode", 1},
+    [P_DIRENT]  = {"directory entries with bad inode numbers", 1},
+    [P_TYPE]    = {"directory entries of the wrong type", 1},
+    [P_LINKED]  = {"inodes in more than one directory", 0},
+    [P_INDEX]   = {"bad directory index blocks", 0},
+    [P_IFREE]   = {"inodes in use but marked free", 1},
+    [P_BFREE]   = {"blocks in use but marked free", 1},
+    [P_ILEAK]   = {"inodes leaked", 1},
+    [P_BLEAK]   = {"blocks leaked", 1},
+    [P_JOURNAL] = {"journal needs replay", 1},
+};
+
+pthread_mutex_t print_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void problem(int kind, const char *fmt, ...)
+{
+    long n = __atomic_add_fetch(&problems[kind].count, 1, __ATOMIC_RELAXED);
+    if (n > MAX_REPORT + 1 && !verbose)
+        return;
+    va_list ap;
+    va_start(ap, fmt);
+    pthread_mutex_lock(&print_lock);
+    if (n == MAX_REPORT + 1 && !verbose)
+        printf("  (more %s not listed)\n", problems[kind].what);
+    else {
+        printf("  ");
+        vprintf(fmt, ap);
+        printf("\n");
+    }
+    pthread_mutex_unlock(&print_lock);
+    va_end(ap);
+}
+
+static int blk_ok(uint32_t blk)
+{
+    return blk >= data_start && blk < sb->num_blocks;
+}
+
+static void *block(uint32_t blk)
+{
+    return disk + (size_t)blk * bs;
+}
+
+/* run fn(lo, hi) over [0, n) in chunks of 'chunk', on all the workers
+ */
+struct job {
+    void (*fn)(int lo, int hi);
+    int n, chunk, next;
+};
+
+static void *worker(void *arg)
+{
+    struct job *j = arg;
+    int lo;
+    while ((lo = __atomic_fetch_add(&j->next, j->chunk, __ATOMIC_RELAXED)) < j->n)
+        j->fn(lo, lo + j->chunk < j->n ? lo + j->chunk : j->n);
+    return NULL;
+}
+
+static void parallel(void (*fn)(int lo, int hi), int n, int chunk)
+{
+    struct job j = {.fn = fn, .n = n, .chunk = chunk, .next = 0};
+    pthread_t t[n_threads];
+    int i;
+    for (i = 0; i < n_threads; i++)
+        pthread_create(&t[i], NULL, worker, &j);
+    for (i = 0; i < n_threads; i++)
+        pthread_join(t[i], NULL);
+}
+
+/* disk block holding block 'idx' of a file, or 0 if there isn't one
+ * (or its pointers are bad - pass 2 reports those)
+ */
+static uint32_t file_block(struct fs_inode *in, int idx)
+{
+    uint32_t *buf;
+    if (idx < N_DIRECT)
+        return blk_ok(in->direct[idx]) ? in->direct[idx] : 0;
+    idx -= N_DIRECT;
+    if (idx < PTRS_PER_BLK) {
+        if (!blk_ok(in->indir_1))
+            return 0;
+        buf = block(in->indir_1);
+        return blk_ok(buf[idx]) ? buf[idx] : 0;
+    }
+    idx -= PTRS_PER_BLK;
+    if (idx >= PTRS_PER_BLK * PTRS_PER_BLK || !blk_ok(in->indir_2))
+        return 0;
+    buf = block(in->indir_2);
+    if (!blk_ok(buf[idx / PTRS_PER_BLK]))
+        return 0;
+    buf = block(buf[idx / PTRS_PER_BLK]);
+    return blk_ok(buf[idx % PTRS_PER_BLK]) ? buf[idx % PTRS_PER_BLK] : 0;
+}
+
+/* pass 1: the directory tree, breadth first. Each level's directories
+ * are shared among the workers, which collect the next level.
+ */
+int *level, n_level;
+int *next_level, n_next;
+long n_dirs, n_files;
+
+static void scan_entries(int dir, struct fs_dirent *de)
+{
+    int i;
+    for (i = 0; i < DIRENTS_PER_BLK; i++) {
+        if (!de[i].valid)
+            continue;
+        int inum = de[i].inode;
+        if (inum < 2 || inum >= n_inodes) {
+            problem(P_DIRENT, "directory %d: entry '%.27s' has inode %d",
+                    dir, de[i].name, inum);
+            if (repair)
+                de[i].valid = 0;
+            continue;
+        }
+        if (__atomic_exchange_n(&found[inum], 1, __ATOMIC_RELAXED)) {
+            problem(P_LINKED, "directory %d: entry '%.27s': inode %d is already "
+                    "in a directory", dir, de[i].name, inum);
+            continue;
+        }
+        int isdir = S_ISDIR(INODE(inum)->mode);
+        if (de[i].isDir != isdir) {
+            problem(P_TYPE, "directory %d: entry '%.27s' says %s, inode %d is %s",
+                    dir, de[i].name, de[i].isDir ? "directory" : "file", inum,
+                    isdir ? "a directory" : "not");
+            if (repair)
+                de[i].isDir = isdir;
+        }
+        if (isdir) {
+            int k = __atomic_fetch_add(&n_next, 1, __ATOMIC_RELAXED);
+            next_level[k] = inum;
+            __atomic_add_fetch(&n_dirs, 1, __ATOMIC_RELAXED);
+        } else
+            __atomic_add_fetch(&n_files, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void scan_dir(int dir)
+{
+    struct fs_inode *in = INODE(dir);
+    int i, j;
+
+    if (!(in->flags & FS_DIR_INDEX)) {
+        if (blk_ok(in->direct[0]))
+            scan_entries(dir, block(in->direct[0]));
+        return;
+    }
+
+    /* hashed: the leaves are the blocks the index points to */
+    struct fs_dx_node *root = blk_ok(in->direct[0]) ? block(in->direct[0]) : NULL;
+    if (root == NULL || root->magic != FS_DX_MAGIC ||
+        root->count > DX_ENTRIES_PER_BLK(bs) || root->levels > 1) {
+        problem(P_INDEX, "directory %d: bad index root", dir);
+        return;
+    }
+    for (i = 0; i < root->count; i++) {
+        uint32_t blk = file_block(in, root->entries[i].block);
+        if (!root->levels) {
+            if (blk)
+                scan_entries(dir, block(blk));
+            continue;
+        }
+        struct fs_dx_node *node = blk ? block(blk) : NULL;
+        if (node == NULL || node->magic != FS_DX_MAGIC ||
+            node->count > DX_ENTRIES_PER_BLK(bs)) {
+            problem(P_INDEX, "directory %d: bad index node (logical block %d)",
+                    dir, root->entries[i].block);
+            continue;
+        }
+        for (j = 0; j < node->count; j++)
+            if ((blk = file_block(in, node->entries[j].block)) != 0)
+                scan_entries(dir, block(blk));
+    }
+}
+
+static void scan_level(int lo, int hi)
+{
+    for (; lo < hi; lo++)
+        scan_dir(level[lo]);
+}
+
+/* pass 2: block pointers. A pointer out of range is cleared with
+ * -repair; one to a block already claimed is left alone.
+ */
+static void claim(int inum, uint32_t blk)
+{
+    uint64_t bit = 1ull << (blk % 64);
+    if (__atomic_fetch_or(&used[blk / 64], bit, __ATOMIC_RELAXED) & bit)
+        problem(P_DUP, "inode %d: block %u is already in use", inum, blk);
+}
+
+static int use_ptr(int inum, uint32_t *p)
+{
+    uint32_t blk = *p;
+    if (blk == 0)
+        return 0;
+    if (!blk_ok(blk)) {
+        problem(P_RANGE, "inode %d: block pointer %u out of range", inum, blk);
+        if (repair)
+            *p = 0;
+        return 0;
+    }
+    claim(inum, blk);
+    return 1;
+}
+
+// a pointer to file data, which in a compressed file can be FS_CLUSTER_MARK
+static void use_data(int inum, uint32_t *p)
+{
+    if (*p != FS_CLUSTER_MARK || !(INODE(inum)->flags & FS_COMPRESS))
+        use_ptr(inum, p);
+}
+
+/* an extent tree node: an extent out of range, or an index entry for a
+ * node that isn't one, is dropped with -repair (the file gets a hole)
+ */
+static void use_extents(int inum, struct fs_extent_hdr *h, struct fs_extent *e)
+{
+    int i = 0;
+    uint32_t j;
+
+    while (i < h->count) {
+        struct fs_extent_node *node = NULL;
+        if (h->depth == 0 && (e[i].len == 0 || !blk_ok(e[i].pblk) ||
+                              !blk_ok(e[i].pblk + e[i].len - 1) ||
+                              e[i].pblk + e[i].len - 1 < e[i].pblk))
+            problem(P_RANGE, "inode %d: extent %u+%u out of range", inum,
+                    e[i].pblk, e[i].len);
+        else if (h->depth != 0 &&
+                 (!blk_ok(e[i].pblk) || (node = block(e[i].pblk))->hdr.magic != FS_EXT_MAGIC ||
+                  node->hdr.depth != h->depth - 1 || node->hdr.max != FS_EXT_NODE(bs) ||
+                  node->hdr.count > FS_EXT_NODE(bs)))
+            problem(P_EXTENT, "inode %d: bad extent node %u", inum, e[i].pblk);
+        else {
+            if (h->depth == 0)
+                for (j = 0; j < e[i].len; j++)
+                    claim(inum, e[i].pblk + j);
+            else {
+                claim(inum, e[i].pblk);
+                use_extents(inum, &node->hdr, node->e);
+            }
+            i++;
+            continue;
+        }
+        if (!repair) {
+            i++;
+            continue;
+        }
+        memmove(&e[i], &e[i + 1], (h->count - i - 1) * sizeof(*e));
+        h->count--;
+    }
+}
+
+static void use_blocks(int lo, int hi)
+{
+    int i, j;
+    for (; lo < hi; lo++) {
+        if (!found[lo])
+            continue;
+        struct fs_inode *in = INODE(lo);
+        if (in->flags & FS_INLINE) {
+            if (in->size_hi != 0 || (uint32_t)in->size > inline_max) {
+                problem(P_INLINE, "inode %d: %u bytes of inline data, at most %d",
+                        lo, in->size, inline_max);
+                if (repair)
+                    in->size = inline_max, in->size_hi = 0;
+            }
+            continue;
+        }
+        if (in->flags & FS_EXTENTS) {
+            struct fs_extent_hdr *h = &in->eh;
+            if (h->magic != FS_EXT_MAGIC || h->max != FS_EXT_INODE ||
+                h->count > FS_EXT_INODE) {
+                problem(P_EXTENT, "inode %d: bad extent tree root", lo);
+                if (repair)
+                    *h = (struct fs_extent_hdr) {.magic = FS_EXT_MAGIC, .max = FS_EXT_INODE};
+                continue;
+            }
+            use_extents(lo, h, in->ext);
+            continue;
+        }
+        for (i = 0; i < N_DIRECT; i++)
+            use_data(lo, &in->direct[i]);
+        if (use_ptr(lo, &in->indir_1)) {
+            uint32_t *buf = block(in->indir_1);
+            for (i = 0; i < PTRS_PER_BLK; i++)
+                use_data(lo, &buf[i]);
+        }
+        if (use_ptr(lo, &in->indir_2)) {
+            uint32_t *buf2 = block(in->indir_2);
+            for (i = 0; i < PTRS_PER_BLK; i++)
+                if (use_ptr(lo, &buf2[i])) {
+                    uint32_t *buf = block(buf2[i]);
+                    for (j = 0; j < PTRS_PER_BLK; j++)
+                        use_data(lo, &buf[j]);
+                }
+        }
+    }
+}
+
+/* pass 3: the bitmaps, a 64-bit word at a time
+ */
+#define WORD(map, i) (((uint64_t *)(map))[i])
+
+static void check_block_map(int lo, int hi)
+{
+    int w, b;
+    for (w = lo; w < hi; w++) {
+        uint64_t have = WORD(block_map, w), want = used[w];
+        for (b = 0; b < 64; b++) {
+            int blk = w * 64 + b;
+            if (blk < data_start)
+                want |= 1ull << b;
+            if (blk >= sb->num_blocks) {
+                want &= ~(~0ull << b);
+                have &= ~(~0ull << b);
+                break;
+            }
+        }
+        if (have == want)
+            continue;
+        for (b = 0; b < 64; b++) {
+            if ((want & ~have) & (1ull << b))
+                problem(P_BFREE, "block %d is in use but marked free", w * 64 + b);
+            if ((have & ~want) & (1ull << b))
+                problem(P_BLEAK, "block %d is leaked", w * 64 + b);
+        }
+        if (repair)
+            WORD(block_map, w) = (WORD(block_map, w) & ~(have ^ want)) | (want & (have ^ want));
+    }
+}
+
+/* chunks are a multiple of 64 inodes, so workers never share a word
+ */
+static void check_inode_map(int lo, int hi)
+{
+    for (; lo < hi; lo++) {
+        int have = FD_ISSET(lo, inode_map) != 0;
+        int want = (lo == 0) || found[lo];
+        if (have == want)
+            continue;
+        if (want)
+            problem(P_IFREE, "inode %d is in use but marked free", lo);
+        else
+            problem(P_ILEAK, "inode %d is leaked", lo);
+        if (repair && want)
+            FD_SET(lo, inode_map);
+        else if (repair)
+            FD_CLR(lo, inode_map);
+    }
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: fsck-x6 [-repair] [-j #] [-v] file.img\n");
+    exit(8);
+}
+
+int main(int argc, char **argv)
+{
+    struct fs_super super;
+    int i, fd;
+
+    n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    for (argv++, argc--; argc > 1; argv++, argc--) {
+        if (!strcmp(argv[0], "-repair"))
+            repair = 1;
+        else if (!strcmp(argv[0], "-v"))
+            verbose = 1;
+        else if (!strcmp(argv[0], "-j") && argc > 2) {
+            n_threads = atoi(argv[1]);
+            argv++, argc--;
+        } else
+            usage();
+    }
+    if (argc != 1)
+        usage();
+    char *file = argv[0];
+    if (n_threads < 1)
+        n_threads = 1;
+
+    if ((fd = open(file, repair ? O_RDWR : O_RDONLY)) < 0)
+        perror(file), exit(8);
+    if (pread(fd, &super, sizeof(super), 0) != sizeof(super) || super.magic != FS_MAGIC) {
+        fprintf(stderr, "%s: not a file system image\n", file);
+        exit(8);
+    }
+    if (super.features & ~FS_FEATURES) {
+        fprintf(stderr, "%s: unknown features 0x%x\n", file, super.features & ~FS_FEATURES);
+        exit(8);
+    }
+    bs = FS_BLKSIZE(&super);
+    if (bs < FS_BLOCK_SIZE || bs > FS_MAX_BLOCK_SIZE || (bs & (bs - 1)) != 0) {
+        fprintf(stderr, "%s: bad block size %d\n", file, bs);
+        exit(8);
+    }
+    inode_size = FS_INODE_SIZE(&super);
+    if (inode_size < sizeof(struct fs_inode) || inode_size > bs ||
+        bs % inode_size != 0) {
+        fprintf(stderr, "%s: bad inode size %d\n", file, inode_size);
+        exit(8);
+    }
+    inline_max = inode_size - sizeof(struct fs_inode);
+    data_start = 1 + super.inode_map_sz + super.block_map_sz +
+        super.inode_region_sz + super.journal_sz;
+
+    /* a journal from an unclean shutdown: replaying it is the first repair */
+    if (super.journal_sz != 0) {
+        struct blkdev *dev = image_create(file, bs);
+        int base = data_start - super.journal_sz;
+        if (dev != NULL && journal_dirty(dev, base)) {
+            problem(P_JOURNAL, "the journal was not closed cleanly");
+            if (repair)
+                dev = journal_create(dev, base, super.journal_sz);
+        }
+        if (dev == NULL)
+            fprintf(stderr, "%s: can't read the journal\n", file), exit(8);
+        dev->ops->close(dev);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)super.num_blocks * bs) {
+        fprintf(stderr, "%s: image is smaller than its file system\n", file);
+        exit(8);
+    }
+    disk = mmap(NULL, (size_t)super.num_blocks * bs,
+                PROT_READ | (repair ? PROT_WRITE : 0), MAP_SHARED, fd, 0);
+    if (disk == MAP_FAILED)
+        perror("mmap"), exit(8);
+    madvise(disk, (size_t)super.num_blocks * bs, MADV_WILLNEED);
+
+    sb = (void *)disk;
+    inode_map = (void *)(disk + bs);
+    block_map = (void *)((char *)inode_map + (size_t)sb->inode_map_sz * bs);
+    inodes = (char *)block_map + (size_t)sb->block_map_sz * bs;
+    n_inodes = sb->inode_region_sz * (bs / inode_size);
+    if (n_inodes > sb->inode_map_sz * bs * 8)
+        n_inodes = sb->inode_map_sz * bs * 8;
+    int n_words = (sb->num_blocks + 63) / 64;
+    if (n_words * 8 > sb->block_map_sz * bs) {
+        fprintf(stderr, "%s: block map too small for %d blocks\n", file, sb->num_blocks);
+        exit(8);
+    }
+    used = calloc(n_words, sizeof(uint64_t));
+    found = calloc(n_inodes, 1);
+    level = malloc(n_inodes * sizeof(int));
+    next_level = malloc(n_inodes * sizeof(int));
+
+    printf("%s: %d blocks, %d inodes, %d journal blocks, %d threads\n",
+           file, sb->num_blocks, n_inodes, sb->journal_sz, n_threads);
+    double t0 = now();
+
+    found[1] = 1;
+    level[0] = 1;
+    n_level = 1;
+    n_dirs = 1;
+    if (!S_ISDIR(INODE(1)->mode)) {
+        fprintf(stderr, "%s: root inode is not a directory\n", file);
+        exit(8);
+    }
+    while (n_level > 0) {
+        n_next = 0;
+        parallel(scan_level, n_level, 16);
+        int *tmp = level;
+        level = next_level;
+        next_level = tmp;
+        n_level = n_next;
+    }
+    parallel(use_blocks, n_inodes, 1024);
+    parallel(check_block_map, n_words, 4096);
+    parallel(check_inode_map, n_inodes, 8192);
+
+    if (repair && msync(disk, (size_t)sb->num_blocks * bs, MS_SYNC) < 0)
+        perror("msync"), exit(8);
+
+    long n_used = 0, left = 0, total = 0;
+    for (i = 0; i < n_words; i++)
+        n_used += __builtin_popcountll(used[i]);
+    printf("%ld directories, %ld files, %ld data blocks in use (%.3f seconds)\n",
+           n_dirs, n_files, n_used, now() - t0);
+    for (i = 0; i < N_PROBLEMS; i++)
+        if (problems[i].count) {
+            int fixed = repair && problems[i].fixed;
+            printf("%8ld %s%s\n", problems[i].count, problems[i].what,
+                   fixed ? " (repaired)" : "");
+            total += problems[i].count;
+            if (!fixed)
+                left += problems[i].count;
+        }
+    if (total == 0)
+        printf("clean\n");
+    return left ? 4 : total ? 1 : 0;
+}
@@ -3,7 +3,12 @@
 #ifndef __CSX600_H__
 #define __CSX600_H__
 
+/* Blocks are FS_BLOCK_SIZE bytes, or with FS_FEAT_BLKSIZE whatever the
+ * superblock says: a power of two up to FS_MAX_BLOCK_SIZE. Everything
+ * below that is "a block" is one of those.
+ */
 #define FS_BLOCK_SIZE 1024
+#define FS_MAX_BLOCK_SIZE 65536
 #define FS_MAGIC 0x37363030
 
 /* Entry in a directory
@@ -24,9 +29,60 @@ struct fs_super {
     uint32_t block_map_sz;       /* in blocks */
     uint32_t num_blocks;         /* total, including SB, bitmaps, inodes */
     uint32_t root_inode;        /* always inode 1 */
+    uint32_t journal_sz;        /* in blocks, after the inodes; 0 = none */
+    uint32_t features;          /* FS_FEAT_* */
+    uint32_t inode_size;        /* bytes per inode, with FS_FEAT_INLINE */
+    uint32_t block_size;        /* bytes, with FS_FEAT_BLKSIZE */
+
+    /* pad out to FS_BLOCK_SIZE; the rest of a bigger block 0 is unused */
+    char pad[FS_BLOCK_SIZE - 10 * sizeof(uint32_t)]; 
+};
+
+/* superblock feature flags. A file system with any flag not in
+ * FS_FEATURES is refused.
+ */
+#define FS_FEAT_SIZE64 0x1      /* inode size is 64 bits: size_hi:size */
+#define FS_FEAT_EXTENTS 0x2     /* new files are mapped by extents */
+#define FS_FEAT_INLINE 0x4      /* big inodes, holding small files' data */
+#define FS_FEAT_BLKSIZE 0x8     /* blocks aren't FS_BLOCK_SIZE */
+#define FS_FEAT_COMPRESS 0x10   /* there may be FS_COMPRESS files */
+#define FS_FEATURES (FS_FEAT_SIZE64 | FS_FEAT_EXTENTS | FS_FEAT_INLINE | \
+                     FS_FEAT_BLKSIZE | FS_FEAT_COMPRESS)
+
+#define FS_BLKSIZE(sb) (((sb)->features & FS_FEAT_BLKSIZE) ? \
+                        (sb)->block_size : FS_BLOCK_SIZE)
+
+/* Extents. A file with FS_EXTENTS set maps its blocks with a tree of
+ * extents instead of direct/indirect pointers. The root is in the
+ * inode (a header and FS_EXT_INODE entries, where the pointers would
+ * be); bigger trees have nodes of FS_EXT_NODE entries in blocks of
+ * their own. In a leaf (depth 0) each entry is a run of 'len' blocks
+ * starting at file block 'lblk' and disk block 'pblk'; in an index
+ * node 'pblk' is the child, covering file blocks from 'lblk' up to
+ * the next entry's. Entries are sorted by 'lblk'; a block that isn't
+ * in any extent is a hole.
+ */
+#define FS_EXT_MAGIC 0xf30e
+
+struct fs_extent_hdr {
+    uint16_t magic;
+    uint16_t count;             /* entries in use */
+    uint16_t max;               /* FS_EXT_INODE or FS_EXT_NODE() */
+    uint16_t depth;             /* 0 = leaf */
+};
 
-    /* pad out to an entire block */
-    char pad[FS_BLOCK_SIZE - 6 * sizeof(uint32_t)]; 
+struct fs_extent {
+    uint32_t lblk;
+    uint32_t len;               /* 0 in index nodes */
+    uint32_t pblk;
+};
+
+#define FS_EXT_INODE 2
+#define FS_EXT_NODE(bsize) (((bsize) - sizeof(struct fs_extent_hdr)) / sizeof(struct fs_extent))
+
+struct fs_extent_node {         /* fills a block */
+    struct fs_extent_hdr hdr;
+    struct fs_extent e[];
 };
 
 #define N_DIRECT 6
@@ -37,13 +93,83 @@ struct fs_inode {
     uint32_t ctime;
     uint32_t mtime;
      int32_t size;
-    uint32_t direct[N_DIRECT];
-    uint32_t indir_1;
-    uint32_t indir_2;
-    uint32_t pad[3];            /* 64 bytes per inode */
+    union {
+        struct {
+            uint32_t direct[N_DIRECT];
+            uint32_t indir_1;
+            uint32_t indir_2;
+        };
+        struct {                /* with FS_EXTENTS */
+            struct fs_extent_hdr eh;
+            struct fs_extent ext[FS_EXT_INODE];
+        };
+    };
+    uint32_t flags;             /* FS_DIR_INDEX, ... */
+    uint32_t size_hi;           /* with FS_FEAT_SIZE64 */
+    uint32_t pad;               /* 64 bytes per inode */
+};
+
+/* With FS_FEAT_INLINE an inode on disk is sb.inode_size bytes (a power
+ * of two, up to a block): a struct fs_inode, then inode_size - 64 bytes
+ * where a file with FS_INLINE keeps its contents instead of in blocks.
+ * Bytes past the end of the file are zero.
+ */
+#define FS_INODE_SIZE(sb) (((sb)->features & FS_FEAT_INLINE) ? \
+                           (sb)->inode_size : sizeof(struct fs_inode))
+
+/* inode flags
+ */
+#define FS_DIR_INDEX 0x1        /* directory is in hashed format */
+#define FS_EXTENTS 0x2          /* mapped by extents, not pointers */
+#define FS_INLINE 0x4           /* data is in the inode - FS_FEAT_INLINE */
+#define FS_COMPRESS 0x8         /* data is compressed - FS_FEAT_COMPRESS */
+
+/* Compressed files. A file with FS_COMPRESS is stored in clusters of
+ * FS_CLUSTER logical blocks, each compressed on its own (lz.c). It is
+ * always mapped by block pointers, and the pointers of a cluster say
+ * how it is stored: either as usual, or, if it compressed to fewer
+ * blocks than it holds, FS_CLUSTER_MARK and then the blocks of the
+ * compressed data, the rest 0. Compressed data starts with its length
+ * in bytes (uint32_t); what it expands to is the cluster up to the end
+ * of the file, and anything past that reads as zeros.
+ */
+#define FS_CLUSTER 8
+#define FS_CLUSTER_MARK 0xffffffff
+
+/* Hashed directories. A directory starts out as a single block of
+ * dirents in direct[0]. Once it outgrows that, logical block 0 of the
+ * directory becomes an index node, mapping ranges of name hashes to
+ * the (logical) blocks holding those names, and the entries live in
+ * leaf blocks which are ordinary arrays of dirents. entries[i] covers
+ * hashes from entries[i].hash up to entries[i+1].hash; entries[0].hash
+ * is always 0. If 'levels' in the root is 1, its entries point to a
+ * second layer of index nodes rather than to leaves.
+ */
+#define FS_DX_MAGIC 0x58444e32  /* low bit clear - never a valid dirent */
+
+struct fs_dx_entry {
+    uint32_t hash;
+    uint32_t block;             /* logical block within the directory */
 };
 
-enum {INODES_PER_BLK = FS_BLOCK_SIZE / sizeof(struct fs_inode)};
+struct fs_dx_node {             /* fills a block */
+    uint32_t magic;
+    uint16_t count;
+    uint16_t levels;            /* root only */
+    struct fs_dx_entry entries[];
+};
+
+#define DX_ENTRIES_PER_BLK(bsize) (((bsize) - 8) / sizeof(struct fs_dx_entry))
+
+/* 32-bit FNV-1a of a file name
+ */
+static inline uint32_t fs_name_hash(const char *name)
+{
+    uint32_t h = 2166136261u;
+    while (*name)
+        h = (h ^ (unsigned char)*name++) * 16777619u;
+    return h;
+}
 
 #endif
 
@@ -0,0 +1,485 @@
+/*
+ * image-aio.c - image blkdev with asynchronous requests
+ *
+ * Same device as image.c, plus the 'submit' and 'complete' ops so the
+ * file system can keep many requests in flight. Requests go to an
+ * io_uring if the kernel gives us one, and otherwise to a small pool
+ * of threads doing pread/pwrite. The synchronous ops are plain
+ * pread/pwrite in the caller's thread either way.
+ *
+ * The ring is driven with raw system calls, so liburing isn't needed.
+ * Either way, 'lock' serializes submit and complete between threads.
+ *
+ * The ring or the threads are set up by the first submit, not when the
+ * device is created: FUSE forks into the background after that, and
+ * threads don't survive a fork.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE               /* from linux/fs.h */
+
+#include "blkdev.h"
+
+#define QDEPTH   64
+#define NTHREADS 4
+
+struct uring {
+    int fd;
+    unsigned entries;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void  *sq_ptr, *cq_ptr;
+    size_t sq_sz, cq_sz;
+};
+
+struct aio_dev {
+    char *path;
+    int   fd;
+    int64_t nblks;
+    int   bsize;                /* block size */
+    int   started;              /* ring or threads set up */
+    int   use_uring;
+    struct uring ring;
+    unsigned queued;            /* in the ring, not taken by the kernel yet */
+
+    pthread_mutex_t lock;
+
+    /* thread pool, if there's no ring */
+    pthread_t threads[NTHREADS];
+    pthread_cond_t work, finished;
+    struct blkdev_req *queue, **queue_tail;
+    int   stopping;
+
+    /* finished requests not handed back by 'complete' yet */
+    struct blkdev_req *done, **done_tail;
+    int   ndone;
+    int   inflight;
+};
+
+/* transfer all of a request with pread/pwrite, retrying short
+ * transfers. 'skip' bytes have already been done.
+ */
+static int do_io(struct aio_dev *ad, struct blkdev_req *req, size_t skip)
+{
+    size_t len = (size_t)req->num_blks * ad->bsize;
+    off_t off = (off_t)req->first_blk * ad->bsize;
+    char *buf = req->buf;
+
+    while (skip < len) {
+        ssize_t n = req->write ?
+            pwrite(ad->fd, buf + skip, len - skip, off + skip) :
+            pread(ad->fd, buf + skip, len - skip, off + skip);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            fprintf(stderr, "%s error on %s: %s\n", req->write ? "write" : "read",
+                    ad->path, n < 0 ? strerror(errno) : "end of file");
+            return E_UNAVAIL;
+        }
+        skip += n;
+    }
+    return SUCCESS;
+}
+
+static int check_req(struct aio_dev *ad, int64_t first, int n)
+{
+    if (ad->fd == -1)
+        return E_UNAVAIL;
+    if (first < 0 || n < 0 || first + n > ad->nblks)
+        return E_BADADDR;
+    return SUCCESS;
+}
+
+// called with the lock held, if there is one
+static void finish(struct aio_dev *ad, struct blkdev_req *req, int result)
+{
+    req->result = result;
+    req->next = NULL;
+    *ad->done_tail = req;
+    ad->done_tail = &req->next;
+    ad->ndone++;
+    ad->inflight--;
+}
+
+static int pop_done(struct aio_dev *ad, struct blkdev_req **done, int max)
+{
+    int n = 0;
+    while (n < max && ad->done != NULL) {
+        done[n++] = ad->done;
+        ad->done = ad->done->next;
+        ad->ndone--;
+    }
+    if (ad->done == NULL)
+        ad->done_tail = &ad->done;
+    return n;
+}
+
+/* io_uring
+ */
+static int ring_enter(struct uring *r, unsigned submit, unsigned wait)
+{
+    int val;
+    do {
+        val = syscall(__NR_io_uring_enter, r->fd, submit, wait,
+                      wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (val < 0 && errno == EINTR);
+    return val;
+}
+
+/* pass the kernel what's queued, and wait for 'wait' completions. It
+ * can take fewer entries than that (short of memory, or a backed up
+ * completion ring); the rest stay queued for next time.
+ */
+static int ring_push(struct aio_dev *ad, unsigned wait)
+{
+    int val = ring_enter(&ad->ring, ad->queued, wait);
+    if (val > 0)
+        ad->queued -= val;
+    else if (val < 0 && (errno == EAGAIN || errno == EBUSY))
+        val = 0;
+    return val;
+}
+
+static void ring_reap(struct aio_dev *ad)
+{
+    struct uring *r = &ad->ring;
+    unsigned head = *r->cq_head;
+    unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        struct blkdev_req *req = (void *)(uintptr_t)cqe->user_data;
+        size_t len = (size_t)req->num_blks * ad->bsize;
+        int val;
+
+        if (cqe->res < 0) {
+            fprintf(stderr, "%s error on %s: %s\n", req->write ? "write" : "read",
+                    ad->path, strerror(-cqe->res));
+            val = E_UNAVAIL;
+        } else if ((size_t)cqe->res < len)
+            val = do_io(ad, req, cqe->res);     /* rare, just finish it here */
+        else
+            val = SUCCESS;
+        finish(ad, req, val);
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void ring_queue(struct aio_dev *ad, struct blkdev_req *req)
+{
+    struct uring *r = &ad->ring;
+    unsigned tail = *r->sq_tail;
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = req->write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = ad->fd;
+    sqe->off = (uint64_t)req->first_blk * ad->bsize;
+    sqe->addr = (uint64_t)(uintptr_t)req->buf;
+    sqe->len = req->num_blks * ad->bsize;
+    sqe->user_data = (uint64_t)(uintptr_t)req;
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void ring_free(struct uring *r)
+{
+    munmap(r->sqes, r->entries * sizeof(struct io_uring_sqe));
+    munmap(r->cq_ptr, r->cq_sz);
+    munmap(r->sq_ptr, r->sq_sz);
+    close(r->fd);
+}
+
+static int ring_setup(struct aio_dev *ad)
+{
+    struct uring *r = &ad->ring;
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, QDEPTH, &p);
+    if (r->fd < 0)
+        return -1;
+
+    r->entries = p.sq_entries;
+    r->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sq_ptr = mmap(NULL, r->sq_sz, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    r->cq_ptr = mmap(NULL, r->cq_sz, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sq_ptr == MAP_FAILED || r->cq_ptr == MAP_FAILED || r->sqes == MAP_FAILED) {
+        close(r->fd);
+        return -1;
+    }
+
+    r->sq_tail = r->sq_ptr + p.sq_off.tail;
+    r->sq_mask = r->sq_ptr + p.sq_off.ring_mask;
+    r->sq_array = r->sq_ptr + p.sq_off.array;
+    r->cq_head = r->cq_ptr + p.cq_off.head;
+    r->cq_tail = r->cq_ptr + p.cq_off.tail;
+    r->cq_mask = r->cq_ptr + p.cq_off.ring_mask;
+    r->cqes = r->cq_ptr + p.cq_off.cqes;
+
+    /* IORING_OP_READ needs 5.6 or later - try an empty read so older
+     * kernels end up with the thread pool instead.
+     */
+    char c;
+    struct blkdev_req probe = {.write = 0, .first_blk = 0, .num_blks = 0, .buf = &c};
+    struct io_uring_cqe *cqe;
+    ring_queue(ad, &probe);
+    if (ring_enter(r, 1, 1) < 0) {
+        ring_free(r);
+        return -1;
+    }
+    cqe = &r->cqes[*r->cq_head & *r->cq_mask];
+    int res = cqe->res;
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+    if (res < 0) {
+        ring_free(r);
+        return -1;
+    }
+    return 0;
+}
+
+/* thread pool
+ */
+static void *worker(void *arg)
+{
+    struct aio_dev *ad = arg;
+    struct blkdev_req *req;
+
+    pthread_mutex_lock(&ad->lock);
+    for (;;) {
+        while (ad->queue == NULL && !ad->stopping)
+            pthread_cond_wait(&ad->work, &ad->lock);
+        if (ad->queue == NULL)
+            break;
+        req = ad->queue;
+        if ((ad->queue = req->next) == NULL)
+            ad->queue_tail = &ad->queue;
+        pthread_mutex_unlock(&ad->lock);
+
+        int val = do_io(ad, req, 0);
+
+        pthread_mutex_lock(&ad->lock);
+        finish(ad, req, val);
+        pthread_cond_broadcast(&ad->finished);
+    }
+    pthread_mutex_unlock(&ad->lock);
+    return NULL;
+}
+
+/* The blkdev operations
+ */
+static int64_t aio_num_blocks(struct blkdev *dev)
+{
+    struct aio_dev *ad = dev->private;
+    return ad->nblks;
+}
+
+static int aio_read(struct blkdev *dev, int64_t first, int n, void *buf)
+{
+    struct aio_dev *ad = dev->private;
+    struct blkdev_req req = {.write = 0, .first_blk = first, .num_blks = n, .buf = buf};
+    int val = check_req(ad, first, n);
+    return val < 0 ? val : do_io(ad, &req, 0);
+}
+
+static int aio_write(struct blkdev *dev, int64_t first, int n, void *buf)
+{
+    struct aio_dev *ad = dev->private;
+    struct blkdev_req req = {.write = 1, .first_blk = first, .num_blks = n, .buf = buf};
+    int val = check_req(ad, first, n);
+
+    if (first == 0)
+        printf("ERROR? write to sector 0\n");
+    return val < 0 ? val : do_io(ad, &req, 0);
+}
+
+// called with the lock held
+static void aio_start(struct aio_dev *ad)
+{
+    int i;
+
+    if (getenv("AIO_NO_URING") == NULL && ring_setup(ad) == 0)
+        ad->use_uring = 1;
+    else
+        for (i = 0; i < NTHREADS; i++)
+            pthread_create(&ad->threads[i], NULL, worker, ad);
+    ad->started = 1;
+}
+
+static int aio_submit(struct blkdev *dev, struct blkdev_req **reqs, int n)
+{
+    struct aio_dev *ad = dev->private;
+    int i;
+
+    pthread_mutex_lock(&ad->lock);
+    if (!ad->started)
+        aio_start(ad);
+    for (i = 0; i < n; i++) {
+        struct blkdev_req *req = reqs[i];
+        ad->inflight++;
+        int val = check_req(ad, req->first_blk, req->num_blks);
+        if (val < 0) {
+            finish(ad, req, val);
+            continue;
+        }
+        if (ad->use_uring) {
+            /* ring full - hand over what we have and make room */
+            while (ad->inflight - ad->ndone > (int)ad->ring.entries) {
+                ring_push(ad, 1);
+                ring_reap(ad);
+            }
+            ring_queue(ad, req);
+            ad->queued++;
+        } else {
+            req->next = NULL;
+            *ad->queue_tail = req;
+            ad->queue_tail = &req->next;
+        }
+    }
+
+    int val = SUCCESS;
+    if (!ad->use_uring)
+        pthread_cond_broadcast(&ad->work);
+    else if (ad->queued && ring_push(ad, 0) < 0)
+        val = E_UNAVAIL;
+    pthread_mutex_unlock(&ad->lock);
+    return val;
+}
+
+static int aio_complete(struct blkdev *dev, struct blkdev_req **done, int min, int max)
+{
+    struct aio_dev *ad = dev->private;
+    int n;
+
+    if (min > max)
+        min = max;
+
+    pthread_mutex_lock(&ad->lock);
+    if (ad->use_uring) {
+        ring_reap(ad);
+        while (ad->ndone < min && ad->inflight > ad->ndone) {
+            ring_push(ad, 1);
+            ring_reap(ad);
+        }
+    } else
+        while (ad->ndone < min && ad->inflight > ad->ndone)
+            pthread_cond_wait(&ad->finished, &ad->lock);
+    n = pop_done(ad, done, max);
+    pthread_mutex_unlock(&ad->lock);
+    return n;
+}
+
+static int aio_flush(struct blkdev *dev, int64_t first, int64_t n)
+{
+    struct aio_dev *ad = dev->private;
+
+    if (ad->fd == -1)
+        return E_UNAVAIL;
+    return fdatasync(ad->fd) < 0 ? E_UNAVAIL : SUCCESS;
+}
+
+static void aio_close(struct blkdev *dev)
+{
+    struct aio_dev *ad = dev->private;
+    struct blkdev_req *reqs[QDEPTH];
+    int i;
+
+    /* let anything still in flight finish first */
+    while (ad->inflight > ad->ndone || ad->ndone > 0)
+        aio_complete(dev, reqs, QDEPTH, QDEPTH);
+
+    if (ad->use_uring)
+        ring_free(&ad->ring);
+    else if (ad->started) {
+        pthread_mutex_lock(&ad->lock);
+        ad->stopping = 1;
+        pthread_cond_broadcast(&ad->work);
+        pthread_mutex_unlock(&ad->lock);
+        for (i = 0; i < NTHREADS; i++)
+            pthread_join(ad->threads[i], NULL);
+    }
+    if (ad->fd != -1)
+        close(ad->fd);
+    free(ad->path);
+    free(ad);
+    dev->private = NULL;
+    free(dev);
+}
+
+struct blkdev_ops aio_ops = {
+    .num_blocks = aio_num_blocks,
+    .read = aio_read,
+    .write = aio_write,
+    .flush = aio_flush,
+    .close = aio_close,
+    .submit = aio_submit,
+    .complete = aio_complete
+};
+
+/* create an image blkdev with asynchronous requests, in blocks of
+ * 'block_size' bytes
+ */
+struct blkdev *image_aio_create(char *path, int block_size)
+{
+    struct blkdev *dev = malloc(sizeof(*dev));
+    struct aio_dev *ad = calloc(1, sizeof(*ad));
+    struct stat sb;
+
+    if (dev == NULL || ad == NULL)
+        return NULL;
+    if (block_size < BLOCK_SIZE || block_size > MAX_BLOCK_SIZE ||
+        (block_size & (block_size - 1)) != 0) {
+        fprintf(stderr, "bad block size %d for %s\n", block_size, path);
+        return NULL;
+    }
+
+    ad->path = strdup(path);
+    ad->fd = open(path, O_RDWR);
+    if (ad->fd < 0) {
+        fprintf(stderr, "can't open image %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    if (fstat(ad->fd, &sb) < 0) {
+        fprintf(stderr, "can't access image %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    if (sb.st_size % block_size != 0)
+        fprintf(stderr, "warning: file %s not a multiple of %d bytes\n",
+                path, block_size);
+    ad->bsize = block_size;
+    ad->nblks = sb.st_size / block_size;
+    ad->done_tail = &ad->done;
+    ad->queue_tail = &ad->queue;
+
+    pthread_mutex_init(&ad->lock, NULL);
+    pthread_cond_init(&ad->work, NULL);
+    pthread_cond_init(&ad->finished, NULL);
+
+    dev->private = ad;
+    dev->ops = &aio_ops;
+    dev->block_size = block_size;
+    return dev;
+}
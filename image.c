@@ -1,35 +1,43 @@
 
-#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE             /* O_DIRECT */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <errno.h>
 #include <string.h>
+#include <stdint.h>
 #include <time.h>
 
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
 
 #include "blkdev.h"
 
 struct image_dev {
     char *path;
     int   fd;
-    int   nblks;
+    int64_t nblks;
+    int   bsize;                /* block size */
+    char *map;                  /* image_mmap_create only */
+    int   tail_fd;              /* image_direct_create only: */
+    char *pool;                 /*  free aligned buffers */
+    pthread_mutex_t pool_lock;
 };
 
 
 /* The blkdev operations - num_blocks, read, write, and close.
  */
-static int image_num_blocks(struct blkdev *dev)
+static int64_t image_num_blocks(struct blkdev *dev)
 {
     struct image_dev *im = dev->private;
     return im->nblks;
 }
 
-static int image_read(struct blkdev *dev, int offset, int len, void *buf)
+static int image_read(struct blkdev *dev, int64_t offset, int len, void *buf)
 {
     struct image_dev *im = dev->private;
 
@@ -39,13 +47,13 @@ static int image_read(struct blkdev *dev, int offset, int len, void *buf)
 
     assert(offset >= 0 && offset+len <= im->nblks);
 
-    int result = pread(im->fd, buf, len*BLOCK_SIZE, offset*BLOCK_SIZE);
+    ssize_t result = pread(im->fd, buf, (size_t)len*im->bsize, (off_t)offset*im->bsize);
 
     if (result < 0) {
         fprintf(stderr, "read error on %s: %s\n", im->path, strerror(errno));
         assert(0);
     }
-    if (result != len*BLOCK_SIZE) {
+    if (result != (ssize_t)len*im->bsize) {
         fprintf(stderr, "short read on %s: %s\n", im->path, strerror(errno));
         assert(0);
     }
@@ -53,7 +61,7 @@ static int image_read(struct blkdev *dev, int offset, int len, void *buf)
     return SUCCESS;
 }
 
-static int image_write(struct blkdev * dev, int offset, int len, void *buf)
+static int image_write(struct blkdev * dev, int64_t offset, int len, void *buf)
 {
     struct image_dev *im = dev->private;
 
@@ -66,11 +74,11 @@ static int image_write(struct blkdev * dev, int offset, int len, void *buf)
 
      assert(offset >= 0 && offset+len <= im->nblks);
     
-    int result = pwrite(im->fd, buf, len*BLOCK_SIZE, offset*BLOCK_SIZE);
+    ssize_t result = pwrite(im->fd, buf, (size_t)len*im->bsize, (off_t)offset*im->bsize);
 
     /* again, report the error and then exit with an assert
      */
-    if (result != len*BLOCK_SIZE) {
+    if (result != (ssize_t)len*im->bsize) {
         fprintf(stderr, "write error on %s: %s\n", im->path, strerror(errno));
         assert(0);
     }
@@ -78,8 +86,14 @@ static int image_write(struct blkdev * dev, int offset, int len, void *buf)
     return SUCCESS;
 }
 
-static int image_flush(struct blkdev * dev, int offset, int len)
+static int image_flush(struct blkdev * dev, int64_t offset, int64_t len)
 {
+    struct image_dev *im = dev->private;
+
+    if (im->fd == -1)
+        return E_UNAVAIL;
+    if (fdatasync(im->fd) < 0 || (im->tail_fd != -1 && fdatasync(im->tail_fd) < 0))
+        return E_UNAVAIL;
     return SUCCESS;
 }
 
@@ -89,6 +103,13 @@ void image_close(struct blkdev *dev)
 
     if (im->fd != -1)
         close(im->fd);
+    if (im->tail_fd != -1)
+        close(im->tail_fd);
+    while (im->pool != NULL) {
+        char *next = *(char **)im->pool;
+        free(im->pool);
+        im->pool = next;
+    }
     free(im);
     dev->private = NULL;        /* crash any attempts to access */
     free(dev);
@@ -102,15 +123,21 @@ struct blkdev_ops image_ops = {
     .close = image_close
 };
 
-/* create an image blkdev reading from a specified image file.
+/* create an image blkdev reading from a specified image file, in
+ * blocks of 'block_size' bytes.
  */
-struct blkdev *image_create(char *path)
+struct blkdev *image_create(char *path, int block_size)
 {
     struct blkdev *dev = malloc(sizeof(*dev));
     struct image_dev *im = malloc(sizeof(*im));
 
     if (dev == NULL || im == NULL)
         return NULL;
+    if (block_size < BLOCK_SIZE || block_size > MAX_BLOCK_SIZE ||
+        (block_size & (block_size - 1)) != 0) {
+        fprintf(stderr, "bad block size %d for %s\n", block_size, path);
+        return NULL;
+    }
 
     im->path = strdup(path);    /* save a copy for error reporting */
     
@@ -129,13 +156,266 @@ struct blkdev *image_create(char *path)
      * this isn't a fatal error, as extra bytes beyond the last full
      * block will be ignored by read and write.
      */
-    if (sb.st_size % BLOCK_SIZE != 0)
+    if (sb.st_size % block_size != 0)
         fprintf(stderr, "warning: file %s not a multiple of %d bytes\n",
-                path, BLOCK_SIZE);
+                path, block_size);
     
-    im->nblks = sb.st_size / BLOCK_SIZE;
+    im->bsize = block_size;
+    im->nblks = sb.st_size / block_size;
+    im->map = NULL;
+    im->tail_fd = -1;
+    im->pool = NULL;
+    pthread_mutex_init(&im->pool_lock, NULL);
     dev->private = im;
     dev->ops = &image_ops;
+    dev->block_size = block_size;
+
+    return dev;
+}
+
+/* The same device, but accessed through a shared mapping of the image
+ * file instead of pread/pwrite. Reads and writes are memcpy, flush is
+ * msync, and 'map' lends out pointers straight into the mapping.
+ */
+static int mmap_read(struct blkdev *dev, int64_t offset, int len, void *buf)
+{
+    struct image_dev *im = dev->private;
+
+    if (im->map == NULL)
+        return E_UNAVAIL;
+
+    assert(offset >= 0 && offset+len <= im->nblks);
+    memcpy(buf, im->map + (size_t)offset*im->bsize, (size_t)len*im->bsize);
+    return SUCCESS;
+}
+
+static int mmap_write(struct blkdev *dev, int64_t offset, int len, void *buf)
+{
+    struct image_dev *im = dev->private;
+
+    if (offset == 0)
+        printf("ERROR? write to sector 0\n");
+
+    if (im->map == NULL)
+        return E_UNAVAIL;
+
+    assert(offset >= 0 && offset+len <= im->nblks);
+    memcpy(im->map + (size_t)offset*im->bsize, buf, (size_t)len*im->bsize);
+    return SUCCESS;
+}
+
+static int mmap_flush(struct blkdev *dev, int64_t offset, int64_t len)
+{
+    struct image_dev *im = dev->private;
+    long pgsz = sysconf(_SC_PAGESIZE);
+
+    if (im->map == NULL)
+        return E_UNAVAIL;
+
+    /* msync wants a page-aligned start */
+    size_t start = (size_t)offset*im->bsize / pgsz * pgsz;
+    size_t end = (size_t)(offset + len)*im->bsize;
+    if (end > (size_t)im->nblks*im->bsize)
+        end = (size_t)im->nblks*im->bsize;
+
+    if (end > start && msync(im->map + start, end - start, MS_SYNC) < 0) {
+        fprintf(stderr, "msync error on %s: %s\n", im->path, strerror(errno));
+        return E_UNAVAIL;
+    }
+    return SUCCESS;
+}
+
+static void *mmap_map(struct blkdev *dev, int64_t blk)
+{
+    struct image_dev *im = dev->private;
+
+    if (im->map == NULL || blk < 0 || blk >= im->nblks)
+        return NULL;
+    return im->map + (size_t)blk*im->bsize;
+}
+
+void mmap_close(struct blkdev *dev)
+{
+    struct image_dev *im = dev->private;
+
+    if (im->map != NULL)
+        munmap(im->map, (size_t)im->nblks*im->bsize);
+    image_close(dev);
+}
+
+struct blkdev_ops mmap_ops = {
+    .num_blocks = image_num_blocks,
+    .read = mmap_read,
+    .write = mmap_write,
+    .flush = mmap_flush,
+    .close = mmap_close,
+    .map = mmap_map
+};
+
+/* create a memory-mapped image blkdev. Falls back to NULL (with a
+ * message) if the file can't be mapped.
+ */
+struct blkdev *image_mmap_create(char *path, int block_size)
+{
+    struct blkdev *dev = image_create(path, block_size);
+
+    if (dev == NULL)
+        return NULL;
+
+    struct image_dev *im = dev->private;
+    if (im->nblks == 0) {
+        fprintf(stderr, "can't map empty image %s\n", path);
+        image_close(dev);
+        return NULL;
+    }
+    im->map = mmap(NULL, (size_t)im->nblks*im->bsize, PROT_READ | PROT_WRITE,
+                   MAP_SHARED, im->fd, 0);
+    if (im->map == MAP_FAILED) {
+        fprintf(stderr, "can't map image %s: %s\n", path, strerror(errno));
+        im->map = NULL;
+        image_close(dev);
+        return NULL;
+    }
+    dev->ops = &mmap_ops;
+
+    return dev;
+}
+
+/* O_DIRECT access, so blocks are cached only by our own buffer cache.
+ * Transfers go through a pool of aligned bounce buffers in windows of
+ * up to DIO_BUF bytes, widened to DIO_ALIGN boundaries - partial
+ * windows are read-modify-write. Any part of the image past the last
+ * DIO_ALIGN boundary (the 'tail') can't be done with O_DIRECT, and
+ * goes through a second, ordinary descriptor.
+ */
+#define DIO_ALIGN 4096
+#define DIO_BUF   (64*1024)
+
+static char *dbuf_get(struct image_dev *im)
+{
+    pthread_mutex_lock(&im->pool_lock);
+    char *buf = im->pool;
+    if (buf != NULL)
+        im->pool = *(char **)buf;
+    pthread_mutex_unlock(&im->pool_lock);
+    if (buf == NULL && posix_memalign((void **)&buf, DIO_ALIGN, DIO_BUF) != 0)
+        return NULL;
+    return buf;
+}
+
+static void dbuf_put(struct image_dev *im, char *buf)
+{
+    pthread_mutex_lock(&im->pool_lock);
+    *(char **)buf = im->pool;
+    im->pool = buf;
+    pthread_mutex_unlock(&im->pool_lock);
+}
+
+static int direct_io(struct image_dev *im, int write, int64_t offset, int len, char *buf)
+{
+    off_t start = (off_t)offset*im->bsize, end = (off_t)(offset+len)*im->bsize;
+    off_t dio_end = (off_t)im->nblks*im->bsize / DIO_ALIGN * DIO_ALIGN;
+    off_t pos = start;
+    char *dbuf = NULL;
+    ssize_t n;
+
+    if (im->fd == -1)
+        return E_UNAVAIL;
+
+    assert(offset >= 0 && offset+len <= im->nblks);
+
+    while (pos < end && pos < dio_end) {
+        off_t w_start = pos / DIO_ALIGN * DIO_ALIGN;
+        off_t w_end = (end + DIO_ALIGN - 1) / DIO_ALIGN * DIO_ALIGN;
+        if (w_end > w_start + DIO_BUF)
+            w_end = w_start + DIO_BUF;
+        if (w_end > dio_end)
+            w_end = dio_end;
+        off_t stop = (end < w_end) ? end : w_end;
+        size_t w_len = w_end - w_start;
+
+        /* aligned all round - no need to bounce */
+        if (pos == w_start && stop == w_end && (uintptr_t)(buf + (pos-start)) % DIO_ALIGN == 0) {
+            n = write ? pwrite(im->fd, buf + (pos-start), w_len, w_start) :
+                pread(im->fd, buf + (pos-start), w_len, w_start);
+            if (n != (ssize_t)w_len)
+                goto fail;
+            pos = stop;
+            continue;
+        }
+
+        if (dbuf == NULL && (dbuf = dbuf_get(im)) == NULL)
+            goto fail;
+        if (!write || pos != w_start || stop != w_end)
+            if (pread(im->fd, dbuf, w_len, w_start) != (ssize_t)w_len)
+                goto fail;
+        if (write) {
+            memcpy(dbuf + (pos-w_start), buf + (pos-start), stop - pos);
+            if (pwrite(im->fd, dbuf, w_len, w_start) != (ssize_t)w_len)
+                goto fail;
+        } else
+            memcpy(buf + (pos-start), dbuf + (pos-w_start), stop - pos);
+        pos = stop;
+    }
+
+    if (pos < end) {
+        n = write ? pwrite(im->tail_fd, buf + (pos-start), end - pos, pos) :
+            pread(im->tail_fd, buf + (pos-start), end - pos, pos);
+        if (n != end - pos)
+            goto fail;
+    }
+
+    if (dbuf != NULL)
+        dbuf_put(im, dbuf);
+    return SUCCESS;
+
+fail:
+    fprintf(stderr, "%s error on %s: %s\n", write ? "write" : "read",
+            im->path, strerror(errno));
+    assert(0);
+    return E_UNAVAIL;
+}
+
+static int direct_read(struct blkdev *dev, int64_t offset, int len, void *buf)
+{
+    return direct_io(dev->private, 0, offset, len, buf);
+}
+
+static int direct_write(struct blkdev *dev, int64_t offset, int len, void *buf)
+{
+    if (offset == 0)
+        printf("ERROR? write to sector 0\n");
+    return direct_io(dev->private, 1, offset, len, buf);
+}
+
+struct blkdev_ops direct_ops = {
+    .num_blocks = image_num_blocks,
+    .read = direct_read,
+    .write = direct_write,
+    .flush = image_flush,
+    .close = image_close
+};
+
+/* create an image blkdev using O_DIRECT. If the file system holding
+ * the image doesn't support it, this is just image_create.
+ */
+struct blkdev *image_direct_create(char *path, int block_size)
+{
+    struct blkdev *dev = image_create(path, block_size);
+
+    if (dev == NULL)
+        return NULL;
+
+    struct image_dev *im = dev->private;
+    int fd = open(path, O_RDWR | O_DIRECT);
+    if (fd < 0) {
+        fprintf(stderr, "warning: no O_DIRECT for %s (%s), using buffered I/O\n",
+                path, strerror(errno));
+        return dev;
+    }
+    im->tail_fd = im->fd;
+    im->fd = fd;
+    dev->ops = &direct_ops;
 
     return dev;
 }
@@ -147,7 +427,13 @@ void image_fail(struct blkdev *dev)
 {
     struct image_dev *im = dev->private;
 
+    if (im->map != NULL)
+        munmap(im->map, (size_t)im->nblks*im->bsize);
+    im->map = NULL;
     if (im->fd != -1)
         close(im->fd);
     im->fd = -1;
+    if (im->tail_fd != -1)
+        close(im->tail_fd);
+    im->tail_fd = -1;
 }
@@ -0,0 +1,561 @@
+/*
+ * journal.c - write-ahead metadata journal with group commit
+ *
+ * The journal is a blkdev stacked on the cache, with its log in a
+ * reserved range of blocks on the device below. The file system sends
+ * metadata (bitmaps, inodes, directory and pointer blocks) through
+ * journal_write_meta, which only copies the blocks into the running
+ * transaction; a block written many times before the next commit is
+ * kept once. Reads see those copies, and data goes straight through.
+ *
+ * Each file system operation runs between journal_begin and
+ * journal_end, and a commit waits until none are in progress, so a
+ * transaction always holds whole operations. A commit
+ *
+ *   1. flushes the device below. That makes the data written by the
+ *      operations durable, along with the home copies of the last
+ *      transaction, so the log can be reused from the start;
+ *   2. writes the transaction to the log as one sequential write:
+ *      descriptor blocks listing the home block numbers, the blocks
+ *      themselves, then a commit block with a checksum over it all;
+ *   3. flushes the log, and
+ *   4. writes the blocks to their home locations through the cache,
+ *      which gets them to disk whenever it likes - at the latest in
+ *      step 1 of the next commit.
+ *
+ * Commits happen every JOURNAL_INTERVAL seconds, when the transaction
+ * fills half the log, on flush and on close. At startup a transaction
+ * whose commit block is intact is copied to its home locations again;
+ * anything else in the log is ignored.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "blkdev.h"
+
+#define JOURNAL_INTERVAL 5      /* seconds between commits */
+
+#define J_DESC_MAGIC   0x4a444553
+#define J_COMMIT_MAGIC 0x4a434d54
+#define J_TAGS(bsize) (((bsize) - 12) / 4)     /* per descriptor block */
+
+/* log blocks are the device's block size; these are the start of one
+ */
+struct j_desc {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t count;             /* 0: the log is empty */
+    uint32_t blocks[];          /* home locations of the blocks that follow */
+};
+
+struct j_commit {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t sum;
+};
+
+struct jblk {
+    int64_t blk;                /* -1 once overwritten by data */
+    struct jblk *next;          /* hash chain */
+    char  data[];               /* a block */
+};
+
+struct journal_dev {
+    struct blkdev *lower;
+    int   bsize;                /* block size, the same as lower's */
+    int   tags;                 /* J_TAGS(bsize) */
+    int64_t start;              /* the log */
+    int   nblks;
+    int   max;                  /* most blocks a transaction can log */
+    uint32_t seq;
+
+    /* the running transaction */
+    struct jblk **blks;
+    int   n, cap;
+    struct jblk **hash;
+    int   hash_mask;
+    unsigned cleared;           /* bumped each time it's emptied */
+
+    int   handles;              /* operations in progress */
+    int   committing;
+    int   stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        /* handles, committing */
+    pthread_cond_t timer;
+    pthread_t thread;
+
+    /* flushes count commits, writes the log; a hit is a metadata
+     * block that was already in the transaction
+     */
+    struct blkdev_stats *st;
+};
+
+static int hashfn(struct journal_dev *j, int64_t blk)
+{
+    return ((uint64_t)blk * 2654435761u) & j->hash_mask;
+}
+
+static struct jblk *lookup(struct journal_dev *j, int64_t blk)
+{
+    struct jblk *b;
+    for (b = j->hash[hashfn(j, blk)]; b != NULL; b = b->next)
+        if (b->blk == blk)
+            return b;
+    return NULL;
+}
+
+static uint32_t checksum(uint32_t sum, const void *p, size_t len)
+{
+    const uint32_t *w = p;
+    size_t i;
+    for (i = 0; i < len / 4; i++)
+        sum = (sum ^ w[i]) * 16777619u;
+    return sum;
+}
+
+// blocks of log needed for 'n' blocks of metadata
+static int log_len(struct journal_dev *j, int n)
+{
+    return n + (n + j->tags - 1) / j->tags + 1;
+}
+
+// drop everything in the running transaction
+static void txn_clear(struct journal_dev *j)
+{
+    int i;
+    for (i = 0; i < j->n; i++)
+        free(j->blks[i]);
+    j->n = 0;
+    memset(j->hash, 0, (j->hash_mask + 1) * sizeof(struct jblk *));
+    j->cleared++;
+}
+
+// mark the log empty
+static int log_clear(struct journal_dev *j)
+{
+    struct j_desc *d = calloc(1, j->bsize);
+    *d = (struct j_desc) {.magic = J_DESC_MAGIC, .seq = j->seq, .count = 0};
+    int val = j->lower->ops->write(j->lower, j->start, 1, d);
+    free(d);
+    if (val < 0)
+        return val;
+    return j->lower->ops->flush(j->lower, j->start, 1);
+}
+
+/* write the running transaction to the log and then home, with
+ * j->lock held. No operations are running (and none can start) while
+ * the I/O is going on, so the transaction doesn't change underneath
+ * it; readers still use it, so it's only emptied at the end.
+ */
+static int do_commit(struct journal_dev *j)
+{
+    struct blkdev *lower = j->lower;
+    int i, m, val;
+
+    while (j->committing)       /* someone else is, just wait for it */
+        pthread_cond_wait(&j->cond, &j->lock);
+    if (j->n == 0)
+        return SUCCESS;
+    j->committing = 1;
+    blkdev_stats_flush(j->st);
+    while (j->handles > 0)
+        pthread_cond_wait(&j->cond, &j->lock);
+    pthread_mutex_unlock(&j->lock);
+
+    struct jblk **live = malloc(j->n * sizeof(*live));
+    for (i = m = 0; i < j->n; i++)
+        if (j->blks[i]->blk >= 0)
+            live[m++] = j->blks[i];
+
+    val = lower->ops->flush(lower, 0, lower->ops->num_blocks(lower));
+
+    /* a transaction too big for the log (one enormous operation) goes
+     * straight home, without the crash protection.
+     */
+    if (val >= 0 && m > 0 && m <= j->max) {
+        int len = log_len(j, m), pos = 0, bs = j->bsize;
+        char *log = calloc(len, bs);
+        for (i = 0; i < m; i++) {
+            if (i % j->tags == 0) {
+                struct j_desc *d = (void *)(log + (size_t)pos++ * bs);
+                d->magic = J_DESC_MAGIC;
+                d->seq = j->seq;
+                d->count = (m - i < j->tags) ? m - i : j->tags;
+            }
+            struct j_desc *d = (void *)(log + (size_t)(pos - 1 - i % j->tags) * bs);
+            d->blocks[i % j->tags] = live[i]->blk;
+            memcpy(log + (size_t)pos++ * bs, live[i]->data, bs);
+        }
+        struct j_commit *c = (void *)(log + (size_t)pos * bs);
+        c->magic = J_COMMIT_MAGIC;
+        c->seq = j->seq;
+        c->sum = checksum(2166136261u, log, (size_t)pos * bs);
+        val = lower->ops->write(lower, j->start, len, log);
+        blkdev_stats_io(j->st, 1, len);
+        if (val >= 0)
+            val = lower->ops->flush(lower, j->start, len);
+        free(log);
+    }
+    for (i = 0; i < m && val >= 0; i++)
+        val = lower->ops->write(lower, live[i]->blk, 1, live[i]->data);
+    if (val >= 0 && m > j->max)
+        val = lower->ops->flush(lower, 0, lower->ops->num_blocks(lower));
+    free(live);
+
+    pthread_mutex_lock(&j->lock);
+    txn_clear(j);
+    j->seq++;
+    j->committing = 0;
+    pthread_cond_broadcast(&j->cond);
+    return val;
+}
+
+// group commit every JOURNAL_INTERVAL seconds
+static void *commit_thread(void *arg)
+{
+    struct journal_dev *j = arg;
+    struct timespec ts;
+
+    pthread_mutex_lock(&j->lock);
+    while (!j->stop) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += JOURNAL_INTERVAL;
+        pthread_cond_timedwait(&j->timer, &j->lock, &ts);
+        if (!j->stop && j->n > 0)
+            do_commit(j);
+    }
+    pthread_mutex_unlock(&j->lock);
+    return NULL;
+}
+
+void journal_begin(struct blkdev *dev)
+{
+    struct journal_dev *j = dev->private;
+    pthread_mutex_lock(&j->lock);
+    while (j->committing)
+        pthread_cond_wait(&j->cond, &j->lock);
+    j->handles++;
+    pthread_mutex_unlock(&j->lock);
+}
+
+void journal_end(struct blkdev *dev)
+{
+    struct journal_dev *j = dev->private;
+    pthread_mutex_lock(&j->lock);
+    if (--j->handles == 0)
+        pthread_cond_broadcast(&j->cond);
+    if (j->n >= j->max / 2)
+        do_commit(j);
+    pthread_mutex_unlock(&j->lock);
+}
+
+// sequence number of the running transaction; earlier ones are durable
+int journal_seq(struct blkdev *dev)
+{
+    struct journal_dev *j = dev->private;
+    pthread_mutex_lock(&j->lock);
+    int seq = j->seq;
+    pthread_mutex_unlock(&j->lock);
+    return seq;
+}
+
+/* add blocks to the running transaction. Only between journal_begin
+ * and journal_end.
+ */
+int journal_write_meta(struct blkdev *dev, int64_t first, int n, void *buf)
+{
+    struct journal_dev *j = dev->private;
+    int i;
+
+    /* the log records home locations in 32 bits */
+    if (first < 0 || first + n > j->lower->ops->num_blocks(j->lower) ||
+        first + n > UINT32_MAX)
+        return E_BADADDR;
+    pthread_mutex_lock(&j->lock);
+    for (i = 0; i < n; i++) {
+        struct jblk *b = lookup(j, first + i);
+        blkdev_stats_hit(j->st, b != NULL);
+        if (b == NULL) {
+            if (j->n == j->cap) {
+                j->cap = j->cap ? j->cap * 2 : 64;
+                j->blks = realloc(j->blks, j->cap * sizeof(*j->blks));
+            }
+            b = malloc(sizeof(*b) + j->bsize);
+            b->blk = first + i;
+            b->next = j->hash[hashfn(j, b->blk)];
+            j->hash[hashfn(j, b->blk)] = b;
+            j->blks[j->n++] = b;
+        }
+        memcpy(b->data, (char *)buf + (size_t)i * j->bsize, j->bsize);
+    }
+    pthread_mutex_unlock(&j->lock);
+    return SUCCESS;
+}
+
+static int64_t journal_num_blocks(struct blkdev *dev)
+{
+    struct journal_dev *j = dev->private;
+    return j->lower->ops->num_blocks(j->lower);
+}
+
+/* read from below, then lay the transaction's copies over it. If a
+ * commit emptied the transaction meanwhile, what we read may predate
+ * the home writes, so read again.
+ */
+static int journal_read(struct blkdev *dev, int64_t first, int n, void *buf)
+{
+    struct journal_dev *j = dev->private;
+    unsigned cleared;
+    int i, val;
+
+    do {
+        pthread_mutex_lock(&j->lock);
+        cleared = j->cleared;
+        pthread_mutex_unlock(&j->lock);
+        if ((val = j->lower->ops->read(j->lower, first, n, buf)) < 0)
+            return val;
+        pthread_mutex_lock(&j->lock);
+        if (j->cleared == cleared && j->n > 0)
+            for (i = 0; i < n; i++) {
+                struct jblk *b = lookup(j, first + i);
+                if (b != NULL)
+                    memcpy((char *)buf + (size_t)i * j->bsize, b->data, j->bsize);
+            }
+        val = (j->cleared == cleared);
+        pthread_mutex_unlock(&j->lock);
+    } while (!val);
+    return SUCCESS;
+}
+
+/* file data. A block being written as data was freed as metadata, so
+ * any copy in the transaction is stale and mustn't go home. Data is
+ * written by operations, so never during a commit's I/O.
+ */
+static void forget(struct journal_dev *j, int64_t first, int n)
+{
+    int i;
+    pthread_mutex_lock(&j->lock);
+    for (i = 0; i < n && j->n > 0; i++) {
+        struct jblk *b = lookup(j, first + i), **pp;
+        if (b == NULL)
+            continue;
+        for (pp = &j->hash[hashfn(j, b->blk)]; *pp != b; pp = &(*pp)->next)
+            ;
+        *pp = b->next;
+        b->blk = -1;
+    }
+    pthread_mutex_unlock(&j->lock);
+}
+
+static int journal_write(struct blkdev *dev, int64_t first, int n, void *buf)
+{
+    struct journal_dev *j = dev->private;
+    forget(j, first, n);
+    return j->lower->ops->write(j->lower, first, n, buf);
+}
+
+static int journal_flush(struct blkdev *dev, int64_t first, int64_t n)
+{
+    struct journal_dev *j = dev->private;
+    pthread_mutex_lock(&j->lock);
+    int val = do_commit(j);
+    pthread_mutex_unlock(&j->lock);
+    if (val < 0)
+        return val;
+    return j->lower->ops->flush(j->lower, first, n);
+}
+
+static void *journal_map(struct blkdev *dev, int64_t blk)
+{
+    struct journal_dev *j = dev->private;
+    void *p = NULL;
+    pthread_mutex_lock(&j->lock);
+    if (lookup(j, blk) == NULL && j->lower->ops->map != NULL)
+        p = j->lower->ops->map(j->lower, blk);
+    pthread_mutex_unlock(&j->lock);
+    return p;
+}
+
+/* asynchronous requests are only used for file data, which never has
+ * a copy in the transaction once it's been written.
+ */
+static int journal_submit(struct blkdev *dev, struct blkdev_req **reqs, int n)
+{
+    struct journal_dev *j = dev->private;
+    int i;
+    for (i = 0; i < n; i++)
+        if (reqs[i]->write)
+            forget(j, reqs[i]->first_blk, reqs[i]->num_blks);
+    return j->lower->ops->submit(j->lower, reqs, n);
+}
+
+static int journal_complete(struct blkdev *dev, struct blkdev_req **done,
+                            int min, int max)
+{
+    struct journal_dev *j = dev->private;
+    return j->lower->ops->complete(j->lower, done, min, max);
+}
+
+// commit, write everything home and leave the log empty
+static void journal_close(struct blkdev *dev)
+{
+    struct journal_dev *j = dev->private;
+
+    pthread_mutex_lock(&j->lock);
+    j->stop = 1;
+    pthread_cond_signal(&j->timer);
+    pthread_mutex_unlock(&j->lock);
+    pthread_join(j->thread, NULL);
+
+    pthread_mutex_lock(&j->lock);
+    do_commit(j);
+    pthread_mutex_unlock(&j->lock);
+    if (j->lower->ops->flush(j->lower, 0, journal_num_blocks(dev)) >= 0)
+        log_clear(j);
+
+    j->lower->ops->close(j->lower);
+    free(j->blks);
+    free(j->hash);
+    pthread_mutex_destroy(&j->lock);
+    pthread_cond_destroy(&j->cond);
+    pthread_cond_destroy(&j->timer);
+    free(j);
+    dev->private = NULL;
+    free(dev);
+}
+
+struct blkdev_ops journal_ops = {
+    .num_blocks = journal_num_blocks,
+    .read = journal_read,
+    .write = journal_write,
+    .flush = journal_flush,
+    .close = journal_close,
+    .map = journal_map
+};
+
+struct blkdev_ops journal_async_ops = {
+    .num_blocks = journal_num_blocks,
+    .read = journal_read,
+    .write = journal_write,
+    .flush = journal_flush,
+    .close = journal_close,
+    .map = journal_map,
+    .submit = journal_submit,
+    .complete = journal_complete
+};
+
+/* copy a committed transaction left in the log to its home locations.
+ * Returns the number of blocks replayed, or an error.
+ */
+static int replay(struct journal_dev *j)
+{
+    struct blkdev *lower = j->lower;
+    size_t bs = j->bsize;
+    char *log = malloc(j->nblks * bs);
+    struct j_desc *d;
+    int pos = 0, m = 0, i, val;
+
+    if ((val = lower->ops->read(lower, j->start, j->nblks, log)) < 0)
+        goto out;
+    d = (void *)log;
+    if (d->magic != J_DESC_MAGIC)
+        goto out;               /* never used */
+    j->seq = d->seq + 1;
+    if (d->count == 0)
+        goto out;               /* empty */
+
+    /* find the commit block, checking the descriptors on the way */
+    while (pos < j->nblks) {
+        d = (void *)(log + pos * bs);
+        if (d->magic != J_DESC_MAGIC || d->seq != j->seq - 1 ||
+            d->count == 0 || d->count > j->tags ||
+            pos + 1 + d->count >= j->nblks)
+            break;
+        pos += 1 + d->count;
+        m += d->count;
+    }
+    struct j_commit *c = (void *)(log + pos * bs);
+    if (pos >= j->nblks || c->magic != J_COMMIT_MAGIC ||
+        c->seq != j->seq - 1 || c->sum != checksum(2166136261u, log, pos * bs)) {
+        m = 0;                  /* never committed */
+        goto out;
+    }
+
+    for (pos = 0; pos < j->nblks; pos += 1 + d->count) {
+        d = (void *)(log + pos * bs);
+        if (d->magic != J_DESC_MAGIC)
+            break;
+        for (i = 0; i < d->count && val >= 0; i++)
+            val = lower->ops->write(lower, d->blocks[i], 1,
+                                    log + (pos + 1 + i) * bs);
+    }
+    if (val >= 0)
+        val = lower->ops->flush(lower, 0, lower->ops->num_blocks(lower));
+    if (val >= 0)
+        val = m;
+
+out:
+    free(log);
+    return val;
+}
+
+/* whether the log at 'start' may hold a transaction to replay, i.e.
+ * the journal wasn't closed cleanly. For checkers; doesn't change it.
+ */
+int journal_dirty(struct blkdev *lower, int64_t start)
+{
+    struct j_desc *d = malloc(lower->block_size);
+    int dirty = lower->ops->read(lower, start, 1, d) >= 0 &&
+        d->magic == J_DESC_MAGIC && d->count != 0;
+    free(d);
+    return dirty;
+}
+
+/* create a journal with its log in blocks [start, start+nblks) of
+ * 'lower', first replaying whatever was committed there. Closing it
+ * closes the lower device as well.
+ */
+struct blkdev *journal_create(struct blkdev *lower, int64_t start, int nblks)
+{
+    struct blkdev *dev = malloc(sizeof(*dev));
+    struct journal_dev *j = calloc(1, sizeof(*j));
+    int nhash = 64, val;
+
+    if (dev == NULL || j == NULL || nblks < 3 ||
+        start + nblks > lower->ops->num_blocks(lower))
+        return NULL;
+
+    j->lower = lower;
+    j->bsize = lower->block_size;
+    j->tags = J_TAGS(j->bsize);
+    j->start = start;
+    j->nblks = nblks;
+    j->max = (int64_t)(nblks - 1) * j->tags / (j->tags + 1);
+    j->seq = 1;
+    while (nhash < j->max)
+        nhash <<= 1;
+    j->hash_mask = nhash - 1;
+    j->hash = calloc(nhash, sizeof(struct jblk *));
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_cond_init(&j->cond, NULL);
+    pthread_cond_init(&j->timer, NULL);
+    j->st = blkdev_stats_register("journal", j->bsize);
+
+    if ((val = replay(j)) < 0 || log_clear(j) < 0) {
+        fprintf(stderr, "journal: can't recover the log\n");
+        return NULL;
+    }
+    if (val > 0)
+        fprintf(stderr, "journal: replayed %d blocks\n", val);
+
+    dev->private = j;
+    dev->ops = (lower->ops->submit != NULL) ? &journal_async_ops : &journal_ops;
+    dev->block_size = lower->block_size;
+    pthread_create(&j->thread, NULL, commit_thread, j);
+    return dev;
+}
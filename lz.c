@@ -0,0 +1,162 @@
+/*
+ * lz.c - a small, fast LZ77 codec for compressed files
+ *
+ * The format is a series of sequences, each a token byte, literals,
+ * and a match:
+ *
+ *   token       high 4 bits: number of literals, low 4 bits: match
+ *               length - LZ_MIN_MATCH. 15 in either means more follows
+ *               as extra bytes after the token (literals) or offset
+ *               (match), each added in, until one isn't 255.
+ *   literals    copied to the output as they are
+ *   offset      2 bytes, little-endian: how far back the match starts
+ *
+ * The last sequence has literals only and ends the input. Matches are
+ * found with a single hash table of recent positions, so compressing
+ * is one pass and decompressing is little more than memcpy.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+
+static uint32_t lz_hash(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// the rest of a length that didn't fit in the token, or NULL if out of room
+static uint8_t *put_len(uint8_t *op, uint8_t *end, int n)
+{
+    for (; n >= 255; n -= 255) {
+        if (op >= end)
+            return NULL;
+        *op++ = 255;
+    }
+    if (op >= end)
+        return NULL;
+    *op++ = n;
+    return op;
+}
+
+// one sequence; 'mlen' is 0 for the last one
+static uint8_t *put_seq(uint8_t *op, uint8_t *end, const uint8_t *lit, int nlit,
+                        int offset, int mlen)
+{
+    int ml = mlen ? mlen - LZ_MIN_MATCH : 0;
+
+    if (op >= end)
+        return NULL;
+    *op++ = (nlit < 15 ? nlit : 15) << 4 | (ml < 15 ? ml : 15);
+    if (nlit >= 15 && (op = put_len(op, end, nlit - 15)) == NULL)
+        return NULL;
+    if (end - op < nlit)
+        return NULL;
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (mlen == 0)
+        return op;
+    if (end - op < 2)
+        return NULL;
+    *op++ = offset;
+    *op++ = offset >> 8;
+    if (ml >= 15 && (op = put_len(op, end, ml - 15)) == NULL)
+        return NULL;
+    return op;
+}
+
+/* compress 'n' bytes from 'src' into 'dst', which has room for 'cap'.
+ * Returns the compressed length, or 0 if it doesn't fit.
+ */
+int lz_compress(const void *src, int n, void *dst, int cap)
+{
+    const uint8_t *base = src, *ip = base, *anchor = base, *end = base + n;
+    uint8_t *op = dst, *oend = op + cap;
+    int table[1 << LZ_HASH_BITS];
+
+    memset(table, 0xff, sizeof(table));
+    while (end - ip >= LZ_MIN_MATCH) {
+        uint32_t h = lz_hash(ip);
+        int cand = table[h];
+        table[h] = ip - base;
+        if (cand < 0 || ip - base - cand > LZ_MAX_OFFSET ||
+            memcmp(base + cand, ip, LZ_MIN_MATCH) != 0) {
+            ip += 1 + ((ip - anchor) >> 6);     /* skip faster through data that won't compress */
+            continue;
+        }
+        const uint8_t *m = base + cand;
+        int len = LZ_MIN_MATCH;
+        while (ip + len < end && m[len] == ip[len])
+            len++;
+        if ((op = put_seq(op, oend, anchor, ip - anchor, ip - m, len)) == NULL)
+            return 0;
+        ip += len;
+        anchor = ip;
+    }
+    if ((op = put_seq(op, oend, anchor, end - anchor, 0, 0)) == NULL)
+        return 0;
+    return op - (uint8_t *)dst;
+}
+
+// a length continued past the token, or -1 if the input runs out
+static int get_len(const uint8_t **ip, const uint8_t *end, int n)
+{
+    int b;
+    do {
+        if (*ip >= end)
+            return -1;
+        n += (b = *(*ip)++);
+    } while (b == 255);
+    return n;
+}
+
+/* decompress 'n' bytes from 'src' into 'dst', which has room for 'cap'.
+ * Returns the decompressed length, or -1 if the input is corrupt or
+ * expands to more than 'cap'.
+ */
+int lz_decompress(const void *src, int n, void *dst, int cap)
+{
+    const uint8_t *ip = src, *end = ip + n;
+    uint8_t *op = dst, *oend = op + cap;
+
+    while (ip < end) {
+        int token = *ip++, nlit = token >> 4, mlen = token & 15;
+        if (nlit == 15 && (nlit = get_len(&ip, end, nlit)) < 0)
+            return -1;
+        if (end - ip < nlit || oend - op < nlit)
+            return -1;
+        memcpy(op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip == end)
+            break;              /* the last sequence */
+
+        if (end - ip < 2)
+            return -1;
+        int offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (mlen == 15 && (mlen = get_len(&ip, end, mlen)) < 0)
+            return -1;
+        mlen += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op - (uint8_t *)dst || oend - op < mlen)
+            return -1;
+        /* an overlapping match repeats a pattern; each copy doubles
+         * how much of it there is to copy from
+         */
+        const uint8_t *m = op - offset;
+        while (mlen > 0) {
+            int n = (op - m < mlen) ? op - m : mlen;
+            memcpy(op, m, n);
+            op += n;
+            mlen -= n;
+        }
+    }
+    return op - (uint8_t *)dst;
+}
@@ -0,0 +1,11 @@
+#ifndef __LZ_H__
+#define __LZ_H__
+
+/* LZ compression (lz.c), for compressed files. lz_compress returns the
+ * compressed length, or 0 if it won't fit in 'cap' bytes; lz_decompress
+ * returns the original length, or -1 if the input is bad.
+ */
+extern int lz_compress(const void *src, int n, void *dst, int cap);
+extern int lz_decompress(const void *src, int n, void *dst, int cap);
+
+#endif
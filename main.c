@@ -5,15 +5,19 @@
 
 #include <stdlib.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <fuse.h>
 #include <fcntl.h>
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include "fsx600.h"
 #include "blkdev.h"
+#include "lz.h"
 
 
 extern int homework_part;       /* set by '-part n' command-line option */
@@ -22,27 +26,133 @@ extern int homework_part;       /* set by '-part n' command-line option */
  * disk access - the global variable 'disk' points to a blkdev
  * structure which has been initialized to access the image file.
  *
- * NOTE - blkdev access is in terms of 1024-byte blocks
+ * NOTE - blkdev access is in terms of blk_size blocks. 'disk' is
+ * normally the buffer cache (bcache.c) stacked on the image, so
+ * writes are not durable until the device is flushed.
  */
 extern struct blkdev *disk;
 
+/* If the image has a journal (sb.journal_sz != 0), fs_init stacks it
+ * on 'disk' and metadata goes through meta_write. Every operation that
+ * changes anything runs between op_begin and op_end, which it calls
+ * before taking any inode lock and after dropping the last one.
+ */
+struct blkdev *journal;
+
+static void op_begin(void) {
+    if (journal != NULL)
+        journal_begin(journal);
+}
+
+static void op_end(void) {
+    if (journal != NULL)
+        journal_end(journal);
+}
+
+static int meta_write(int first, int n, void *buf) {
+    if (journal != NULL)
+        return journal_write_meta(journal, first, n, buf);
+    return disk->ops->write(disk, first, n, buf);
+}
+
 /* by defining bitmaps as 'fd_set' pointers, you can use existing
  * macros to handle them.
  *   FD_ISSET(##, inode_map);
  *   FD_CLR(##, block_map);
  *   FD_SET(##, block_map);
  */
-fd_set *inode_map;              /* = malloc(sb.inode_map_size * FS_BLOCK_SIZE); */
+fd_set *inode_map;              /* = malloc(sb.inode_map_size * blk_size); */
 fd_set *block_map;
 
-#define MAX_ENTRIES_DIR (FS_BLOCK_SIZE / sizeof(struct fs_dirent))
+/* The block size comes from the superblock (FS_BLKSIZE) and is always
+ * a power of two, so block arithmetic is shifts and masks.
+ */
+int blk_size = FS_BLOCK_SIZE, blk_shift = 10;
+#define BLK_MASK (blk_size - 1)
+
+#define MAX_ENTRIES_DIR (blk_size / sizeof(struct fs_dirent))
 #define MAX_LENGTH_OF_DIR_NAME 26
 #define INDIRECT_BOUND (N_DIRECT + ADDR_PER_BLOCK)
 #define SIZE_DOUBLE_INDIRECT (INDIRECT_BOUND + (ADDR_PER_BLOCK * ADDR_PER_BLOCK))
-#define ADDR_PER_BLOCK (FS_BLOCK_SIZE / sizeof(uint32_t))
+#define ADDR_PER_BLOCK (blk_size / sizeof(uint32_t))
+#define FILE_MAX_BLOCKS(inode) (((inode)->flags & FS_EXTENTS) ? INT32_MAX : SIZE_DOUBLE_INDIRECT)
 
 struct fs_inode *inodes;
+int *dirty_inode_blks;          /* inode region blocks modified in memory */
+int n_dirty_inode_blks;
+char *inode_blk_is_dirty;
 int max_num_blocks, inode_map_sz, start_block, block_map_sz, inode_block_sz, inode_reg_sz;
+int journal_sz;
+int size64;                     /* FS_FEAT_SIZE64 - see inode_size */
+int extents;                    /* FS_FEAT_EXTENTS: new files get extent maps */
+int compress_files;             /* '-compress': new files get FS_COMPRESS */
+
+/* With FS_FEAT_INLINE the inodes on disk are bigger than struct fs_inode
+ * and the rest of each one holds a small file's data. In memory the
+ * inode table stays an array of struct fs_inode, and the inline parts
+ * are kept in a table of their own; write_dirty_inodes puts them back
+ * together.
+ */
+int inodes_per_blk;
+int inline_max;                 /* bytes of data an inode can hold, or 0 */
+char *inline_data;
+#define INLINE(inum) (inline_data + (size_t) (inum) * inline_max)
+
+/* Locking - the file system runs under FUSE's multithreaded loop.
+ *
+ *   inode_locks[inum]  read/write lock per inode, covering the inode
+ *                      itself and its contents (data or entries)
+ *   alloc_lock         bitmaps, free counts and allocation cursors
+ *   itable_lock        list of dirty inode-region blocks
+ *   dcache_lock        dentry cache
+ *   ino_lock           hash of in-core inodes (struct fs_ino)
+ *
+ * Inode locks are taken directory before child: unlink and rmdir lock
+ * the parent and then the victim, and rename (which never leaves the
+ * directory) locks the parent and then the entry being renamed. Path
+ * lookup holds each directory's lock only while searching it, never
+ * while taking another, so it can't hold up that order. The mutexes
+ * are taken last and never held while waiting for another lock.
+ */
+pthread_rwlock_t *inode_locks;
+pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t itable_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t ino_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void lock_inode(int inum, int excl) {
+    if (excl)
+        pthread_rwlock_wrlock(&inode_locks[inum]);
+    else
+        pthread_rwlock_rdlock(&inode_locks[inum]);
+}
+
+static void unlock_inode(int inum) {
+    pthread_rwlock_unlock(&inode_locks[inum]);
+}
+
+/* file sizes. On a file system with FS_FEAT_SIZE64 an inode's size is
+ * size_hi:size; on an older one it is the signed 32-bit 'size' alone,
+ * and nothing can grow past 2GB.
+ */
+static off_t inode_size(struct fs_inode *inode) {
+    if (!size64)
+        return inode->size;
+    return ((off_t) inode->size_hi << 32) | (uint32_t) inode->size;
+}
+
+static int set_inode_size(struct fs_inode *inode, off_t size) {
+    if (!size64 && size > INT32_MAX)
+        return -EFBIG;
+    inode->size = (uint32_t) size;
+    if (size64)
+        inode->size_hi = size >> 32;
+    return 0;
+}
+
+void init_allocator(void);
+int dir_find(int dir_inum, const char *name, struct fs_dirent *de);
+int dir_iterate(int dir_inum, int (*fn)(struct fs_dirent *, void *), void *arg);
 
 
 /* init - this is called once by the FUSE framework at startup. Ignore
@@ -53,14 +163,50 @@ int max_num_blocks, inode_map_sz, start_block, block_map_sz, inode_block_sz, ino
  */
 void *fs_init(struct fuse_conn_info *conn) {
     struct fs_super sb;
-    if (disk->ops->read(disk, 0, 1, &sb) < 0) {
+    char *blk0 = malloc(disk->block_size);
+    if (disk->ops->read(disk, 0, 1, blk0) < 0) {
+        exit(1);
+    }
+    memcpy(&sb, blk0, sizeof(sb));
+    free(blk0);
+    if (sb.features & ~FS_FEATURES) {
+        fprintf(stderr, "unsupported file system features 0x%x\n",
+                sb.features & ~FS_FEATURES);
+        exit(1);
+    }
+    if (compress_files && !(sb.features & FS_FEAT_COMPRESS)) {
+        fprintf(stderr, "-compress: file system wasn't made with mkfs-x6 -compress\n");
+        exit(1);
+    }
+    size64 = (sb.features & FS_FEAT_SIZE64) != 0;
+    extents = (sb.features & FS_FEAT_EXTENTS) != 0;
+    if (FS_BLKSIZE(&sb) != disk->block_size) {
+        fprintf(stderr, "file system has %d-byte blocks, device has %d\n",
+                FS_BLKSIZE(&sb), disk->block_size);
+        exit(1);
+    }
+    blk_size = disk->block_size;
+    blk_shift = __builtin_ctz(blk_size);
+    int isize = FS_INODE_SIZE(&sb);
+    if (isize < sizeof(struct fs_inode) || isize > blk_size ||
+        blk_size % isize != 0) {
+        fprintf(stderr, "bad inode size %d\n", isize);
         exit(1);
     }
+    inodes_per_blk = blk_size / isize;
+    inline_max = isize - sizeof(struct fs_inode);
+
+    /* replay the journal before reading anything else */
+    if (sb.journal_sz != 0) {
+        int base = 1 + sb.inode_map_sz + sb.block_map_sz + sb.inode_region_sz;
+        if ((journal = journal_create(disk, base, sb.journal_sz)) == NULL)
+            exit(1);
+        disk = journal;
+    }
 
-    /* your code here */
     int start_blk = 1;
-    inode_map = (fd_set *) malloc(sb.inode_map_sz * FS_BLOCK_SIZE);
-    block_map = (fd_set *) malloc(sb.block_map_sz * FS_BLOCK_SIZE);
+    inode_map = (fd_set *) malloc((size_t) sb.inode_map_sz * blk_size);
+    block_map = (fd_set *) malloc((size_t) sb.block_map_sz * blk_size);
     disk->ops->read(disk, start_blk, sb.inode_map_sz, inode_map);
 
     start_blk += sb.inode_map_sz;
@@ -68,19 +214,56 @@ void *fs_init(struct fuse_conn_info *conn) {
     disk->ops->read(disk, start_blk, sb.block_map_sz, block_map);
 
     start_blk += sb.block_map_sz;
-    inodes = (struct fs_inode *) malloc(sb.inode_region_sz * FS_BLOCK_SIZE);
+    inodes = (struct fs_inode *) malloc((size_t) sb.inode_region_sz * blk_size);
     disk->ops->read(disk, start_blk, sb.inode_region_sz, inodes);
+    if (inline_max > 0) {
+        size_t n = (size_t) sb.inode_region_sz * inodes_per_blk;
+        char *raw = (char *) inodes;
+        inodes = malloc(n * sizeof(struct fs_inode));
+        inline_data = malloc(n * inline_max);
+        for (size_t i = 0; i < n; i++) {
+            memcpy(&inodes[i], raw + i * isize, sizeof(struct fs_inode));
+            memcpy(INLINE(i), raw + i * isize + sizeof(struct fs_inode), inline_max);
+        }
+        free(raw);
+    }
+    dirty_inode_blks = malloc(sb.inode_region_sz * sizeof(int));
+    inode_blk_is_dirty = calloc(sb.inode_region_sz, 1);
+    n_dirty_inode_blks = 0;
 
     /* set the global variables which will be used in various calculations */
     inode_map_sz = sb.inode_map_sz;
     block_map_sz = sb.block_map_sz;
     max_num_blocks = sb.num_blocks;
     inode_reg_sz = sb.inode_region_sz;
-    start_block = start_blk + inode_reg_sz;
+    journal_sz = sb.journal_sz;
+    start_block = start_blk + inode_reg_sz + journal_sz;
+    init_allocator();
+
+    int n_locks = inode_reg_sz * inodes_per_blk;
+    inode_locks = malloc(n_locks * sizeof(pthread_rwlock_t));
+    for (int i = 0; i < n_locks; i++)
+        pthread_rwlock_init(&inode_locks[i], NULL);
 
     return NULL;
 }
 
+/* the block size of the file system in image file 'path', from its
+ * superblock, so the image can be opened with it. If it can't tell,
+ * the default, and opening or mounting it will complain.
+ */
+int fs_image_block_size(char *path) {
+    struct fs_super sb;
+    int fd = open(path, O_RDONLY);
+    int n = (fd < 0) ? -1 : pread(fd, &sb, sizeof(sb), 0);
+
+    if (fd >= 0)
+        close(fd);
+    if (n != sizeof(sb) || sb.magic != FS_MAGIC)
+        return FS_BLOCK_SIZE;
+    return FS_BLKSIZE(&sb);
+}
+
 /* Note on path translation errors:
  * In addition to the method-specific errors listed below, almost
  * every method can return one of the following errors if it fails to
@@ -104,65 +287,139 @@ void *fs_init(struct fuse_conn_info *conn) {
  */
 
 
+/* Directory entry cache - maps (parent inum, name) to the child inum,
+ * with inum 0 recording that the name is known not to exist. It is
+ * set-associative: a name hashes to a set of DCACHE_WAYS slots, which
+ * are replaced round-robin. mknod/mkdir/unlink/rmdir/rename update it
+ * as they modify directories, so it never needs to be flushed.
+ */
+#define DCACHE_SETS 1024
+#define DCACHE_WAYS 4
+
+struct dentry {
+    int parent;                 /* 0 if the slot is unused */
+    int inum;                   /* 0 for a negative entry */
+    int isDir;
+    char name[28];
+};
+
+struct dentry dcache[DCACHE_SETS][DCACHE_WAYS];
+int dcache_victim[DCACHE_SETS];
+
+static struct dentry *dcache_set_for(int parent, const char *name) {
+    uint32_t h = 2166136261u ^ parent;
+    while (*name)
+        h = (h ^ (unsigned char) *name++) * 16777619u;
+    return dcache[h % DCACHE_SETS];
+}
+
+static struct dentry *dcache_find(int parent, const char *name) {
+    struct dentry *set = dcache_set_for(parent, name);
+    int i;
+    for (i = 0; i < DCACHE_WAYS; i++)
+        if (set[i].parent == parent && !strcmp(set[i].name, name))
+            return &set[i];
+    return NULL;
+}
+
+// add or update an entry; inum == 0 caches a negative result
+void dcache_set(int parent, const char *name, int inum, int isDir) {
+    struct dentry *de;
+
+    if (strlen(name) >= sizeof(de->name))
+        return;
+    pthread_mutex_lock(&dcache_lock);
+    if ((de = dcache_find(parent, name)) == NULL) {
+        struct dentry *set = dcache_set_for(parent, name);
+        int *victim = &dcache_victim[(set - dcache[0]) / DCACHE_WAYS];
+        de = &set[*victim];
+        *victim = (*victim + 1) % DCACHE_WAYS;
+        de->parent = parent;
+        strcpy(de->name, name);
+    }
+    de->inum = inum;
+    de->isDir = isDir;
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+/* look up 'name' in directory 'dir_inum', going to disk only if the
+ * dentry cache doesn't know the answer. The caller holds the directory
+ * locked.
+ */
+int dir_lookup(int dir_inum, const char *name, int *isDir) {
+    struct dentry *de, copy;
+
+    pthread_mutex_lock(&dcache_lock);
+    if ((de = dcache_find(dir_inum, name)) != NULL)
+        copy = *de;
+    pthread_mutex_unlock(&dcache_lock);
+
+    if (de == NULL) {
+        struct fs_dirent fd;
+        int inum = dir_find(dir_inum, name, &fd);
+        if (inum > 0 || inum == -ENOENT)    /* not I/O errors etc. */
+            dcache_set(dir_inum, name, inum > 0 ? inum : 0, inum > 0 && fd.isDir);
+        if (inum < 0)
+            return inum;
+        *isDir = fd.isDir;
+        return inum;
+    }
+
+    if (copy.inum == 0)
+        return -ENOENT;
+    *isDir = copy.isDir;
+    return copy.inum;
+}
+
+// dir_lookup for path translation, with the directory locked just for it
+static int walk_lookup(int dir_inum, const char *name, int *isDir) {
+    lock_inode(dir_inum, 0);
+    int inum = dir_lookup(dir_inum, name, isDir);
+    unlock_inode(dir_inum);
+    return inum;
+}
+
 int translate_path_to_inum(char *path) {
     int inum = 1;
     int i = 0;
 
 
-    char *token = NULL;
+    char *token = NULL, *save;
     char *tokens[64] = {NULL};
     const char delim[2] = "/";
 
     /* tokenize the string */
-    token = strtok(path, delim);
+    token = strtok_r(path, delim, &save);
     while (token) {
         tokens[i++] = token;
-        token = strtok(NULL, delim);
+        token = strtok_r(NULL, delim, &save);
     }
 
     i = 0;
-    void *block = NULL;
-
     token = tokens[i];
-    struct fs_inode temp;
-    struct fs_dirent *fd;
-    block = malloc(FS_BLOCK_SIZE);
     while (token != NULL) {
-        temp = inodes[inum];
-        disk->ops->read(disk, temp.direct[0], 1, block);
-        fd = block;
-        int j = 0;
-        for (j = 0; j < MAX_ENTRIES_DIR; j++) {
-            if (!strcmp(fd->name, token) && fd->valid) {
-                if (tokens[i + 1] != NULL && !(fd->isDir)) {
-                    free(block);
-                    return -ENOTDIR;
-                }
-                inum = fd->inode;
-                break;
-            }
-            fd++;
+        int isDir;
+        int child = walk_lookup(inum, token, &isDir);
+        if (child < 0) {
+            return child;
         }
-        if (j == MAX_ENTRIES_DIR) {
-            free(block);
-            return -ENOENT;
+        if (tokens[i + 1] != NULL && !isDir) {
+            return -ENOTDIR;
         }
+        inum = child;
         token = tokens[++i];
     }
 
-    if (block) {
-        free(block);
-    }
-
     return inum;
 }
 
 
 void fs_set_superbock_attrs(struct fs_inode *inode, struct stat *sb, int inum) {
     sb->st_ino = inum;
-    sb->st_blocks = (inode->size - 1) / FS_BLOCK_SIZE + 1;
+    sb->st_blocks = (inode->flags & FS_INLINE) ? 0 :
+        ((inode_size(inode) - 1) >> blk_shift) + 1;
     sb->st_mode = inode->mode;
-    sb->st_size = inode->size;
+    sb->st_size = inode_size(inode);
     sb->st_uid = inode->uid;
     sb->st_gid = inode->gid;
     // st_atime, st_ctime not set, so now setting to same as  st_mtime
@@ -190,11 +447,29 @@ static int fs_getattr(const char *path, struct stat *sb) {
         return inum;
     }
 
+    lock_inode(inum, 0);
     struct fs_inode inode = inodes[inum];
+    unlock_inode(inum);
     fs_set_superbock_attrs(&inode, sb, inum);
     return 0;
 }
 
+struct readdir_args {
+    void *ptr;
+    fuse_fill_dir_t filler;
+};
+
+static int readdir_fill(struct fs_dirent *fd, void *arg) {
+    struct readdir_args *args = arg;
+    struct stat sb;
+
+    memset(&sb, 0, sizeof(sb));
+    lock_inode(fd->inode, 0);
+    fs_set_superbock_attrs(&inodes[fd->inode], &sb, fd->inode);
+    unlock_inode(fd->inode);
+    return args->filler(args->ptr, fd->name, &sb, 0);
+}
+
 /* readdir - get directory contents.
  *
  * for each entry in the directory, invoke the 'filler' function,
@@ -213,30 +488,15 @@ static int fs_readdir(const char *path, void *ptr, fuse_fill_dir_t filler,
         return ret;
     }
 
-    struct fs_inode inode = inodes[sb.st_ino];
     // checking if the inode a directory or not
-    if (!S_ISDIR(inode.mode)) {
+    if (!S_ISDIR(sb.st_mode)) {
         return -ENOTDIR;
     }
 
-    void *block = malloc(FS_BLOCK_SIZE);
-    disk->ops->read(disk, inode.direct[0], 1, block);
-    struct fs_dirent *fd = block;
-
-    int i;
-    for (i = 0; i < MAX_ENTRIES_DIR; i++) {
-        if (fd->valid) {
-            memset(&sb, 0, sizeof(sb));
-            inode = inodes[fd->inode];
-            fs_set_superbock_attrs(&inode, &sb, fd->inode);
-            filler(ptr, fd->name, &sb, 0);
-        }
-        fd++;
-    }
-
-    if (block) {
-        free(block);
-    }
+    struct readdir_args args = {.ptr = ptr, .filler = filler};
+    lock_inode(sb.st_ino, 0);
+    dir_iterate(sb.st_ino, readdir_fill, &args);
+    unlock_inode(sb.st_ino);
     return 0;
 }
 
@@ -258,41 +518,25 @@ static int fs_releasedir(const char *path, struct fuse_file_info *fi) {
  *          "/a/b" must exist, and "/a/b/c" must not.
  *
  * If a file or directory of this name already exists, return -EEXIST.
- * If this would result in >32 entries in a directory, return -ENOSPC
+ * If the directory can't grow any further, return -ENOSPC
  * if !S_ISREG(mode) return -EINVAL [i.e. 'mode' specifies a device special
  * file or other non-file object]
  */
 
-char *get_last_of_split(char *path) {
-
-    char *token = NULL;
-    char *tokens[64] = {NULL};
-    int i = 0;
-    /* tokenize the string */
-    token = strtok(path, "/");
-    while (token) {
-        tokens[i++] = token;
-        token = strtok(NULL, "/");
-    }
-
-    return tokens[--i];
-}
-
 // given the complete path, traverse it, find last file/dir and get its
 // inum if exists.
 int get_parent_inum(char *path, char *str) {
     int inum = 1;
     int i = 0;
     const char delim[2] = "/";
-    void *block = NULL;
-    char *token = NULL;
+    char *token = NULL, *save;
     char *tokens[64] = {NULL};
 
     /* tokenize the string */
-    token = strtok(path, delim);
+    token = strtok_r(path, delim, &save);
     while (token) {
         tokens[i++] = token;
-        token = strtok(NULL, delim);
+        token = strtok_r(NULL, delim, &save);
     }
 
     /* copy last token to str */
@@ -306,462 +550,1547 @@ int get_parent_inum(char *path, char *str) {
 
     i = 0;
     token = tokens[i];
-    struct fs_inode temp;
-    struct fs_dirent *fd;
-    block = malloc(FS_BLOCK_SIZE);
     while (tokens[i + 1] != NULL) {
-        temp = inodes[inum];
-        disk->ops->read(disk, temp.direct[0], 1, block);
-        fd = block;
-        int j = 0;
-        for (j = 0; j < MAX_ENTRIES_DIR; j++) {
-            if (!strcmp(fd->name, token) && fd->valid) {
-                if (tokens[i + 1] != NULL && !(fd->isDir)) {
-                    free(block);
-                    // return not a dir
-                    return -ENOTDIR;
-                }
-                inum = fd->inode;
-                break;
-            }
-            fd++;
-        }
-        if (j == MAX_ENTRIES_DIR) {
-            free(block);
+        int isDir;
+        int child = walk_lookup(inum, token, &isDir);
+        if (child < 0) {
             // return no entry
-            return -ENOENT;
+            return child;
         }
+        if (!isDir) {
+            // return not a dir
+            return -ENOTDIR;
+        }
+        inum = child;
         token = tokens[++i];
     }
 
-    if (block) {
-        free(block);
-    }
-
     // return inum
     return inum;
 }
 
 // write the complete inode map to disk
 void write_inode_map() {
-    disk->ops->write(disk, 1, inode_map_sz, inode_map);
+    pthread_mutex_lock(&alloc_lock);
+    meta_write(1, inode_map_sz, inode_map);
+    pthread_mutex_unlock(&alloc_lock);
 }
 
-// free a given block
-void free_a_block(int bit) {
-    if (bit >= start_block) {
-        FD_CLR(bit, block_map);
-    }
+/* Allocator. Both bitmaps are scanned 64 bits at a time: a word with
+ * no zero bits is skipped outright (four at a time on long full runs,
+ * which the compiler turns into vector compares), and the first free
+ * bit of a word is found with count-trailing-zeros. Each map has a
+ * next-fit cursor so successive allocations don't rescan the full
+ * prefix, and the number of free blocks/inodes is kept up to date so
+ * that statfs doesn't have to count bits.
+ */
+int num_inodes;                 /* inodes covered by both map and table */
+int free_blocks, free_inodes;
+int block_cursor, inode_cursor;
+char *block_map_dirty;          /* one flag per block of the block map */
+
+#define BITS_PER_BLOCK (blk_size * 8)
+
+// first clear bit in [lo, hi), or -1
+static int bitmap_scan(fd_set *map, int lo, int hi) {
+    uint64_t *words = (uint64_t *) map;
+    int w = lo / 64, last = (hi - 1) / 64;
+    uint64_t free_bits;
+
+    if (lo >= hi)
+        return -1;
+    free_bits = ~words[w] & (~0ULL << (lo % 64));
+    while (!free_bits) {
+        if (++w > last)
+            return -1;
+        while (w + 4 <= last &&
+               (words[w] & words[w + 1] & words[w + 2] & words[w + 3]) == ~0ULL)
+            w += 4;
+        free_bits = ~words[w];
+    }
+    int bit = w * 64 + __builtin_ctzll(free_bits);
+    return bit < hi ? bit : -1;
 }
 
-// find and return a free block
-int get_free_block() {
-    int i = 0;
-    for (i = start_block; i < max_num_blocks; i++) {
-        if (!FD_ISSET(i, block_map)) {
-            FD_SET(i, block_map);
-            return i;
-        }
-    }
-    return -ENOSPC;
+// number of clear bits in [lo, hi)
+static int bitmap_count_free(fd_set *map, int lo, int hi) {
+    int i, n = 0;
+    for (i = lo; i < hi && i % 64 != 0; i++)
+        n += !FD_ISSET(i, map);
+    for (; i + 64 <= hi; i += 64)
+        n += 64 - __builtin_popcountll(((uint64_t *) map)[i / 64]);
+    for (; i < hi; i++)
+        n += !FD_ISSET(i, map);
+    return n;
 }
 
-// find and return a free inode
-int get_free_inode() {
-    int i = 0;
-    while (i < 64) {
-        if (!FD_ISSET(i, inode_map)) {
-            FD_SET(i, inode_map);
-            return i;
-        }
-        i++;
+// length of the run of clear bits starting at 'lo', up to 'max' or 'hi'
+static int bitmap_run_len(fd_set *map, int lo, int hi, int max) {
+    uint64_t *words = (uint64_t *) map;
+    int i = lo;
+
+    while (i < hi && i - lo < max) {
+        uint64_t used = words[i / 64] >> (i % 64);
+        if (used & 1)
+            break;
+        i += used ? __builtin_ctzll(used) : 64 - i % 64;
     }
-    return -ENOSPC;
+    if (i > hi)
+        i = hi;
+    return (i - lo < max) ? i - lo : max;
 }
 
-// write the complete contents to disk
-void write_block_map() {
-    disk->ops->write(disk, 1 + inode_map_sz, block_map_sz, block_map);
+// next-fit search of [lo, hi) starting at *cursor, wrapping around
+static int bitmap_alloc(fd_set *map, int lo, int hi, int *cursor) {
+    int start = (*cursor >= lo && *cursor < hi) ? *cursor : lo;
+    int bit = bitmap_scan(map, start, hi);
+    if (bit < 0)
+        bit = bitmap_scan(map, lo, start);
+    if (bit < 0)
+        return -ENOSPC;
+    FD_SET(bit, map);
+    *cursor = bit + 1;
+    return bit;
 }
 
-// write all the inodes to the disk
-void write_all_inodes() {
-    disk->ops->write(disk, (1 + inode_map_sz + block_map_sz), inode_reg_sz, inodes);
+// set up the allocator state once the bitmaps have been read
+void init_allocator(void) {
+    num_inodes = inode_reg_sz * inodes_per_blk;
+    if (num_inodes > inode_map_sz * BITS_PER_BLOCK)
+        num_inodes = inode_map_sz * BITS_PER_BLOCK;
+    free_blocks = bitmap_count_free(block_map, start_block, max_num_blocks);
+    free_inodes = bitmap_count_free(inode_map, 1, num_inodes);
+    block_cursor = start_block;
+    inode_cursor = 1;
+    block_map_dirty = calloc(block_map_sz, 1);
 }
 
-static int fs_mknod(const char *path, mode_t mode, dev_t dev) {
-    char dir_name[MAX_LENGTH_OF_DIR_NAME];
-
-    /* get the child inode number */
-    char *_path = strdupa(path);
-    int child_inum = translate_path_to_inum(_path);
-
-    /* get the parent inode number */
-    _path = strdupa(path);
-    int parent_inum = get_parent_inum(_path, dir_name);
+/* With a journal, a freed block stays allocated until the transaction
+ * that freed it has committed. Otherwise it could be reused for data,
+ * which goes straight to disk, while the metadata on disk still says
+ * it's a directory or pointer block. If we crash before it's released
+ * the block is just leaked.
+ */
+struct freed_blk {
+    int blk;
+    int seq;                    /* transaction that freed it */
+} *freed;
+int n_freed, freed_cap;
+
+// with alloc_lock held: release the blocks freed before transaction 'seq'
+static void release_freed(int seq) {
+    int i, j;
+    for (i = 0; i < n_freed && freed[i].seq < seq; i++) {
+        FD_CLR(freed[i].blk, block_map);
+        block_map_dirty[freed[i].blk / BITS_PER_BLOCK] = 1;
+        free_blocks++;
+    }
+    for (j = 0; i < n_freed; )
+        freed[j++] = freed[i++];
+    n_freed = j;
+}
 
-    /* If parent path contains invalid files other than directories
-     * or the parent path is not present
-     */
-    if (parent_inum == -ENOTDIR || parent_inum == -ENOENT) {
-        return parent_inum;
+// free a given block
+void free_a_block(int bit) {
+    pthread_mutex_lock(&alloc_lock);
+    if (bit >= start_block && bit < max_num_blocks && FD_ISSET(bit, block_map)) {
+        if (journal != NULL) {
+            if (n_freed == freed_cap) {
+                freed_cap = freed_cap ? freed_cap * 2 : 256;
+                freed = realloc(freed, freed_cap * sizeof(*freed));
+            }
+            freed[n_freed++] = (struct freed_blk) {bit, journal_seq(journal)};
+        } else {
+            FD_CLR(bit, block_map);
+            block_map_dirty[bit / BITS_PER_BLOCK] = 1;
+            free_blocks++;
+        }
     }
+    pthread_mutex_unlock(&alloc_lock);
+}
 
-    /* If parent is not a directory */
-    struct fs_inode p_inode = inodes[parent_inum];
-    if (!S_ISDIR(p_inode.mode)) {
-        return -ENOTDIR;
-    }
+// find and return a free block
+int get_free_block() {
+    pthread_mutex_lock(&alloc_lock);
+    if (n_freed > 0)
+        release_freed(journal_seq(journal));
+    int blk = bitmap_alloc(block_map, start_block, max_num_blocks, &block_cursor);
+    if (blk >= 0) {
+        block_map_dirty[blk / BITS_PER_BLOCK] = 1;
+        free_blocks--;
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    return blk;
+}
 
-    /* If a file already exists with the given name */
-    if (child_inum > 0) {
-        return -EEXIST;
+// look for a run of 'want' free blocks in [lo, hi); remember the longest
+// one seen in *best/*best_len. Gives up after a bounded number of
+// candidate runs so a fragmented map can't make a write scan forever.
+static void find_free_run(int lo, int hi, int want, int *best, int *best_len) {
+    int tries = 64;
+    while (*best_len < want && tries-- > 0) {
+        int blk = bitmap_scan(block_map, lo, hi);
+        if (blk < 0)
+            break;
+        int n = bitmap_run_len(block_map, blk, hi, want);
+        if (n > *best_len) {
+            *best = blk;
+            *best_len = n;
+        }
+        lo = blk + n;
     }
+}
 
-    int new_inum = get_free_inode();
-    /* If the inode_bitmap is full and no free inode available */
-    if (new_inum == -ENOSPC) {
+// allocate up to 'want' physically contiguous blocks, preferably
+// starting at 'goal' (e.g. right after the file's last block). The
+// first block is returned in *first; the return value is the number of
+// blocks allocated, which may be fewer than asked for, or -ENOSPC.
+int get_free_blocks(int want, int goal, int *first) {
+    int i, best = -1, best_len = 0;
+
+    pthread_mutex_lock(&alloc_lock);
+    if (n_freed > 0)
+        release_freed(journal_seq(journal));
+    if (goal < start_block || goal >= max_num_blocks)
+        goal = block_cursor;
+    if (goal < start_block || goal >= max_num_blocks)
+        goal = start_block;
+
+    if (free_blocks > 0)
+        find_free_run(goal, max_num_blocks, want, &best, &best_len);
+    if (free_blocks > 0 && best_len < want)
+        find_free_run(start_block, goal, want, &best, &best_len);
+    if (best_len == 0) {
+        pthread_mutex_unlock(&alloc_lock);
         return -ENOSPC;
     }
 
-    void *block = malloc(FS_BLOCK_SIZE);
-    disk->ops->read(disk, p_inode.direct[0], 1, block);
-    struct fs_dirent *dirent_parent = block;
-    struct fs_inode new_inode = inodes[new_inum];
+    for (i = best; i < best + best_len; i++) {
+        FD_SET(i, block_map);
+        block_map_dirty[i / BITS_PER_BLOCK] = 1;
+    }
+    free_blocks -= best_len;
+    block_cursor = best + best_len;
+    *first = best;
+    pthread_mutex_unlock(&alloc_lock);
+    return best_len;
+}
 
-    int i = 0;
-    for (i = 0; i < MAX_ENTRIES_DIR; i++) {
-        if (!dirent_parent->valid) {
-            memset(dirent_parent, 0, sizeof(struct fs_dirent));
-            strncpy(dirent_parent->name, dir_name, strlen(dir_name));
-            dirent_parent->valid = 1;
-            dirent_parent->isDir = S_ISDIR(mode);
-            dirent_parent->inode = new_inum;
-
-            /* create inode, write to disk and update in-memory ds */
-
-            struct fuse_context *context = fuse_get_context();
-            int i = 0;
-            time_t mytime;
-            mytime = time(NULL);
-
-            new_inode.mode = mode;
-            new_inode.uid = context->uid;
-            new_inode.gid = context->gid;
-
-            new_inode.ctime = mytime;
-            new_inode.mtime = mytime;
-            new_inode.size = 0;
-            for (; i < 6; i++)
-                new_inode.direct[i] = 0;
-            new_inode.indir_1 = 0;
-            new_inode.indir_2 = 0;
-
-            if (S_ISDIR(mode)) {
-                int block_num = get_free_block();
-                if (block_num == -ENOSPC) {
-                    FD_CLR(new_inum, inode_map);
-                    write_inode_map();
-                    if (block) {
-                        free(block);
-                    }
-                    return -ENOSPC;
-                }
-                new_inode.direct[0] = block_num;
-                write_block_map();
-
-                /* create empty block for direct[0] and write to disk */
-                /* block number is same as obtained above */
-                void *block_dir = malloc(FS_BLOCK_SIZE);
-                memset(block_dir, 0, FS_BLOCK_SIZE);
-                disk->ops->write(disk, block_num, 1, block_dir);
-                free(block_dir);
-            }
+// free a given inode
+void free_an_inode(int inum) {
+    pthread_mutex_lock(&alloc_lock);
+    if (inum > 0 && inum < num_inodes && FD_ISSET(inum, inode_map)) {
+        FD_CLR(inum, inode_map);
+        free_inodes++;
+    }
+    pthread_mutex_unlock(&alloc_lock);
+}
 
-            /* write inode_map to disk */
-            write_inode_map();
+// find and return a free inode
+int get_free_inode() {
+    pthread_mutex_lock(&alloc_lock);
+    int inum = bitmap_alloc(inode_map, 1, num_inodes, &inode_cursor);
+    if (inum >= 0)
+        free_inodes--;
+    pthread_mutex_unlock(&alloc_lock);
+    return inum;
+}
 
-            /* write inode_region to disk */
-            inodes[new_inum] = new_inode;
-            write_all_inodes();
+// write the modified parts of the block map to disk
+void write_block_map() {
+    int i, j;
+    pthread_mutex_lock(&alloc_lock);
+    for (i = 0; i < block_map_sz; i = j) {
+        for (j = i; j < block_map_sz && block_map_dirty[j]; j++)
+            block_map_dirty[j] = 0;
+        if (j > i)
+            meta_write(1 + inode_map_sz + i, j - i,
+                             (char *) block_map + i * blk_size);
+        else
+            j++;
+    }
+    pthread_mutex_unlock(&alloc_lock);
+}
 
-            /* write the parent directory to disk */
-            disk->ops->write(disk, p_inode.direct[0], 1, block);
-            break;
-        }
-        dirent_parent++;
+// note that inode 'inum' was changed in memory; the block holding it
+// goes out with the next write_dirty_inodes()
+void mark_inode_dirty(int inum) {
+    int blk = inum / inodes_per_blk;
+    pthread_mutex_lock(&itable_lock);
+    if (!inode_blk_is_dirty[blk]) {
+        inode_blk_is_dirty[blk] = 1;
+        dirty_inode_blks[n_dirty_inode_blks++] = blk;
     }
+    pthread_mutex_unlock(&itable_lock);
+}
 
-    /* Incase directory already contains 32 entries, return
-     * ENOSPC error after clearing the newly allocated bit
-     * in inode bitmap.
-     */
-    if (i == MAX_ENTRIES_DIR) {
-        if (block) {
-            free(block);
-        }
-        if (FD_ISSET(new_inum, inode_map)) {
-            FD_CLR(new_inum, inode_map);
-            write_inode_map();
-        }
-        return -ENOSPC;
-    }
+static int cmp_int(const void *a, const void *b) {
+    return *(int *) a - *(int *) b;
+}
 
-    /* Free the allocated memory blocks */
-    if (block) {
-        free(block);
+// the on-disk form of inode region blocks [blk, blk+n) - see inline_max
+static void *inode_blocks(int blk, int n) {
+    int isize = sizeof(struct fs_inode) + inline_max;
+    int i, inum = blk * inodes_per_blk;
+    char *buf;
+
+    if (inline_max == 0)
+        return (char *) inodes + blk * blk_size;
+    buf = malloc(n * blk_size);
+    for (i = 0; i < n * inodes_per_blk; i++, inum++) {
+        memcpy(buf + i * isize, &inodes[inum], sizeof(struct fs_inode));
+        memcpy(buf + i * isize + sizeof(struct fs_inode), INLINE(inum), inline_max);
     }
+    return buf;
+}
 
-    return 0;
+// write only the modified blocks of the inode region to disk, merging
+// adjacent ones into a single write. Called once per operation. A block
+// can go out while another thread is changing a different inode in it;
+// that thread marks the block dirty again when it's done, so its final
+// state is written too.
+void write_dirty_inodes() {
+    int i, j, base = 1 + inode_map_sz + block_map_sz;
+
+    pthread_mutex_lock(&itable_lock);
+    qsort(dirty_inode_blks, n_dirty_inode_blks, sizeof(int), cmp_int);
+    for (i = 0; i < n_dirty_inode_blks; i = j) {
+        for (j = i + 1; j < n_dirty_inode_blks &&
+                        dirty_inode_blks[j] == dirty_inode_blks[j - 1] + 1; j++)
+            ;
+        void *buf = inode_blocks(dirty_inode_blks[i], j - i);
+        meta_write(base + dirty_inode_blks[i], j - i, buf);
+        if (inline_max > 0)
+            free(buf);
+    }
+    for (i = 0; i < n_dirty_inode_blks; i++)
+        inode_blk_is_dirty[dirty_inode_blks[i]] = 0;
+    n_dirty_inode_blks = 0;
+    pthread_mutex_unlock(&itable_lock);
 }
 
-/* mkdir - create a directory with the given mode.
- * Errors - path resolution, EEXIST
- * Conditions for EEXIST are the same as for create.
- * If this would result in >32 entries in a directory, return -ENOSPC
- *
- * Note that you may want to combine the logic of fs_mknod and
- * fs_mkdir.
+/* read-only access to block 'blk': a pointer into the device's own
+ * copy if it will lend us one (see image_mmap_create), otherwise the
+ * block is read into 'buf'. Only good until the block is next written.
  */
-static int fs_mkdir(const char *path, mode_t mode) {
-    mode = mode | S_IFDIR;
-    int ret = fs_mknod(path, mode, 0);
-    return ret;
+static const void *get_block(int blk, void *buf) {
+    void *p;
+    if (disk->ops->map != NULL && (p = disk->ops->map(disk, blk)) != NULL)
+        return p;
+    disk->ops->read(disk, blk, 1, buf);
+    return buf;
 }
 
-/* truncate - truncate file to exactly 'len' bytes
- * Errors - path resolution, ENOENT, EISDIR, EINVAL
- *    return EINVAL if len > 0.
+/* Extent-mapped files (FS_EXTENTS - see fsx600.h). Regular files on a
+ * file system with FS_FEAT_EXTENTS use these; directories keep the
+ * pointer map. A block is added either by growing the extent that
+ * ends just before it, when it follows on in the file and on disk, or
+ * as a new one-block extent, so a file written in contiguous runs is
+ * described by a handful of extents. A full node is split in half and
+ * its parent gets an entry for the new half; when the root in the
+ * inode is full it moves out to a block and the tree gets a level
+ * deeper. The first entry of a node stands for everything below the
+ * second one, so its 'lblk' is never adjusted when something smaller
+ * is inserted.
  */
-static int fs_truncate(const char *path, off_t len) {
-    /* you can cheat by only implementing this for the case of len==0,
-     * and an error otherwise.
-     */
-    if (len != 0)
-        return -EINVAL;        /* invalid argument */
-    int total_direct_blocks = 6;
-    struct stat sb;
-    int ret = fs_getattr(path, &sb);
+#define EXT_MAX_DEPTH 4
 
-    // checking for path translation and errors
-    if (ret == -ENOENT || ret == -ENOTDIR) {
-        return ret;
-    }
+void ext_init(struct fs_inode *inode) {
+    memset(&inode->eh, 0, sizeof(inode->eh) + sizeof(inode->ext));
+    inode->eh = (struct fs_extent_hdr) {.magic = FS_EXT_MAGIC, .max = FS_EXT_INODE};
+    inode->flags |= FS_EXTENTS;
+}
+
+/* change an inode's inline data (zero it if buf is NULL). The caller
+ * has the inode locked, but write_dirty_inodes may be copying out
+ * another inode in the same block, so this is done under itable_lock.
+ */
+static void inline_set(int inum, int offset, const void *buf, int len) {
+    pthread_mutex_lock(&itable_lock);
+    if (buf != NULL)
+        memcpy(INLINE(inum) + offset, buf, len);
+    else
+        memset(INLINE(inum) + offset, 0, len);
+    pthread_mutex_unlock(&itable_lock);
+}
 
+// an empty file with its data in the inode (FS_FEAT_INLINE)
+void inline_init(struct fs_inode *inode, int inum) {
+    memset(&inode->eh, 0, sizeof(inode->eh) + sizeof(inode->ext));
+    inode->flags = (inode->flags & ~FS_EXTENTS) | FS_INLINE;
+    inline_set(inum, 0, NULL, inline_max);
+}
 
-    struct fs_inode inode = inodes[sb.st_ino];
+// the entry covering file block 'idx': the last one at or before it, or 0
+static int ext_search(const struct fs_extent_hdr *h, const struct fs_extent *e,
+                      uint32_t idx) {
+    int lo = 0, hi = h->count - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (e[mid].lblk <= idx)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
 
-    // now checking if its a directory and not a file
+// the extent holding file block 'idx' in *ext, or 0 if it's a hole
+int ext_lookup(struct fs_inode *inode, int idx, struct fs_extent *ext) {
+    char buf[blk_size];
+    const struct fs_extent_hdr *h = &inode->eh;
+    const struct fs_extent *e = inode->ext;
+    int i;
 
-    if (S_ISDIR(inode.mode)) {
-        return -EISDIR;
+    for (;;) {
+        if (h->count == 0)
+            return 0;
+        i = ext_search(h, e, idx);
+        int depth = h->depth;   /* h may be in buf */
+        if (depth == 0)
+            break;
+        const struct fs_extent_node *node = get_block(e[i].pblk, buf);
+        if (node->hdr.magic != FS_EXT_MAGIC || node->hdr.depth != depth - 1)
+            return 0;
+        h = &node->hdr;
+        e = node->e;
     }
-    int address_per_block = (FS_BLOCK_SIZE / sizeof(uint32_t));
-    int *blocks = NULL;
-    void *indirect_block_1 = malloc(FS_BLOCK_SIZE);
-
+    if ((uint32_t) idx - e[i].lblk >= e[i].len)
+        return 0;
+    *ext = e[i];
+    return 1;
+}
 
-    // free the direct blocks first
+/* the nodes from the root (level 0, a copy of the one in the inode)
+ * down, each a block in 'mem', with one more block spare for a split
+ */
+struct ext_path {
+    int blk[EXT_MAX_DEPTH + 1];
+    int pos[EXT_MAX_DEPTH + 1];
+    struct fs_extent_node *node[EXT_MAX_DEPTH + 1];
+    char *mem;
+};
 
-    int i = 0;
-    for (i = 0; i < total_direct_blocks; i++) {
+static void ext_put(struct fs_inode *inode, struct ext_path *p, int level) {
+    if (level > 0) {
+        meta_write(p->blk[level], 1, p->node[level]);
+        return;
+    }
+    inode->eh = p->node[0]->hdr;
+    memcpy(inode->ext, p->node[0]->e, sizeof(inode->ext));
+}
 
-        if (!inode.direct[i]) {
+/* map file block 'idx' to disk block 'blk'; it must be a hole. New
+ * tree blocks are allocated before anything changes, so running out
+ * of space leaves the tree as it was. The caller writes the inode.
+ */
+int ext_insert(struct fs_inode *inode, int idx, int blk) {
+    struct ext_path p;
+    int depth = inode->eh.depth, level, pos, need, i, ret = 0;
+    int new_blks[EXT_MAX_DEPTH + 1];
+
+    p.mem = calloc(EXT_MAX_DEPTH + 2, blk_size);
+    for (i = 0; i <= EXT_MAX_DEPTH; i++)
+        p.node[i] = (struct fs_extent_node *) (p.mem + i * blk_size);
+    struct fs_extent_node *right = (struct fs_extent_node *) (p.mem + i * blk_size);
+    p.node[0]->hdr = inode->eh;
+    memcpy(p.node[0]->e, inode->ext, sizeof(inode->ext));
+    for (level = 0; ; level++) {
+        struct fs_extent_node *n = p.node[level];
+        p.pos[level] = ext_search(&n->hdr, n->e, idx);
+        if (level == depth)
             break;
-        }
-        inode.direct[i] = 0;
-        free_a_block(inode.direct[i]);
+        p.blk[level + 1] = n->e[p.pos[level]].pblk;
+        disk->ops->read(disk, p.blk[level + 1], 1, p.node[level + 1]);
     }
 
-    // now to free the indirect blocks
-    if (inode.indir_1 >= start_block) {
-        disk->ops->read(disk, inode.indir_1, 1, indirect_block_1);
-        blocks = indirect_block_1;
-        for (i = 0; i < address_per_block; i++) {
-            if (!*blocks) {
-                break;
-            }
-            free_a_block(*blocks);
-            blocks++;
+    struct fs_extent_node *leaf = p.node[depth];
+    struct fs_extent *e = &leaf->e[p.pos[depth]];
+    pos = p.pos[depth];
+    if (leaf->hdr.count > 0 && e->lblk <= idx) {
+        if (idx - e->lblk < e->len) {
+            ret = -EEXIST;
+            goto out;
+        }
+        if (e->lblk + e->len == idx && e->pblk + e->len == blk) {
+            e->len++;
+            ext_put(inode, &p, depth);
+            goto out;
         }
+        pos++;
     }
 
-    // now freeing 2nd indirect blocks.
-    void *indirect_block_2 = malloc(FS_BLOCK_SIZE);
-    if (inode.indir_2 >= start_block) {
-        disk->ops->read(disk, inode.indir_2, 1, indirect_block_2);
-        blocks = indirect_block_2;
-        for (i = 0; i < address_per_block; i++) {
-
-            if (!*blocks) {
-                break;
-            }
+    /* every full node on the way up splits, and a full root moves out */
+    for (need = 0, level = depth; level >= 0; level--, need++)
+        if (p.node[level]->hdr.count < p.node[level]->hdr.max)
+            break;
+    if (level < 0 && depth == EXT_MAX_DEPTH) {
+        ret = -EFBIG;
+        goto out;
+    }
+    for (i = 0; i < need; i++)
+        if ((new_blks[i] = get_free_block()) < 0) {
+            while (i-- > 0)
+                free_a_block(new_blks[i]);
+            ret = -ENOSPC;
+            goto out;
+        }
 
-            if (*blocks >= start_block) {
-                disk->ops->read(disk, *blocks, 1, indirect_block_1);
-                int j = 0;
-                int *innerloop = indirect_block_1;
-                for (j = 0; j < address_per_block; j++) {
-                    if (!*innerloop)
-                        break;
-                    free_a_block(*innerloop);
-                    innerloop++;
-                }
-                free_a_block(*blocks);
-                blocks++;
+    if (level < 0) {
+        /* the root's contents become node 1, and a new root points at it */
+        struct fs_extent_node *top = p.node[depth + 1];
+        for (level = depth; level > 0; level--) {
+            p.node[level + 1] = p.node[level];
+            p.blk[level + 1] = p.blk[level];
+            p.pos[level + 1] = p.pos[level];
+        }
+        p.node[1] = p.node[0];
+        p.node[1]->hdr.max = FS_EXT_NODE(blk_size);
+        p.blk[1] = new_blks[--need];
+        p.pos[1] = p.pos[0];
+        p.node[0] = top;
+        memset(top, 0, blk_size);
+        top->hdr = p.node[1]->hdr;
+        top->hdr.max = inode->eh.max;
+        top->hdr.count = 1;
+        top->hdr.depth = ++depth;
+        top->e[0] = (struct fs_extent) {.lblk = p.node[1]->e[0].lblk, .pblk = p.blk[1]};
+        p.pos[0] = 0;
+        ext_put(inode, &p, 0);
+    }
+
+    struct fs_extent ins = {.lblk = idx, .len = 1, .pblk = blk};
+    for (level = depth; ; level--) {
+        struct fs_extent_node *n = p.node[level], *to = n;
+        if (n->hdr.count == n->hdr.max) {
+            int half = n->hdr.count / 2, rblk = new_blks[--need];
+            memset(right, 0, blk_size);
+            right->hdr = n->hdr;
+            right->hdr.count = n->hdr.count - half;
+            memcpy(right->e, &n->e[half], right->hdr.count * sizeof(ins));
+            memset(&n->e[half], 0, right->hdr.count * sizeof(ins));
+            n->hdr.count = half;
+            if (pos > half) {
+                to = right;
+                pos -= half;
             }
+            memmove(&to->e[pos + 1], &to->e[pos], (to->hdr.count - pos) * sizeof(ins));
+            to->e[pos] = ins;
+            to->hdr.count++;
+            meta_write(rblk, 1, right);
+            ext_put(inode, &p, level);
+            ins = (struct fs_extent) {.lblk = right->e[0].lblk, .pblk = rblk};
+            pos = p.pos[level - 1] + 1;
+            continue;
         }
-    }
+        memmove(&n->e[pos + 1], &n->e[pos], (n->hdr.count - pos) * sizeof(ins));
+        n->e[pos] = ins;
+        n->hdr.count++;
+        ext_put(inode, &p, level);
+        break;
+    }
+out:
+    free(p.mem);
+    return ret;
+}
 
-    // free the indirect blocks
-    if (indirect_block_1) {
-        free(indirect_block_1);
-    }
-    if (indirect_block_2) {
-        free(indirect_block_2);
+// release the blocks of every extent under a node, and the tree's own
+void ext_free(const struct fs_extent_hdr *h, const struct fs_extent *e) {
+    int i, j;
+    for (i = 0; i < h->count; i++) {
+        if (h->depth == 0) {
+            for (j = 0; j < e[i].len; j++)
+                free_a_block(e[i].pblk + j);
+            continue;
+        }
+        struct fs_extent_node *node = malloc(blk_size);
+        disk->ops->read(disk, e[i].pblk, 1, node);
+        if (node->hdr.magic == FS_EXT_MAGIC)
+            ext_free(&node->hdr, node->e);
+        free(node);
+        free_a_block(e[i].pblk);
     }
+}
 
-    write_block_map();
-
-    /* change the file size to zero */
-    inode.size = 0;
-    inodes[sb.st_ino] = inode;
-    write_all_inodes();
+/* file block map - translate block 'idx' of a file into a disk block
+ * number, 0 if it isn't allocated.
+ */
+int file_get_block(struct fs_inode *inode, int idx) {
+    uint32_t buf[ADDR_PER_BLOCK];
+    const uint32_t *ptrs;
+    struct fs_extent ext;
+
+    if (inode->flags & FS_EXTENTS)
+        return ext_lookup(inode, idx, &ext) ? ext.pblk + (idx - ext.lblk) : 0;
+    if (idx < N_DIRECT)
+        return inode->direct[idx];
+    idx -= N_DIRECT;
+    if (idx < ADDR_PER_BLOCK) {
+        if (!inode->indir_1)
+            return 0;
+        ptrs = get_block(inode->indir_1, buf);
+        return ptrs[idx];
+    }
+    idx -= ADDR_PER_BLOCK;
+    if (idx >= ADDR_PER_BLOCK * ADDR_PER_BLOCK || !inode->indir_2)
+        return 0;
+    ptrs = get_block(inode->indir_2, buf);
+    if (!ptrs[idx / ADDR_PER_BLOCK])
+        return 0;
+    ptrs = get_block(ptrs[idx / ADDR_PER_BLOCK], buf);
+    return ptrs[idx % ADDR_PER_BLOCK];
+}
 
+// allocate a zero-filled pointer block, storing its number in *ptr
+static int new_indirect_block(uint32_t *ptr) {
+    int blk = get_free_block();
+    if (blk < 0)
+        return blk;
+    char *zero = calloc(1, blk_size);
+    meta_write(blk, 1, zero);
+    free(zero);
+    *ptr = blk;
     return 0;
 }
 
-/* unlink - delete a file
- *  Errors - path resolution, ENOENT, EISDIR
- * Note that you have to delete (i.e. truncate) all the data.
+/* set block 'idx' of a file to disk block 'blk', allocating indirect
+ * blocks as needed. The caller writes the inode and the block map.
  */
+int file_set_block(struct fs_inode *inode, int idx, int blk) {
+    uint32_t ptrs[ADDR_PER_BLOCK];
+    int ptr_blk;
+
+    if (inode->flags & FS_EXTENTS)
+        return ext_insert(inode, idx, blk);
+    if (idx < N_DIRECT) {
+        inode->direct[idx] = blk;
+        return 0;
+    }
+    idx -= N_DIRECT;
+    if (idx < ADDR_PER_BLOCK) {
+        if (!inode->indir_1 && new_indirect_block(&inode->indir_1) < 0)
+            return -ENOSPC;
+        ptr_blk = inode->indir_1;
+    } else {
+        idx -= ADDR_PER_BLOCK;
+        if (idx >= ADDR_PER_BLOCK * ADDR_PER_BLOCK)
+            return -EFBIG;
+        if (!inode->indir_2 && new_indirect_block(&inode->indir_2) < 0)
+            return -ENOSPC;
+        disk->ops->read(disk, inode->indir_2, 1, ptrs);
+        if (!ptrs[idx / ADDR_PER_BLOCK]) {
+            if (new_indirect_block(&ptrs[idx / ADDR_PER_BLOCK]) < 0)
+                return -ENOSPC;
+            meta_write(inode->indir_2, 1, ptrs);
+        }
+        ptr_blk = ptrs[idx / ADDR_PER_BLOCK];
+        idx %= ADDR_PER_BLOCK;
+    }
+    disk->ops->read(disk, ptr_blk, 1, ptrs);
+    ptrs[idx] = blk;
+    meta_write(ptr_blk, 1, ptrs);
+    return 0;
+}
 
-static int fs_unlink(const char *path) {
-    int i = 0;
-    int inum = fs_truncate(path, 0);
-    if (inum < 0)
-        return inum;
-
-    char dir_name[MAX_LENGTH_OF_DIR_NAME];
-    char *_path = strdupa(path);
-    int parent_inum = get_parent_inum(_path, dir_name);
-    _path = strdupa(path);
-    char *last;
+// release every block of a file, including its indirect blocks
+void free_file_blocks(struct fs_inode *inode) {
+    uint32_t ptrs[ADDR_PER_BLOCK], ptrs2[ADDR_PER_BLOCK];
+    int i, j;
+
+    if (inode->flags & FS_INLINE)
+        return;
+    if (inode->flags & FS_EXTENTS) {
+        ext_free(&inode->eh, inode->ext);
+        ext_init(inode);
+        return;
+    }
+    for (i = 0; i < N_DIRECT; i++) {
+        free_a_block(inode->direct[i]);
+        inode->direct[i] = 0;
+    }
+    if (inode->indir_1) {
+        disk->ops->read(disk, inode->indir_1, 1, ptrs);
+        for (i = 0; i < ADDR_PER_BLOCK; i++)
+            free_a_block(ptrs[i]);
+        free_a_block(inode->indir_1);
+        inode->indir_1 = 0;
+    }
+    if (inode->indir_2) {
+        disk->ops->read(disk, inode->indir_2, 1, ptrs);
+        for (i = 0; i < ADDR_PER_BLOCK; i++) {
+            if (!ptrs[i])
+                continue;
+            disk->ops->read(disk, ptrs[i], 1, ptrs2);
+            for (j = 0; j < ADDR_PER_BLOCK; j++)
+                free_a_block(ptrs2[j]);
+            free_a_block(ptrs[i]);
+        }
+        free_a_block(inode->indir_2);
+        inode->indir_2 = 0;
+    }
+}
+
+/* Directories. A small directory is a single block of MAX_ENTRIES_DIR
+ * entries in direct[0]. When it fills up it is converted to the hashed
+ * format (see fsx600.h): block 0 becomes the root index node and the
+ * entries move to leaf blocks, which are split by hash as they fill.
+ * When the root index itself is full a second level of index nodes is
+ * added. Lookup, insert and delete read at most three blocks no matter
+ * how big the directory is.
+ */
 
-    last = get_last_of_split(_path);
-    //free(_path);
+/* where a name hash leads in an indexed directory. The nodes are two
+ * blocks that dx_walk allocates on first use; the caller frees node[0].
+ */
+struct dx_path {
+    struct fs_dx_node *node[2]; /* root and, if levels == 1, second level */
+    int node_blk[2];            /* their disk block numbers */
+    int pos[2];                 /* entry followed in each */
+    int leaf;                   /* logical block of the leaf */
+};
+
+// last entry in an index node whose hash is <= 'hash'
+static int dx_search(struct fs_dx_node *node, uint32_t hash) {
+    int lo = 1, hi = node->count - 1, pos = 0;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (node->entries[mid].hash <= hash) {
+            pos = mid;
+            lo = mid + 1;
+        } else
+            hi = mid - 1;
+    }
+    return pos;
+}
+
+static void dx_walk(struct fs_inode *dir, uint32_t hash, struct dx_path *p) {
+    if (p->node[0] == NULL) {
+        p->node[0] = malloc(2 * blk_size);
+        p->node[1] = (struct fs_dx_node *) ((char *) p->node[0] + blk_size);
+    }
+    p->node_blk[0] = dir->direct[0];
+    disk->ops->read(disk, p->node_blk[0], 1, p->node[0]);
+    p->pos[0] = dx_search(p->node[0], hash);
+    p->leaf = p->node[0]->entries[p->pos[0]].block;
+    if (p->node[0]->levels) {
+        p->node_blk[1] = file_get_block(dir, p->leaf);
+        disk->ops->read(disk, p->node_blk[1], 1, p->node[1]);
+        p->pos[1] = dx_search(p->node[1], hash);
+        p->leaf = p->node[1]->entries[p->pos[1]].block;
+    }
+}
 
-    struct fs_inode parent_dir = inodes[parent_inum];
-    struct fs_dirent *block = (struct fs_dirent *) malloc(FS_BLOCK_SIZE);
-    disk->ops->read(disk, parent_dir.direct[0], 1, block);
+// disk block holding the entry for 'name', whether or not it exists
+static int dir_block_for(int dir_inum, const char *name) {
+    struct fs_inode *dir = &inodes[dir_inum];
+    struct dx_path path = {0};
 
+    if (!(dir->flags & FS_DIR_INDEX))
+        return dir->direct[0];
+    dx_walk(dir, fs_name_hash(name), &path);
+    free(path.node[0]);
+    return file_get_block(dir, path.leaf);
+}
 
-    /* find the inode entry and clear it */
-    for (i = 0; i < 32; i++) {
+/* find 'name' in a directory. Returns its inode number, or -ENOENT.
+ * If found, the entry is copied to *de if 'de' isn't NULL.
+ */
+int dir_find(int dir_inum, const char *name, struct fs_dirent *de) {
+    struct fs_dirent *buf = malloc(blk_size);
+    const struct fs_dirent *block;
+    int i, inum = -ENOENT;
 
-        if (block[i].valid == 0) {
-            continue;
+    block = get_block(dir_block_for(dir_inum, name), buf);
+    for (i = 0; i < MAX_ENTRIES_DIR; i++) {
+        if (block[i].valid && !strcmp(block[i].name, name)) {
+            inum = block[i].inode;
+            if (de != NULL)
+                *de = block[i];
+            break;
         }
+    }
+    free(buf);
+    return inum;
+}
 
-        if (strcmp(block[i].name, last) == 0) {
+// add a block to the end of a directory, returning its logical number
+static int dir_append_block(int dir_inum, void *data) {
+    struct fs_inode *dir = &inodes[dir_inum];
+    int lblk = dir->size >> blk_shift;
+    int blk;
 
-            if (block[i].isDir) {
-                return -EISDIR;
-            }
-            int file_node_num = block[i].inode;
-            struct fs_inode fileinode = inodes[file_node_num];
-            if (FD_ISSET(file_node_num, inode_map)) {
-                FD_CLR(file_node_num, inode_map);
-                fileinode.size = 0;
-                fileinode.mtime = time(NULL);
-                block[i].valid = 0;
-                inodes[file_node_num] = fileinode;
+    if (get_free_blocks(1, file_get_block(dir, lblk - 1) + 1, &blk) < 0)
+        return -ENOSPC;
+    if (file_set_block(dir, lblk, blk) < 0) {
+        free_a_block(blk);
+        return -ENOSPC;
+    }
+    meta_write(blk, 1, data);
+    dir->size += blk_size;
+    mark_inode_dirty(dir_inum);
+    return lblk;
+}
+
+// insert an entry after position 'pos' of an index node
+static void dx_insert(struct fs_dx_node *node, int pos, uint32_t hash, int lblk) {
+    memmove(&node->entries[pos + 2], &node->entries[pos + 1],
+            (node->count - pos - 1) * sizeof(struct fs_dx_entry));
+    node->entries[pos + 1] = (struct fs_dx_entry) {.hash = hash, .block = lblk};
+    node->count++;
+}
+
+// convert a full single-block directory into the hashed format
+static int dx_convert(int dir_inum) {
+    struct fs_inode *dir = &inodes[dir_inum];
+    char *block = malloc(blk_size);
+    struct fs_dx_node *root = (struct fs_dx_node *) block;
+    int leaf;
+
+    disk->ops->read(disk, dir->direct[0], 1, block);
+    dir->size = blk_size;
+    if ((leaf = dir_append_block(dir_inum, block)) < 0) {
+        free(block);
+        return leaf;
+    }
+
+    memset(root, 0, blk_size);
+    root->magic = FS_DX_MAGIC;
+    root->count = 1;
+    root->entries[0] = (struct fs_dx_entry) {.hash = 0, .block = leaf};
+    meta_write(dir->direct[0], 1, root);
+    free(block);
+    dir->flags |= FS_DIR_INDEX;
+    mark_inode_dirty(dir_inum);
+    return 0;
+}
+
+/* make room in the index node above the leaf in 'p', by adding a level
+ * below a full root or splitting a full second-level node.
+ */
+static int dx_grow_index(int dir_inum, struct dx_path *p) {
+    struct fs_dx_node *root = p->node[0], *new;
+    int lblk;
+
+    if (!root->levels) {
+        new = malloc(blk_size);
+        memcpy(new, root, blk_size);
+        new->levels = 0;
+        lblk = dir_append_block(dir_inum, new);
+        free(new);
+        if (lblk < 0)
+            return lblk;
+        root->levels = 1;
+        root->count = 1;
+        root->entries[0] = (struct fs_dx_entry) {.hash = 0, .block = lblk};
+        meta_write(p->node_blk[0], 1, root);
+        return 0;
+    }
+
+    if (root->count == DX_ENTRIES_PER_BLK(blk_size))
+        return -ENOSPC;         /* directory is at its maximum size */
+
+    struct fs_dx_node *node = p->node[1];
+    int half = node->count / 2;
+    new = calloc(1, blk_size);
+    new->magic = FS_DX_MAGIC;
+    new->count = node->count - half;
+    memcpy(new->entries, &node->entries[half],
+           new->count * sizeof(struct fs_dx_entry));
+    uint32_t hash = new->entries[0].hash;
+    lblk = dir_append_block(dir_inum, new);
+    free(new);
+    if (lblk < 0)
+        return lblk;
+    node->count = half;
+    meta_write(p->node_blk[1], 1, node);
+    dx_insert(root, p->pos[0], hash, lblk);
+    meta_write(p->node_blk[0], 1, root);
+    return 0;
+}
+
+static int cmp_dirent_hash(const void *a, const void *b) {
+    uint32_t x = fs_name_hash(((struct fs_dirent *) a)->name);
+    uint32_t y = fs_name_hash(((struct fs_dirent *) b)->name);
+    return (x > y) - (x < y);
+}
+
+/* split a full leaf in two by hash. Names with equal hashes always stay
+ * in the same leaf, so lookups only ever need to search one leaf.
+ */
+static int dx_split_leaf(int dir_inum, struct dx_path *p, struct fs_dirent *leaf) {
+    struct fs_dx_node *parent = p->node[p->node[0]->levels];
+    int parent_blk = p->node_blk[p->node[0]->levels];
+    struct fs_dirent *new = calloc(MAX_ENTRIES_DIR, sizeof(struct fs_dirent));
+    int k, lblk;
+
+    qsort(leaf, MAX_ENTRIES_DIR, sizeof(struct fs_dirent), cmp_dirent_hash);
+    for (k = MAX_ENTRIES_DIR / 2; k < MAX_ENTRIES_DIR; k++)
+        if (fs_name_hash(leaf[k].name) != fs_name_hash(leaf[k - 1].name))
+            break;
+    if (k == MAX_ENTRIES_DIR)
+        for (k = MAX_ENTRIES_DIR / 2 - 1; k > 0; k--)
+            if (fs_name_hash(leaf[k].name) != fs_name_hash(leaf[k - 1].name))
                 break;
-            }
+    if (k == 0) {
+        free(new);
+        return -ENOSPC;
+    }
+
+    uint32_t split_hash = fs_name_hash(leaf[k].name);
+    memcpy(new, &leaf[k], (MAX_ENTRIES_DIR - k) * sizeof(struct fs_dirent));
+    if ((lblk = dir_append_block(dir_inum, new)) < 0) {
+        free(new);
+        return lblk;
+    }
+    free(new);
+    memset(&leaf[k], 0, (MAX_ENTRIES_DIR - k) * sizeof(struct fs_dirent));
+    meta_write(file_get_block(&inodes[dir_inum], p->leaf), 1, leaf);
+
+    dx_insert(parent, p->pos[p->node[0]->levels], split_hash, lblk);
+    meta_write(parent_blk, 1, parent);
+    return 0;
+}
+
+/* add an entry to a directory. The caller has checked that the name
+ * isn't already there, and writes the inode and block map afterwards.
+ */
+int dir_add(int dir_inum, const char *name, int inum, int isDir) {
+    struct fs_dirent *block = malloc(blk_size);
+    struct dx_path path = {0};
+    int i, blk, ret = 0;
+
+    if (strlen(name) >= sizeof(block->name)) {
+        free(block);
+        return -ENAMETOOLONG;
+    }
+
+    /* each time around, either the entry goes in or the directory is
+     * restructured (converted, leaf split, index grown) to make room.
+     */
+    while (ret == 0) {
+        if (!(inodes[dir_inum].flags & FS_DIR_INDEX))
+            blk = inodes[dir_inum].direct[0];
+        else {
+            dx_walk(&inodes[dir_inum], fs_name_hash(name), &path);
+            blk = file_get_block(&inodes[dir_inum], path.leaf);
+        }
+        disk->ops->read(disk, blk, 1, block);
+
+        for (i = 0; i < MAX_ENTRIES_DIR; i++)
+            if (!block[i].valid)
+                break;
+        if (i < MAX_ENTRIES_DIR) {
+            memset(&block[i], 0, sizeof(struct fs_dirent));
+            strcpy(block[i].name, name);
+            block[i].valid = 1;
+            block[i].isDir = isDir;
+            block[i].inode = inum;
+            meta_write(blk, 1, block);
+            break;
         }
+
+        if (!(inodes[dir_inum].flags & FS_DIR_INDEX))
+            ret = dx_convert(dir_inum);
+        else if (path.node[path.node[0]->levels]->count == DX_ENTRIES_PER_BLK(blk_size))
+            ret = dx_grow_index(dir_inum, &path);
+        else
+            ret = dx_split_leaf(dir_inum, &path, block);
     }
 
+    free(path.node[0]);
+    free(block);
+    return ret;
+}
 
-    if (i > 31) {
-        return -ENOENT;
+// remove 'name' from a directory, returning the inode it pointed to
+int dir_remove(int dir_inum, const char *name) {
+    struct fs_dirent *block = malloc(blk_size);
+    int i, inum = -ENOENT, blk = dir_block_for(dir_inum, name);
+
+    disk->ops->read(disk, blk, 1, block);
+    for (i = 0; i < MAX_ENTRIES_DIR; i++) {
+        if (block[i].valid && !strcmp(block[i].name, name)) {
+            inum = block[i].inode;
+            memset(&block[i], 0, sizeof(struct fs_dirent));
+            meta_write(blk, 1, block);
+            break;
+        }
     }
+    free(block);
+    return inum;
+}
 
-    disk->ops->write(disk, parent_dir.direct[0], 1, block);
-    write_all_inodes();
-    //write_block_map();
-    write_inode_map();
+/* call 'fn' for each entry of a directory, stopping early if it
+ * returns non-zero (which is then returned).
+ */
+int dir_iterate(int dir_inum, int (*fn)(struct fs_dirent *, void *), void *arg) {
+    struct fs_inode *dir = &inodes[dir_inum];
+    struct fs_dirent *block = malloc(blk_size);
+    struct fs_dx_node *root, *node;
+    int i, j, k, ret = 0;
+
+    if (!(dir->flags & FS_DIR_INDEX)) {
+        disk->ops->read(disk, dir->direct[0], 1, block);
+        for (i = 0; i < MAX_ENTRIES_DIR && ret == 0; i++)
+            if (block[i].valid)
+                ret = fn(&block[i], arg);
+        free(block);
+        return ret;
+    }
+
+    root = malloc(2 * blk_size);
+    node = (struct fs_dx_node *) ((char *) root + blk_size);
+    disk->ops->read(disk, dir->direct[0], 1, root);
+    for (i = 0; i < root->count && ret == 0; i++) {
+        if (root->levels)
+            disk->ops->read(disk, file_get_block(dir, root->entries[i].block), 1, node);
+        else {
+            node->count = 1;
+            node->entries[0] = root->entries[i];
+        }
+        for (j = 0; j < node->count && ret == 0; j++) {
+            disk->ops->read(disk, file_get_block(dir, node->entries[j].block), 1, block);
+            for (k = 0; k < MAX_ENTRIES_DIR && ret == 0; k++)
+                if (block[k].valid)
+                    ret = fn(&block[k], arg);
+        }
+    }
+    free(root);
     free(block);
+    return ret;
+}
+
+static int not_empty(struct fs_dirent *de, void *arg) {
+    return 1;
+}
+
+int dir_is_empty(int dir_inum) {
+    return dir_iterate(dir_inum, not_empty, NULL) == 0;
+}
+
+// the rest of mknod, with the parent locked
+static int mknod_locked(int parent_inum, const char *dir_name, mode_t mode) {
+    int isDir;
+
+    /* If parent is not a directory */
+    struct fs_inode p_inode = inodes[parent_inum];
+    if (!S_ISDIR(p_inode.mode)) {
+        return -ENOTDIR;
+    }
+
+    /* If a file already exists with the given name */
+    if (dir_lookup(parent_inum, dir_name, &isDir) > 0) {
+        return -EEXIST;
+    }
+
+    int new_inum = get_free_inode();
+    /* If the inode_bitmap is full and no free inode available */
+    if (new_inum == -ENOSPC) {
+        return -ENOSPC;
+    }
+
+    /* create inode, write to disk and update in-memory ds */
+    struct fuse_context *context = fuse_get_context();
+    struct fs_inode new_inode;
+    time_t mytime = time(NULL);
+
+    memset(&new_inode, 0, sizeof(new_inode));
+    new_inode.mode = mode;
+    new_inode.uid = context->uid;
+    new_inode.gid = context->gid;
+    new_inode.ctime = mytime;
+    new_inode.mtime = mytime;
+    new_inode.size = 0;
+    if (compress_files && !S_ISDIR(mode))
+        new_inode.flags |= FS_COMPRESS;
+    if (inline_max > 0 && !S_ISDIR(mode))
+        inline_init(&new_inode, new_inum);
+    else if (extents && !S_ISDIR(mode) && !compress_files)
+        ext_init(&new_inode);
+
+    if (S_ISDIR(mode)) {
+        int block_num = get_free_block();
+        if (block_num == -ENOSPC) {
+            free_an_inode(new_inum);
+            return -ENOSPC;
+        }
+        new_inode.direct[0] = block_num;
+
+        /* create empty block for direct[0] and write to disk */
+        void *block_dir = calloc(1, blk_size);
+        meta_write(block_num, 1, block_dir);
+        free(block_dir);
+    }
+
+    /* add it to the parent; this can fail if the parent is at its
+     * maximum size or the disk is full.
+     */
+    int ret = dir_add(parent_inum, dir_name, new_inum, S_ISDIR(mode));
+    if (ret < 0) {
+        if (S_ISDIR(mode))
+            free_a_block(new_inode.direct[0]);
+        free_an_inode(new_inum);
+        write_dirty_inodes();
+        write_block_map();
+        return ret;
+    }
+    dcache_set(parent_inum, dir_name, new_inum, S_ISDIR(mode));
+
+    /* write inode_map, inode region and block map to disk */
+    inodes[new_inum] = new_inode;
+    mark_inode_dirty(new_inum);
+    write_inode_map();
+    write_dirty_inodes();
+    write_block_map();
 
     return 0;
+}
+
+static int fs_mknod(const char *path, mode_t mode, dev_t dev) {
+    char dir_name[MAX_LENGTH_OF_DIR_NAME];
 
+    /* get the parent inode number */
+    char *_path = strdupa(path);
+    int parent_inum = get_parent_inum(_path, dir_name);
+
+    /* If parent path contains invalid files other than directories
+     * or the parent path is not present
+     */
+    if (parent_inum < 0) {
+        return parent_inum;
+    }
+
+    op_begin();
+    lock_inode(parent_inum, 1);
+    int ret = mknod_locked(parent_inum, dir_name, mode);
+    unlock_inode(parent_inum);
+    op_end();
+    return ret;
 }
 
-/* rmdir - remove a directory
- *  Errors - path resolution, ENOENT, ENOTDIR, ENOTEMPTY
+/* mkdir - create a directory with the given mode.
+ * Errors - path resolution, EEXIST
+ * Conditions for EEXIST are the same as for create.
+ * If the directory can't grow any further, return -ENOSPC
+ *
+ * Note that you may want to combine the logic of fs_mknod and
+ * fs_mkdir.
  */
-static int fs_rmdir(const char *path) {
+static int fs_mkdir(const char *path, mode_t mode) {
+    mode = mode | S_IFDIR;
+    int ret = fs_mknod(path, mode, 0);
+    return ret;
+}
+
+/* In-core inodes. All opens of a file share one of these, which caches
+ * the file's decoded block map: once the pointer block covering a file
+ * block has been read, translating it to a disk block is an array
+ * lookup. The map is filled in lazily, a pointer block ('chunk') at a
+ * time, kept up to date by fs_write and dropped by truncate. For an
+ * extent-mapped file it holds just the last extent found, which
+ * answers every lookup in a sequential pass over it.
+ */
+struct fs_ino {
+    int inum;
+    int refcnt;                 /* under ino_lock */
+    pthread_mutex_t lock;       /* for the map, which readers fill in */
+    unsigned gen;               /* bumped by every write and truncate */
+    uint32_t *map;              /* blocks N_DIRECT and up */
+    char *loaded;               /* per chunk of ADDR_PER_BLOCK entries */
+    int nchunks;
+    uint32_t *indir_2;          /* copy of the top-level block */
+    int indir_2_loaded;
+    struct fs_extent ext;       /* FS_EXTENTS: the last extent looked up */
+    struct fs_ino *next;
+};
+
+#define INO_HASH 256
+struct fs_ino *ino_hash[INO_HASH];
+
+struct fs_ino *ilookup(int inum) {
+    struct fs_ino *ino;
+    for (ino = ino_hash[inum % INO_HASH]; ino != NULL; ino = ino->next)
+        if (ino->inum == inum)
+            return ino;
+    return NULL;
+}
+
+// find or create the in-core inode, taking a reference
+struct fs_ino *iget(int inum) {
+    pthread_mutex_lock(&ino_lock);
+    struct fs_ino *ino = ilookup(inum);
+    if (ino == NULL) {
+        ino = calloc(1, sizeof(*ino));
+        ino->inum = inum;
+        pthread_mutex_init(&ino->lock, NULL);
+        ino->next = ino_hash[inum % INO_HASH];
+        ino_hash[inum % INO_HASH] = ino;
+    }
+    ino->refcnt++;
+    pthread_mutex_unlock(&ino_lock);
+    return ino;
+}
+
+// forget the cached block map, e.g. after the file's blocks are freed
+static void ino_drop_map(struct fs_ino *ino) {
+    free(ino->map);
+    free(ino->loaded);
+    free(ino->indir_2);
+    ino->map = NULL;
+    ino->loaded = NULL;
+    ino->indir_2 = NULL;
+    ino->nchunks = 0;
+    ino->indir_2_loaded = 0;
+    ino->ext.len = 0;
+}
+
+// with the inode locked for writing, so there are no readers of the map
+void ino_invalidate(int inum) {
+    pthread_mutex_lock(&ino_lock);
+    struct fs_ino *ino = ilookup(inum);
+    if (ino != NULL) {
+        ino_drop_map(ino);
+        ino->gen++;
+    }
+    pthread_mutex_unlock(&ino_lock);
+}
+
+void iput(struct fs_ino *ino) {
+    pthread_mutex_lock(&ino_lock);
+    if (--ino->refcnt > 0) {
+        pthread_mutex_unlock(&ino_lock);
+        return;
+    }
+    struct fs_ino **pp = &ino_hash[ino->inum % INO_HASH];
+    while (*pp != ino)
+        pp = &(*pp)->next;
+    *pp = ino->next;
+    pthread_mutex_unlock(&ino_lock);
+    ino_drop_map(ino);
+    pthread_mutex_destroy(&ino->lock);
+    free(ino);
+}
+
+// read chunk 'c' of the block map from its pointer block
+static void bmap_load(struct fs_ino *ino, int c) {
+    struct fs_inode *inode = &inodes[ino->inum];
+    int ptr_blk = 0;
+
+    if (c >= ino->nchunks) {
+        ino->map = realloc(ino->map, (c + 1) * ADDR_PER_BLOCK * sizeof(uint32_t));
+        ino->loaded = realloc(ino->loaded, c + 1);
+        memset(ino->loaded + ino->nchunks, 0, c + 1 - ino->nchunks);
+        ino->nchunks = c + 1;
+    }
+
+    if (c == 0)
+        ptr_blk = inode->indir_1;
+    else if (inode->indir_2) {
+        if (!ino->indir_2_loaded) {
+            if (ino->indir_2 == NULL)
+                ino->indir_2 = malloc(blk_size);
+            disk->ops->read(disk, inode->indir_2, 1, ino->indir_2);
+            ino->indir_2_loaded = 1;
+        }
+        ptr_blk = ino->indir_2[c - 1];
+    }
+
+    uint32_t *chunk = ino->map + c * ADDR_PER_BLOCK;
+    if (ptr_blk)
+        disk->ops->read(disk, ptr_blk, 1, chunk);
+    else
+        memset(chunk, 0, blk_size);
+    ino->loaded[c] = 1;
+}
+
+// disk block for block 'idx' of the file, 0 if not allocated
+int bmap(struct fs_ino *ino, int idx) {
+    struct fs_inode *inode = &inodes[ino->inum];
+    if (inode->flags & FS_EXTENTS) {
+        struct fs_extent *x = &ino->ext;
+        int blk = 0;
+        pthread_mutex_lock(&ino->lock);
+        if ((uint32_t) idx - x->lblk < x->len || ext_lookup(inode, idx, x))
+            blk = x->pblk + (idx - x->lblk);
+        pthread_mutex_unlock(&ino->lock);
+        return blk;
+    }
+    if (idx < N_DIRECT)
+        return inodes[ino->inum].direct[idx];
+    if (idx >= SIZE_DOUBLE_INDIRECT)
+        return 0;
+    int c = (idx - N_DIRECT) / ADDR_PER_BLOCK;
+    pthread_mutex_lock(&ino->lock);
+    if (c >= ino->nchunks || !ino->loaded[c])
+        bmap_load(ino, c);
+    int blk = ino->map[idx - N_DIRECT];
+    pthread_mutex_unlock(&ino->lock);
+    return blk;
+}
+
+// set block 'idx' of the file (see file_set_block), keeping the map current
+int bmap_set(struct fs_ino *ino, struct fs_inode *inode, int idx, int blk) {
+    int ret = file_set_block(inode, idx, blk);
+    if (inode->flags & FS_EXTENTS) {
+        ino->ext.len = 0;
+        return ret;
+    }
+    if (ret < 0 || idx < N_DIRECT)
+        return ret;
+    int c = (idx - N_DIRECT) / ADDR_PER_BLOCK;
+    if (c < ino->nchunks && ino->loaded[c])
+        ino->map[idx - N_DIRECT] = blk;
+    ino->indir_2_loaded = 0;    /* may have gained a pointer block */
+    return 0;
+}
+
+/* Open files - see fs_open. Callers that don't open files first (the
+ * command-line interface does, FUSE always does) pass fi == NULL, and
+ * then the path is resolved on every call.
+ */
+struct fs_file {
+    int inum;
+    struct fs_inode *inode;     /* in the in-memory inode table */
+    struct fs_ino *ino;
+
+    /* readahead - see ra_issue */
+    pthread_mutex_t ra_lock;
+    off_t ra_pos;               /* where a sequential read would start */
+    int ra_window;              /* blocks to read ahead, 0 if not sequential */
+    int ra_start, ra_len;       /* file blocks held in ra_buf */
+    unsigned ra_gen;            /* ino->gen when they were read */
+    int ra_pending;             /* requests still in flight */
+    int ra_error;
+    char *ra_buf;
+    struct blkdev_req *ra_reqs;
+
+    /* FS_COMPRESS: the last cluster expanded, under ra_lock */
+    char *cl_buf;
+    int cl_idx;
+    unsigned cl_gen;
+};
+
+// the in-core inode for a read/write: the open file's, or a temporary
+// reference which the caller drops with iput()
+static struct fs_ino *file_ino(int inum, struct fuse_file_info *fi) {
+    if (fi != NULL && fi->fh != 0)
+        return ((struct fs_file *) (uintptr_t) fi->fh)->ino;
+    return iget(inum);
+}
+
+// inode for a read/write/ftruncate: from the open file if there is
+// one, otherwise by resolving the path
+static int file_inum(const char *path, struct fuse_file_info *fi) {
+    if (fi != NULL && fi->fh != 0)
+        return ((struct fs_file *) (uintptr_t) fi->fh)->inum;
+    char *_path = strdupa(path);
+    return translate_path_to_inum(_path);
+}
+
+/* truncate - truncate file to exactly 'len' bytes
+ * Errors - path resolution, ENOENT, EISDIR, EINVAL
+ *    return EINVAL if len > 0.
+ */
+static int truncate_inum(int inum, off_t len) {
+    /* you can cheat by only implementing this for the case of len==0,
+     * and an error otherwise.
+     */
+    if (len != 0)
+        return -EINVAL;        /* invalid argument */
+
+    struct fs_inode inode = inodes[inum];
+
+    // now checking if its a directory and not a file
+
+    if (S_ISDIR(inode.mode)) {
+        return -EISDIR;
+    }
+
+    // free the direct, indirect and double indirect blocks; an empty
+    // file goes back to being inline if it can
+    free_file_blocks(&inode);
+    ino_invalidate(inum);
+    write_block_map();
+    if (inline_max > 0)
+        inline_init(&inode, inum);
+
+    /* change the file size to zero */
+    set_inode_size(&inode, 0);
+    inodes[inum] = inode;
+    mark_inode_dirty(inum);
+    write_dirty_inodes();
+
+    return 0;
+}
+
+static int fs_truncate(const char *path, off_t len) {
+    char *_path = strdupa(path);
+    int inum = translate_path_to_inum(_path);
+
+    // checking for path translation and errors
+    if (inum == -ENOENT || inum == -ENOTDIR) {
+        return inum;
+    }
+    op_begin();
+    lock_inode(inum, 1);
+    int ret = truncate_inum(inum, len);
+    unlock_inode(inum);
+    op_end();
+    return ret;
+}
+
+/* ftruncate - same, for a file that is already open
+ */
+static int fs_ftruncate(const char *path, off_t len, struct fuse_file_info *fi) {
+    int inum = file_inum(path, fi);
+    if (inum < 0)
+        return inum;
+    op_begin();
+    lock_inode(inum, 1);
+    int ret = truncate_inum(inum, len);
+    unlock_inode(inum);
+    op_end();
+    return ret;
+}
+
+/* unlink - delete a file
+ *  Errors - path resolution, ENOENT, EISDIR
+ * Note that you have to delete (i.e. truncate) all the data.
+ */
+
+static int fs_unlink(const char *path) {
     char dir_name[MAX_LENGTH_OF_DIR_NAME];
     char *_path = strdupa(path);
-    int child_inum = translate_path_to_inum(_path);
-    _path = strdupa(path);
     int parent_inum = get_parent_inum(_path, dir_name);
+    if (parent_inum < 0)
+        return parent_inum;
 
-    /* If path contains invalid files other than directories
-     * or the path is not present
-     */
-    if (child_inum == -ENOTDIR || child_inum == -ENOENT)
-        return child_inum;
+    /* parent first, then the file */
+    op_begin();
+    lock_inode(parent_inum, 1);
+    int file_node_num = dir_find(parent_inum, dir_name, NULL);
+    if (file_node_num < 0) {
+        unlock_inode(parent_inum);
+        op_end();
+        return file_node_num;
+    }
+    lock_inode(file_node_num, 1);
+
+    int ret = truncate_inum(file_node_num, 0);
+    if (ret == 0) {
+        /* find the entry and clear it */
+        dir_remove(parent_inum, dir_name);
+        dcache_set(parent_inum, dir_name, 0, 0);
+
+        struct fs_inode fileinode = inodes[file_node_num];
+        free_an_inode(file_node_num);
+        set_inode_size(&fileinode, 0);
+        fileinode.mtime = time(NULL);
+        inodes[file_node_num] = fileinode;
+        mark_inode_dirty(file_node_num);
+
+        write_dirty_inodes();
+        write_inode_map();
+    }
+
+    unlock_inode(file_node_num);
+    unlock_inode(parent_inum);
+    op_end();
+    return ret;
+}
 
+// the rest of rmdir, with the parent and the directory locked
+static int rmdir_locked(int parent_inum, const char *dir_name, int child_inum) {
     /* If child is not a directory */
     struct fs_inode c_inode = inodes[child_inum];
     if (!S_ISDIR(c_inode.mode)) {
         return -ENOTDIR;
     }
 
-    void *block = malloc(FS_BLOCK_SIZE);
-    disk->ops->read(disk, c_inode.direct[0], 1, block);
-    struct fs_dirent *entry = block;
-
-    int i = 0;
-    for (i = 0; i < MAX_ENTRIES_DIR; i++) {
-        if (entry->valid) {
-            if (block) {
-                free(block);
-            }
-            return -ENOTEMPTY;
-        }
-        entry++;
+    if (!dir_is_empty(child_inum)) {
+        return -ENOTEMPTY;
     }
 
-    free_a_block(c_inode.direct[0]);
+    dir_remove(parent_inum, dir_name);
+    dcache_set(parent_inum, dir_name, 0, 0);
+
+    free_file_blocks(&c_inode);
     write_block_map();
 
     memset(&c_inode, 0, sizeof(struct fs_inode));
     inodes[child_inum] = c_inode;
+    mark_inode_dirty(child_inum);
+    free_an_inode(child_inum);
+    write_inode_map();
+    write_dirty_inodes();
 
-    struct fs_inode p_inode = inodes[parent_inum];
-    disk->ops->read(disk, p_inode.direct[0], 1, block);
-    entry = block;
+    return 0;
+}
 
-    for (i = 0; i < MAX_ENTRIES_DIR; i++) {
-        if (entry->inode == child_inum) {
-            memset(entry, 0, sizeof(struct fs_dirent));
-            FD_CLR(child_inum, inode_map);
-            write_inode_map();
-            break;
-        }
-        entry++;
+/* rmdir - remove a directory
+ *  Errors - path resolution, ENOENT, ENOTDIR, ENOTEMPTY
+ */
+static int fs_rmdir(const char *path) {
+    char dir_name[MAX_LENGTH_OF_DIR_NAME];
+    char *_path = strdupa(path);
+    int parent_inum = get_parent_inum(_path, dir_name);
+
+    /* If path contains invalid files other than directories
+     * or the path is not present
+     */
+    if (parent_inum < 0)
+        return parent_inum;
+
+    /* parent first, then the directory being removed */
+    op_begin();
+    lock_inode(parent_inum, 1);
+    int child_inum = dir_find(parent_inum, dir_name, NULL);
+    if (child_inum < 0) {
+        unlock_inode(parent_inum);
+        op_end();
+        return child_inum;
     }
-    disk->ops->write(disk, p_inode.direct[0], 1, block);
+    lock_inode(child_inum, 1);
+    int ret = rmdir_locked(parent_inum, dir_name, child_inum);
+    unlock_inode(child_inum);
+    unlock_inode(parent_inum);
+    op_end();
+    return ret;
+}
 
-    inodes[parent_inum] = p_inode;
-    write_all_inodes();
+// the rest of rename, with the directory and the entry locked
+static int rename_locked(int prev_pinum, const char *the_old_name,
+                         const char *the_new_name, int curr_inum) {
+    /* to check if destination is not present */
+    if (dir_find(prev_pinum, the_new_name, NULL) >= 0) {
+        return -EEXIST;
+    }
 
-    if (block) {
-        free(block);
+    /* in a hashed directory the new name may belong in a different
+     * block, so remove the entry and add it back under the new name.
+     */
+    struct fs_dirent entry;
+    dir_find(prev_pinum, the_old_name, &entry);
+    dir_remove(prev_pinum, the_old_name);
+    int ret = dir_add(prev_pinum, the_new_name, curr_inum, entry.isDir);
+    if (ret < 0) {
+        dir_add(prev_pinum, the_old_name, curr_inum, entry.isDir);
+        write_dirty_inodes();
+        write_block_map();
+        return ret;
     }
+    dcache_set(prev_pinum, the_old_name, 0, 0);
+    dcache_set(prev_pinum, the_new_name, curr_inum, entry.isDir);
+
+    struct fs_inode inode = inodes[curr_inum];
+    inode.ctime = time(NULL);
+    inodes[curr_inum] = inode;
+    mark_inode_dirty(curr_inum);
+    write_dirty_inodes();
+    write_block_map();
 
     return 0;
+
 }
 
 /* rename - rename a file or directory
@@ -782,62 +2111,35 @@ static int fs_rename(const char *src_path, const char *dst_path) {
     char *tmp_path = strdupa(src_path);
     int prev_pinum = get_parent_inum(tmp_path, the_old_name);
 
-    tmp_path = strdupa(src_path);
-    int curr_inum = translate_path_to_inum(tmp_path);
-
     char the_new_name[MAX_LENGTH_OF_DIR_NAME];
     tmp_path = strdupa(dst_path);
     int new_pinum = get_parent_inum(tmp_path, the_new_name);
 
-    if (curr_inum == -ENOTDIR || curr_inum == -ENOENT) {
-        return curr_inum;
+    if (prev_pinum < 0) {
+        return prev_pinum;
     }
 
     if (prev_pinum != new_pinum) {
         return -EINVAL;
     }
 
-    struct fs_inode parent_inode = inodes[prev_pinum];
-    void *block = malloc(FS_BLOCK_SIZE);
-    disk->ops->read(disk, parent_inode.direct[0], 1, block);
-    struct fs_dirent *entry = block;
-
-    /* to check if destination is not present */
-    int i = 0;
-    for (i = 0; i < MAX_ENTRIES_DIR; i++) {
-        if (!strcmp(entry->name, the_new_name)) {
-            if (block) {
-                free(block);
-            }
-            return -EEXIST;
-        }
-        entry++;
-    }
-
-    /* update name of matching inode */
-    entry = block;
-    for (i = 0; i < MAX_ENTRIES_DIR; i++) {
-        if (entry->inode == curr_inum) {
-            strncpy(entry->name, the_new_name, strlen(the_new_name));
-            struct fs_inode inode = inodes[curr_inum];
-            inode.ctime = time(NULL);
-            inodes[curr_inum] = inode;
-            write_all_inodes();
-            break;
-        }
-        entry++;
-    }
-
-    /* write back to disk */
-    disk->ops->write(disk, parent_inode.direct[0], 1, block);
-
-    /* free previously allocated memory */
-    if (block) {
-        free(block);
+    /* only the one directory is involved: lock it, then the entry
+     * being renamed.
+     */
+    op_begin();
+    lock_inode(prev_pinum, 1);
+    int curr_inum = dir_find(prev_pinum, the_old_name, NULL);
+    if (curr_inum < 0) {
+        unlock_inode(prev_pinum);
+        op_end();
+        return curr_inum;
     }
-
-    return 0;
-
+    lock_inode(curr_inum, 1);
+    int ret = rename_locked(prev_pinum, the_old_name, the_new_name, curr_inum);
+    unlock_inode(curr_inum);
+    unlock_inode(prev_pinum);
+    op_end();
+    return ret;
 }
 
 /* chmod - change file permissions
@@ -855,6 +2157,8 @@ static int fs_chmod(const char *path, mode_t mode) {
         return ret;
     }
 
+    op_begin();
+    lock_inode(sb.st_ino, 1);
     struct fs_inode inode = inodes[sb.st_ino];
 
     // update the mode of the directory or the file.
@@ -869,7 +2173,10 @@ static int fs_chmod(const char *path, mode_t mode) {
 
     // finally write to the disk
     inodes[sb.st_ino] = inode;
-    write_all_inodes();
+    mark_inode_dirty(sb.st_ino);
+    unlock_inode(sb.st_ino);
+    write_dirty_inodes();
+    op_end();
     return 0;
 }
 
@@ -882,6 +2189,8 @@ int fs_utime(const char *path, struct utimbuf *ut) {
         return ret;
     }
 
+    op_begin();
+    lock_inode(sb.st_ino, 1);
     struct fs_inode inode = inodes[sb.st_ino];
 
     // the modification time updated for the directory or file type.
@@ -889,7 +2198,10 @@ int fs_utime(const char *path, struct utimbuf *ut) {
 
     // finally write to disk for persistance
     inodes[sb.st_ino] = inode;
-    write_all_inodes();
+    mark_inode_dirty(sb.st_ino);
+    unlock_inode(sb.st_ino);
+    write_dirty_inodes();
+    op_end();
     return 0;
 }
 
@@ -903,463 +2215,708 @@ int fs_utime(const char *path, struct utimbuf *ut) {
 
 
 
-static int fs_read(const char *path, char *buf, size_t len, off_t offset,
-                   struct fuse_file_info *fi) {
-
-    int num_copied = 0;
+/* Compressed files (FS_COMPRESS, see fsx600.h) are read and written a
+ * cluster at a time. A write reads back any cluster it only partly
+ * covers, then compresses each cluster it touches again and stores it
+ * in whichever form takes fewer blocks, reusing the blocks it had. A
+ * reader with an open file keeps the last cluster it expanded, so
+ * reading one sequentially decompresses each cluster once.
+ */
+#define CLUSTER_BYTES (FS_CLUSTER << blk_shift)
+#define CLUSTER_MAX_BLOCKS (SIZE_DOUBLE_INDIRECT / FS_CLUSTER * FS_CLUSTER)
 
-    struct stat sb;
-    int ret = fs_getattr(path, &sb);
+// block pointer 'idx' of a file; 'inode' may be a writer's copy
+static uint32_t cluster_slot(struct fs_ino *ino, struct fs_inode *inode, int idx) {
+    return idx < N_DIRECT ? inode->direct[idx] : (uint32_t) bmap(ino, idx);
+}
 
-    /* error-checking for path resolution */
-    if (ret == -ENOENT || ret == -ENOTDIR) {
-        return ret;
+// read 'n' blocks at 'map' into 'buf', one read per contiguous run
+static void read_runs(const uint32_t *map, int n, char *buf) {
+    int i, j;
+    for (i = 0; i < n; i = j) {
+        for (j = i + 1; j < n && map[i] && map[j] == map[j - 1] + 1; j++)
+            ;
+        if (map[i])
+            disk->ops->read(disk, map[i], j - i, buf + ((size_t) i << blk_shift));
+        else
+            memset(buf + ((size_t) i << blk_shift), 0, (size_t) (j - i) << blk_shift);
     }
+}
 
-    /* if offset >= file len */
-    int n_blocks = offset / FS_BLOCK_SIZE;
-    if (n_blocks >= SIZE_DOUBLE_INDIRECT) {
+// cluster 'c' of a file, expanded into 'buf' (CLUSTER_BYTES)
+static int cluster_read(struct fs_ino *ino, struct fs_inode *inode, int c, char *buf) {
+    uint32_t map[FS_CLUSTER], clen;
+    int i, n, len = -1;
+
+    for (i = 0; i < FS_CLUSTER; i++)
+        map[i] = cluster_slot(ino, inode, c * FS_CLUSTER + i);
+    if (map[0] != FS_CLUSTER_MARK) {
+        read_runs(map, FS_CLUSTER, buf);
         return 0;
     }
 
-    struct fs_inode inode = inodes[sb.st_ino];
+    for (n = 0; n < FS_CLUSTER - 1 && map[n + 1]; n++)
+        ;
+    char *z = malloc((size_t) (n ? n : 1) << blk_shift);
+    read_runs(map + 1, n, z);
+    memcpy(&clen, z, sizeof(clen));
+    if (n > 0 && clen <= (n << blk_shift) - sizeof(clen))
+        len = lz_decompress(z + sizeof(clen), clen, buf, CLUSTER_BYTES);
+    free(z);
+    if (len < 0)
+        return -EIO;
+    memset(buf + len, 0, CLUSTER_BYTES - len);
+    return 0;
+}
 
-    /* if given path is a directory instead of file */
-    if (S_ISDIR(inode.mode)) {
-        return -EISDIR;
+/* store cluster 'c', whose first 'valid' bytes are in 'buf' and the
+ * rest zeros. Returns 0 or -ENOSPC, in which case the cluster is as it
+ * was. The caller writes the inode and the block map.
+ */
+static int cluster_write(struct fs_ino *ino, struct fs_inode *inode, int c,
+                         char *buf, int valid) {
+    uint32_t old[FS_CLUSTER], have[FS_CLUSTER], map[FS_CLUSTER];
+    int first = c * FS_CLUSTER, raw = (valid + BLK_MASK) >> blk_shift;
+    int i, j, n = raw, nhave = 0, nslots, ret = 0;
+    char *z = NULL, *data = buf;
+
+    /* worth compressing only if it saves at least a block */
+    if (raw > 1) {
+        uint32_t clen;
+        z = malloc(CLUSTER_BYTES);
+        clen = lz_compress(buf, valid, z + sizeof(clen), ((raw - 1) << blk_shift) - sizeof(clen));
+        if (clen > 0) {
+            n = (sizeof(clen) + clen + BLK_MASK) >> blk_shift;
+            memcpy(z, &clen, sizeof(clen));
+            memset(z + sizeof(clen) + clen, 0, (n << blk_shift) - sizeof(clen) - clen);
+            data = z;
+        }
     }
+    nslots = (data == z) ? n + 1 : n;
 
-    void *block = malloc(FS_BLOCK_SIZE);
-    void *indirect_1 = malloc(FS_BLOCK_SIZE);
-    void *indirect_2 = malloc(FS_BLOCK_SIZE);
+    for (i = 0; i < FS_CLUSTER; i++) {
+        old[i] = cluster_slot(ino, inode, first + i);
+        if (old[i] && old[i] != FS_CLUSTER_MARK)
+            have[nhave++] = old[i];
+    }
 
-    int i = 0;
-    int cnt_offset = 0;
-
-    // handling in different modular blocks as professor mentioned
-    if (n_blocks < 6) {
-        goto handle_direct_blocks;
-    } else if (n_blocks >= 6 && n_blocks < 262) {
-        goto handle_indirect_blocks;
-    } else if (n_blocks >= 262 && n_blocks < SIZE_DOUBLE_INDIRECT) {
-        goto handle_double_indirect_blocks;
-    }
-
-// this handles the direct block writing.
-    handle_direct_blocks:
-    i = n_blocks;
-    cnt_offset = n_blocks * FS_BLOCK_SIZE;
-    for (; i < 6; i++) {
-        int j = 0;
-        disk->ops->read(disk, inode.direct[i], 1, block);
-        char *string = block;
-        for (j = 0; j < FS_BLOCK_SIZE; j++) {
-            if (cnt_offset < offset)
-                cnt_offset++;
-            else {
-                if (len > 0 && (offset + num_copied) < inode.size) {
-                    // add data to the buffer from str
-                    *buf = *(string + j);
-                    num_copied++;
-                    len--;
-                } else {
-                    goto cleanup;
-                }
-                buf++;
-            }
+    /* the pointer blocks first (a cluster can straddle two), so setting
+     * the slots below can't fail
+     */
+    if ((!old[0] && bmap_set(ino, inode, first, 0) < 0) ||
+        (!old[nslots - 1] && bmap_set(ino, inode, first + nslots - 1, 0) < 0)) {
+        ret = -ENOSPC;
+        goto out;
+    }
+
+    /* keep the blocks the cluster had, and add to them contiguously */
+    for (i = 0; i < n && i < nhave; i++)
+        map[i] = have[i];
+    while (i < n) {
+        int start, goal = i > 0 ? map[i - 1] + 1 : 0;
+        int got = get_free_blocks(n - i, goal, &start);
+        if (got < 0) {
+            for (j = nhave; j < i; j++)
+                free_a_block(map[j]);
+            ret = -ENOSPC;
+            goto out;
         }
+        for (j = 0; j < got; j++)
+            map[i++] = start + j;
     }
 
-// this handles indirect level 1 blocks
-    handle_indirect_blocks:
-    i = 0;
-    disk->ops->read(disk, inode.indir_1, 1, indirect_1);
-    int *blocks = indirect_1;
-    if (n_blocks >= 6) {
-        i = n_blocks - 6;
-        blocks += i;
-    }
-    cnt_offset = (i + 6) * FS_BLOCK_SIZE;
-    for (; i < ADDR_PER_BLOCK; i++) {
-        int j = 0;
-        disk->ops->read(disk, *blocks, 1, block);
-        char *string = block;
-        for (j = 0; j < FS_BLOCK_SIZE; j++) {
-            if (cnt_offset < offset)
-                cnt_offset++;
-            else {
-                if (len > 0 && (offset + num_copied) < inode.size) {
-                    *buf = *(string + j);
-                    num_copied++;
-                    len--;
-                } else {
-                    goto cleanup;
-                }
-                buf++;
-            }
-        }
-        blocks++;
+    for (i = 0; i < n; i = j) {
+        for (j = i + 1; j < n && map[j] == map[j - 1] + 1; j++)
+            ;
+        disk->ops->write(disk, map[i], j - i, data + ((size_t) i << blk_shift));
     }
 
-// this handles indirect level 2 blocks
-    handle_double_indirect_blocks:
-    i = 0;
-    int j = 0;
-    disk->ops->read(disk, inode.indir_2, 1, indirect_2);
-    int *indirect_level1_blocks = indirect_2;
-    if (n_blocks >= 262) {
-        i = (n_blocks - 262) / ADDR_PER_BLOCK;
-        indirect_level1_blocks += i;
-        j = (n_blocks - 262) % ADDR_PER_BLOCK;
-
-    }
-    cnt_offset = (262 + (i * ADDR_PER_BLOCK)) * FS_BLOCK_SIZE;
-    for (; i < ADDR_PER_BLOCK; i++) {
-        disk->ops->read(disk, *indirect_level1_blocks, 1, indirect_1);
-        int *indirect_level2_blocks = indirect_1;
-        indirect_level2_blocks += j;
-        cnt_offset += j * FS_BLOCK_SIZE;
-        for (; j < ADDR_PER_BLOCK; j++) {
-            int k = 0;
-            disk->ops->read(disk, *indirect_level2_blocks, 1, block);
-            char *string = block;
-            for (k = 0; k < FS_BLOCK_SIZE; k++) {
-                if (cnt_offset < offset)
-                    cnt_offset++;
-                else {
-                    if (len > 0 && (offset + num_copied) < inode.size) {
-                        *buf = *(string + k);
-                        num_copied++;
-                        len--;
-                    } else {
-                        goto cleanup;
-                    }
-                    buf++;
-                }
-            }
-            indirect_level2_blocks++;
+    j = 0;
+    if (data == z)
+        bmap_set(ino, inode, first + j++, (int) FS_CLUSTER_MARK);
+    for (i = 0; i < n; i++)
+        bmap_set(ino, inode, first + j++, map[i]);
+    for (; j < FS_CLUSTER; j++)
+        if (old[j])
+            bmap_set(ino, inode, first + j, 0);
+    for (i = n; i < nhave; i++)
+        free_a_block(have[i]);
+
+  out:
+    free(z);
+    return ret;
+}
+
+// write_inum for an FS_COMPRESS file, with its inode copied into 'inode'
+static int write_compressed(int inum, struct fs_inode *inode, const char *buf,
+                            size_t len, off_t offset, struct fuse_file_info *fi) {
+    if ((offset + len - 1) >> blk_shift >= CLUSTER_MAX_BLOCKS ||
+        (!size64 && offset + len > INT32_MAX))
+        return -EFBIG;
+
+    struct fs_ino *ino = file_ino(inum, fi);
+    char *cl = malloc(CLUSTER_BYTES);
+    off_t size = inode_size(inode), pos = offset, end = offset + len;
+    int ret = 0;
+
+    ino->gen++;
+    while (pos < end) {
+        int c = pos / CLUSTER_BYTES;
+        off_t start = (off_t) c * CLUSTER_BYTES;
+        int lo = pos - start;
+        int hi = (end - start < CLUSTER_BYTES) ? end - start : CLUSTER_BYTES;
+        off_t new_size = (start + hi > size) ? start + hi : size;
+        int valid = (new_size - start < CLUSTER_BYTES) ? new_size - start : CLUSTER_BYTES;
+
+        /* keep what isn't overwritten, if there is anything */
+        if (start < size && (lo > 0 || hi < valid)) {
+            if ((ret = cluster_read(ino, inode, c, cl)) < 0)
+                break;
+            if (size - start < CLUSTER_BYTES)
+                memset(cl + (size - start), 0, CLUSTER_BYTES - (size - start));
+        } else
+            memset(cl, 0, CLUSTER_BYTES);
+        memcpy(cl + lo, buf + (pos - offset), hi - lo);
+        if ((ret = cluster_write(ino, inode, c, cl, valid)) < 0)
+            break;
+        pos = start + hi;
+        if (pos > size) {
+            size = pos;
+            set_inode_size(inode, size);
         }
-        j = 0;
-        indirect_level1_blocks++;
     }
+    if (pos > offset)           /* as much as fit */
+        ret = pos - offset;
 
-// this is the cleanup. free's the blocks and additional variables.
-    cleanup:
-    *buf = '\0';
-    if (block) {
-        free(block);
-    }
+    inode->mtime = time(NULL);
+    inodes[inum] = *inode;
+    mark_inode_dirty(inum);
+    write_dirty_inodes();
+    write_block_map();
+    free(cl);
+    if (fi == NULL || fi->fh == 0)
+        iput(ino);
+    return ret;
+}
 
-    if (indirect_1) {
-        free(indirect_1);
+// read_inum for an FS_COMPRESS file; 'len' is within the file
+static int read_compressed(int inum, char *buf, size_t len, off_t offset,
+                           struct fuse_file_info *fi) {
+    struct fs_ino *ino = file_ino(inum, fi);
+    struct fs_file *f = (fi != NULL && fi->fh != 0) ?
+        (struct fs_file *) (uintptr_t) fi->fh : NULL;
+    int cached = -1, ret = 0;
+    size_t done;
+    char *cl;
+
+    if (f != NULL) {
+        pthread_mutex_lock(&f->ra_lock);
+        if (f->cl_buf == NULL)
+            f->cl_buf = malloc(CLUSTER_BYTES);
+        else if (f->cl_gen == ino->gen)
+            cached = f->cl_idx;
+        cl = f->cl_buf;
+    } else
+        cl = malloc(CLUSTER_BYTES);
+
+    for (done = 0; done < len; ) {
+        off_t pos = offset + done;
+        int c = pos / CLUSTER_BYTES, lo = pos - (off_t) c * CLUSTER_BYTES;
+        int n = (len - done < CLUSTER_BYTES - lo) ? len - done : CLUSTER_BYTES - lo;
+        if (c != cached) {
+            cached = -1;
+            if ((ret = cluster_read(ino, &inodes[inum], c, cl)) < 0)
+                break;
+            cached = c;
+        }
+        memcpy(buf + done, cl + lo, n);
+        done += n;
     }
+    if (ret == 0)
+        ret = len;
 
-    if (indirect_2) {
-        free(indirect_2);
+    if (f != NULL) {
+        f->cl_idx = cached;
+        f->cl_gen = ino->gen;
+        pthread_mutex_unlock(&f->ra_lock);
+    } else {
+        free(cl);
+        iput(ino);
     }
-
-    return num_copied;
+    return ret;
 }
 
-
-/* write - write data to a file
- * It should return exactly the number of bytes requested, except on
- * error.
- * Errors - path resolution, ENOENT, EISDIR
- *  return EINVAL if 'offset' is greater than current file length.
- *  (POSIX semantics support the creation of files with "holes" in them,
- *   but we don't)
+/* Readahead. Each open file watches for sequential reads; while they
+ * continue, the blocks following each read are fetched into ra_buf
+ * before they're asked for, asynchronously if the device can do that.
+ * The window starts at RA_MIN blocks and doubles with each sequential
+ * read up to RA_MAX 1K blocks' worth (fewer, bigger blocks when the
+ * block size is bigger); any other read turns it off. Fetching the window
+ * also pulls in the pointer blocks mapping it. ra_buf is only used if
+ * the in-core inode's generation hasn't changed since it was filled.
  */
-static int fs_write(const char *path, const char *buf, size_t len,
-                    off_t offset, struct fuse_file_info *fi) {
+#define RA_MIN 4
+#define RA_MAX 128
+#define RA_LIMIT ((RA_MAX >> (blk_shift - 10)) > RA_MIN ? (RA_MAX >> (blk_shift - 10)) : RA_MIN)
 
-    struct stat sb;
-    struct utimbuf ut;
-    ut.modtime = time(NULL);
-    int ret = fs_getattr(path, &sb);
+/* wait for this file's readahead requests. Completions of other files'
+ * requests can turn up here too; they're credited to their owners.
+ */
+static void ra_wait(struct fs_file *f) {
+    struct blkdev_req *done[16];
+    int i, n;
+
+    while (__atomic_load_n(&f->ra_pending, __ATOMIC_ACQUIRE) > 0) {
+        n = disk->ops->complete(disk, done, 1, 16);
+        for (i = 0; i < n; i++) {
+            struct fs_file *owner = done[i]->priv;
+            if (done[i]->result < 0)
+                owner->ra_error = 1;
+            __atomic_sub_fetch(&owner->ra_pending, 1, __ATOMIC_RELEASE);
+        }
+        if (n == 0)
+            sched_yield();      /* another thread is finishing ours */
+    }
+}
 
-    /* error-checking for path resolution */
-    if (ret == -ENOENT || ret == -ENOTDIR)
-        return ret;
+// start fetching file blocks [start, start+n) into ra_buf
+static void ra_issue(struct fs_file *f, int start, int n) {
+    int nfile = (inode_size(&inodes[f->inum]) + BLK_MASK) >> blk_shift;
+    struct blkdev_req *ptrs[RA_MAX];
+    int map[RA_MAX];
+    int i, j, nreqs = 0;
+
+    f->ra_len = 0;
+    if (start >= nfile)
+        return;
+    if (n > nfile - start)
+        n = nfile - start;
+    if (f->ra_buf == NULL) {
+        f->ra_buf = malloc(RA_LIMIT * blk_size);
+        f->ra_reqs = malloc(RA_MAX * sizeof(struct blkdev_req));
+    }
+
+    for (i = 0; i < n; i++)
+        map[i] = bmap(f->ino, start + i);
+    for (i = 0; i < n; i = j) {
+        for (j = i + 1; j < n && map[i] && map[j] == map[j - 1] + 1; j++)
+            ;
+        if (!map[i]) {
+            memset(f->ra_buf + i * blk_size, 0, (j - i) * blk_size);
+            continue;
+        }
+        f->ra_reqs[nreqs] = (struct blkdev_req) {
+            .write = 0, .first_blk = map[i], .num_blks = j - i,
+            .buf = f->ra_buf + i * blk_size, .priv = f};
+        ptrs[nreqs] = &f->ra_reqs[nreqs];
+        nreqs++;
+    }
+
+    f->ra_error = 0;
+    if (disk->ops->submit != NULL) {
+        f->ra_pending = nreqs;
+        disk->ops->submit(disk, ptrs, nreqs);
+    } else
+        for (i = 0; i < nreqs; i++)
+            if (disk->ops->read(disk, ptrs[i]->first_blk, ptrs[i]->num_blks,
+                                ptrs[i]->buf) < 0)
+                f->ra_error = 1;
+    f->ra_start = start;
+    f->ra_len = n;
+    f->ra_gen = f->ino->gen;
+}
 
-    struct fs_inode inode = inodes[sb.st_ino];
+static int read_inum(int inum, char *buf, size_t len, off_t offset,
+                     struct fuse_file_info *fi) {
+    struct fs_inode *inode = &inodes[inum];
 
     /* if given path is a directory instead of file */
-    if (S_ISDIR(inode.mode)) {
+    if (S_ISDIR(inode->mode)) {
         return -EISDIR;
     }
 
-    /* if offset > current file length */
-    if (offset > inode.size)
-        return -EINVAL;
-
-    int number_of_blocks = offset / FS_BLOCK_SIZE;
-
-    int total_bytes_written = 0;
-    int total_bytes_in_block = 0;
-    void *block = malloc(FS_BLOCK_SIZE);
-    void *indirect_1 = malloc(FS_BLOCK_SIZE);
-    void *indirect_2 = malloc(FS_BLOCK_SIZE);
-    int i = 0;
-    if (number_of_blocks < 6) {
-        goto handle_writing_direct_blocks;
-    } else if (number_of_blocks >= 6 && number_of_blocks < 262) {
-        goto handle_writing_indirect_blocks_level1;
-    } else if (number_of_blocks >= 262 && number_of_blocks < SIZE_DOUBLE_INDIRECT) {
-        goto handle_writing_indirect_level2_blocks;
-    }
-
-// this handles writing to direct blocks
-    handle_writing_direct_blocks:
-    i = number_of_blocks;
-
-    for (; i < 6; i++) {
-        if (!inode.direct[i]) {
-            ret = get_free_block();
-            if (ret == -ENOSPC) {
-                total_bytes_written = -ENOSPC;
-                goto cleanup;
-            }
-            write_block_map();
-            disk->ops->read(disk, ret, 1, block);
-            memset(block, 0, FS_BLOCK_SIZE);
-            inode.direct[i] = ret;
-            total_bytes_in_block = 0;
-        } else {
-            disk->ops->read(disk, inode.direct[i], 1, block);
-            total_bytes_in_block = offset % FS_BLOCK_SIZE;
-        }
-        char *start = block + total_bytes_in_block;
-        if (total_bytes_in_block == 0)
-            offset = 0;
-
-        /* fill the current block */
-        int remaining_bytes_of_block = 0;
-        remaining_bytes_of_block = FS_BLOCK_SIZE - total_bytes_in_block;
-        if (len > remaining_bytes_of_block)
-            len = len - remaining_bytes_of_block;
-        else {
-            remaining_bytes_of_block = len;
-            len = 0;
-        }
-        memcpy(start, buf, remaining_bytes_of_block);
-        buf += remaining_bytes_of_block;
-        total_bytes_written += remaining_bytes_of_block;
-        start += remaining_bytes_of_block;
-        inode.size += remaining_bytes_of_block;
-        /* write block and inode back to disk */
-        inodes[sb.st_ino] = inode;
-        write_all_inodes();
-        disk->ops->write(disk, inode.direct[i], 1, block);
-        if (len == 0) {
-            goto cleanup;
+    /* if offset >= file len */
+    off_t size = inode_size(inode);
+    if (offset >= size || len == 0) {
+        return 0;
+    }
+    if (offset + len > size) {
+        len = size - offset;
+    }
+    if (inode->flags & FS_INLINE) {
+        memcpy(buf, INLINE(inum) + offset, len);
+        return len;
+    }
+    if (inode->flags & FS_COMPRESS)
+        return read_compressed(inum, buf, len, offset, fi);
+
+    struct fs_ino *ino = file_ino(inum, fi);
+    struct fs_file *f = (fi != NULL && fi->fh != 0) ?
+        (struct fs_file *) (uintptr_t) fi->fh : NULL;
+    int first = offset >> blk_shift;
+    int nblks = ((offset + len - 1) >> blk_shift) - first + 1;
+    int *map = malloc(nblks * sizeof(int));
+    const char **src = calloc(nblks, sizeof(*src));
+    char *data = malloc((size_t) nblks * blk_size);
+    int i, j, done;
+
+    if (f != NULL) {
+        pthread_mutex_lock(&f->ra_lock);
+        ra_wait(f);
+        if (f->ra_error || f->ra_gen != ino->gen)
+            f->ra_len = 0;
+    }
+
+    for (i = 0; i < nblks; i++) {
+        int blk = first + i;
+        if (f != NULL && blk >= f->ra_start && blk < f->ra_start + f->ra_len) {
+            src[i] = f->ra_buf + (blk - f->ra_start) * blk_size;
+            continue;
         }
+        map[i] = bmap(ino, blk);
+        if (map[i] && disk->ops->map != NULL)
+            src[i] = disk->ops->map(disk, map[i]);
     }
-    offset = 0;
-    number_of_blocks = 6;
 
-// this handles writing to level 1 indirect blocks
-    handle_writing_indirect_blocks_level1:
-    i = offset / FS_BLOCK_SIZE;
-
-    if (!inode.indir_1) {
-        ret = get_free_block();
-        if (ret == -ENOSPC) {
-            total_bytes_written = -ENOSPC;
-            goto cleanup;
-        }
-        write_block_map();
-        disk->ops->read(disk, ret, 1, block);
-        memset(block, 0, FS_BLOCK_SIZE);
-        inode.indir_1 = ret;
-        inodes[sb.st_ino] = inode;
-        write_all_inodes();
-        disk->ops->write(disk, inode.indir_1, 1, block);
-    }
-
-    disk->ops->read(disk, inode.indir_1, 1, indirect_1);
-    int *blocks = indirect_1;
-    if (number_of_blocks >= 6) {
-        i = number_of_blocks - 6;
-        blocks += i;
-    }
-
-    for (; i < ADDR_PER_BLOCK; i++) {
-        if (!*blocks) {
-            ret = get_free_block();
-            if (ret == -ENOSPC) {
-                total_bytes_written = -ENOSPC;
-                goto cleanup;
-            }
-            write_block_map();
-            disk->ops->read(disk, ret, 1, block);
-            memset(block, 0, FS_BLOCK_SIZE);
-            *blocks = ret;
-            total_bytes_in_block = 0;
-        } else {
-            disk->ops->read(disk, *blocks, 1, block);
-            total_bytes_in_block = (offset % FS_BLOCK_SIZE);
+    /* blocks that were read ahead, or that the device lends us, are
+     * copied straight from there; the rest take one read for each
+     * physically contiguous run.
+     */
+    for (i = 0; i < nblks; i = j) {
+        if (src[i]) {
+            j = i + 1;
+            continue;
         }
+        for (j = i + 1; j < nblks && !src[j] && map[i] && map[j] == map[j - 1] + 1; j++)
+            ;
+        if (map[i])
+            disk->ops->read(disk, map[i], j - i, data + i * blk_size);
+        else
+            memset(data + i * blk_size, 0, (j - i) * blk_size);
+    }
+    for (i = 0, done = 0; i < nblks; i++) {
+        int start = (i == 0) ? (offset & BLK_MASK) : 0;
+        int n = blk_size - start;
+        if (n > len - done)
+            n = len - done;
+        memcpy(buf + done, (src[i] ? src[i] : data + i * blk_size) + start, n);
+        done += n;
+    }
+
+    /* sequential so far? then fetch the next window, unless what's
+     * already in ra_buf covers where the next read will start.
+     */
+    if (f != NULL) {
+        int next = (offset + len) >> blk_shift;
+        if (offset == f->ra_pos)
+            f->ra_window = f->ra_window ? f->ra_window * 2 : RA_MIN;
+        else
+            f->ra_window = 0;
+        if (f->ra_window > RA_LIMIT)
+            f->ra_window = RA_LIMIT;
+        f->ra_pos = offset + len;
+        if (f->ra_window && (next < f->ra_start || next >= f->ra_start + f->ra_len))
+            ra_issue(f, next, f->ra_window);
+        pthread_mutex_unlock(&f->ra_lock);
+    }
+
+    free(data);
+    free(src);
+    free(map);
+    if (fi == NULL || fi->fh == 0)
+        iput(ino);
+
+    return len;
+}
 
-        char *start = block + total_bytes_in_block;
-        if (total_bytes_in_block == 0) {
-            offset = 0;
-        }
+static int fs_read(const char *path, char *buf, size_t len, off_t offset,
+                   struct fuse_file_info *fi) {
 
-        /* fill the current block */
-        int remaining_bytes_of_block = 0;
-        remaining_bytes_of_block = FS_BLOCK_SIZE - total_bytes_in_block;
-        if (len > remaining_bytes_of_block) {
-            len = len - remaining_bytes_of_block;
-        } else {
-            remaining_bytes_of_block = len;
-            len = 0;
-        }
-        memcpy(start, buf, remaining_bytes_of_block);
-        buf += remaining_bytes_of_block;
-        total_bytes_written += remaining_bytes_of_block;
-        start += remaining_bytes_of_block;
-        inode.size += remaining_bytes_of_block;
-        /* write block and inode back to disk */
-        inodes[sb.st_ino] = inode;
-        write_all_inodes();
-        disk->ops->write(disk, inode.indir_1, 1, indirect_1);
-        disk->ops->write(disk, *blocks, 1, block);
-        if (len == 0) {
-            goto cleanup;
-        }
-        blocks++;
+    int inum = file_inum(path, fi);
+
+    /* error-checking for path resolution */
+    if (inum == -ENOENT || inum == -ENOTDIR) {
+        return inum;
     }
-    offset = 0;
-    number_of_blocks = 262;
 
-// this handles writing to indirect level2 blocks.
-    handle_writing_indirect_level2_blocks:
+    lock_inode(inum, 0);
+    int ret = read_inum(inum, buf, len, offset, fi);
+    unlock_inode(inum);
+    return ret;
+}
 
-    if (!inode.indir_2) {
-        ret = get_free_block();
-        if (ret == -ENOSPC) {
-            // setting this as this var gets returned in cleanup
-            total_bytes_written = -ENOSPC;
-            goto cleanup;
-        }
-        write_block_map();
-        disk->ops->read(disk, ret, 1, block);
-        memset(block, 0, FS_BLOCK_SIZE);
-        inode.indir_2 = ret;
-        inodes[sb.st_ino] = inode;
-        write_all_inodes();
-        disk->ops->write(disk, inode.indir_2, 1, block);
-    }
 
-    disk->ops->read(disk, inode.indir_2, 1, indirect_2);
-    int *outer = indirect_2;
-    i = offset / FS_BLOCK_SIZE;
-    int j = 0;
+static int write_inum(int inum, const char *buf, size_t len,
+                      off_t offset, struct fuse_file_info *fi);
+
+/* move an inline file's data out to a block, making it an ordinary
+ * file. If there's no room it is left as it was.
+ */
+static int inline_spill(int inum, struct fuse_file_info *fi) {
+    struct fs_inode *inode = &inodes[inum];
+    int size = inode_size(inode), ret = 0;
+    char data[inline_max];
+
+    memcpy(data, INLINE(inum), size);
+    inline_set(inum, 0, NULL, inline_max);
+    inode->flags &= ~FS_INLINE;
+    set_inode_size(inode, 0);
+    if (extents && !(inode->flags & FS_COMPRESS))
+        ext_init(inode);
+    if (size == 0 || (ret = write_inum(inum, data, size, 0, fi)) == size)
+        return 0;
 
-    if (number_of_blocks >= 262) {
-        i = (number_of_blocks - 262) / ADDR_PER_BLOCK;
-        outer += i;
+    free_file_blocks(inode);
+    ino_invalidate(inum);
+    inline_init(inode, inum);
+    inline_set(inum, 0, data, size);
+    set_inode_size(inode, size);
+    mark_inode_dirty(inum);
+    write_dirty_inodes();
+    write_block_map();
+    return ret < 0 ? ret : -ENOSPC;
+}
 
-        j = (number_of_blocks - 262) % ADDR_PER_BLOCK;
+/* write - write data to a file
+ * It should return exactly the number of bytes requested, except on
+ * error.
+ * Errors - path resolution, ENOENT, EISDIR
+ *
+ * Writing past the end of the file leaves a hole: the blocks in between
+ * aren't allocated, and read back as zeros.
+ *
+ * Blocks that need to be allocated are reserved up front as one or a
+ * few contiguous runs, and the data goes out as one multi-block write
+ * per physically contiguous run. Only the first and last blocks can be
+ * partly overwritten, so they're the only ones ever read first.
+ */
+static int write_inum(int inum, const char *buf, size_t len,
+                      off_t offset, struct fuse_file_info *fi) {
+    int ret;
+    struct fs_inode inode = inodes[inum];
 
+    /* if given path is a directory instead of file */
+    if (S_ISDIR(inode.mode)) {
+        return -EISDIR;
     }
 
-    for (i = i; i < ADDR_PER_BLOCK; i++) {
-        if (!*outer) {
-            ret = get_free_block();
-            if (ret == -ENOSPC) {
-                total_bytes_written = -ENOSPC;
-                goto cleanup;
-            }
-            write_block_map();
-            disk->ops->read(disk, ret, 1, indirect_1);
-            memset(indirect_1, 0, FS_BLOCK_SIZE);
-            *outer = ret;
-            disk->ops->write(disk, inode.indir_2, 1, indirect_2);
+    if (len == 0)
+        return 0;
+
+    /* an inline file stays that way while it fits */
+    if (inode.flags & FS_INLINE) {
+        if (offset + len <= inline_max) {
+            inline_set(inum, offset, buf, len);
+            if (offset + len > inode_size(&inode))
+                set_inode_size(&inode, offset + len);
+            inode.mtime = time(NULL);
+            inodes[inum] = inode;
+            mark_inode_dirty(inum);
+            write_dirty_inodes();
+            return len;
         }
+        if ((ret = inline_spill(inum, fi)) < 0)
+            return ret;
+        inode = inodes[inum];
+    }
+    if (inode.flags & FS_COMPRESS)
+        return write_compressed(inum, &inode, buf, len, offset, fi);
+
+    if ((offset + len - 1) >> blk_shift >= FILE_MAX_BLOCKS(&inode) ||
+        (!size64 && offset + len > INT32_MAX))
+        return -EFBIG;
+    int first = offset >> blk_shift;
+    int last = (offset + len - 1) >> blk_shift;
+
+    struct fs_ino *ino = file_ino(inum, fi);
+    int nblks = last - first + 1;
+    ino->gen++;
+    int *map = malloc((size_t) nblks * sizeof(int));
+    int i, j, k;
+
+    for (i = 0; i < nblks; i++)
+        map[i] = bmap(ino, first + i);
+
+    /* the first and last blocks keep whatever part of them isn't
+     * overwritten, if they hold anything yet.
+     */
+    int keep_first = map[0] && (offset & BLK_MASK) != 0;
+    int keep_last = map[nblks - 1] && ((offset + len) & BLK_MASK) != 0;
 
-        disk->ops->read(disk, *outer, 1, indirect_1);
-        int *inner = indirect_1;
-
-        inner += j;
-        for (j = j; j < ADDR_PER_BLOCK; j++) {
-            if (!*inner) {
-                ret = get_free_block();
-                if (ret == -ENOSPC) {
-                    total_bytes_written = -ENOSPC;
-                    goto cleanup;
-                }
-                write_block_map();
-                disk->ops->read(disk, ret, 1, block);
-                memset(block, 0, FS_BLOCK_SIZE);
-                *inner = ret;
-                total_bytes_in_block = 0;
-            } else {
-                disk->ops->read(disk, *inner, 1, block);
-                total_bytes_in_block = (offset % FS_BLOCK_SIZE);
-            }
-            char *start = block + total_bytes_in_block;
-
-            /* fill the current block */
-            int remaining_bytes_of_block = 0;
-            remaining_bytes_of_block = FS_BLOCK_SIZE - total_bytes_in_block;
-            if (len > remaining_bytes_of_block) {
-                len = len - remaining_bytes_of_block;
-            } else {
-                remaining_bytes_of_block = len;
-                len = 0;
+    /* reserve each unallocated run (holes, or the blocks past the end)
+     * as contiguously as possible, right after the block before it.
+     */
+    for (i = 0; i < nblks; i = j) {
+        if (map[i]) {
+            j = i + 1;
+            continue;
+        }
+        for (j = i + 1; j < nblks && !map[j]; j++)
+            ;
+        int goal = i > 0 ? map[i - 1] : first > 0 ? bmap(ino, first - 1) : 0;
+        if (goal)
+            goal++;
+        for (k = i; k < j;) {
+            int start, n = get_free_blocks(j - k, goal, &start), m;
+            if (n < 0)
+                break;
+            for (m = 0; m < n; m++) {
+                if (bmap_set(ino, &inode, first + k, start + m) < 0)
+                    break;
+                map[k++] = start + m;
             }
-            memcpy(start, buf, remaining_bytes_of_block);
-            buf += remaining_bytes_of_block;
-            total_bytes_written += remaining_bytes_of_block;
-            start += remaining_bytes_of_block;
-            inode.size += remaining_bytes_of_block;
-            /* write block and inode back to disk */
-            inodes[sb.st_ino] = inode;
-            write_all_inodes();
-            disk->ops->write(disk, *inner, 1, block);
-            disk->ops->write(disk, *outer, 1, indirect_1);
-            if (len == 0) {
-                goto cleanup;
+            if (m < n) {        /* out of space for indirect blocks */
+                for (; m < n; m++)
+                    free_a_block(start + m);
+                break;
             }
-            inner++;
+            goal = start + n;
+        }
+        if (k < j) {
+            i = k;
+            break;
+        }
+    }
+
+    /* if we ran out of space, write as much as fits
+     */
+    if (i < nblks) {
+        nblks = i;
+        if (nblks == 0) {
+            ret = -ENOSPC;
+            goto cleanup;
         }
-        j = 0;
-        outer++;
+        len = ((size_t) nblks << blk_shift) - (offset & BLK_MASK);
     }
 
+    /* assemble the new contents: a partly overwritten block is read
+     * first if it already existed, otherwise zeroed.
+     */
+    char *data = malloc((size_t) nblks * blk_size);
+    char *last_blk = data + (size_t) (nblks - 1) * blk_size;
+    if (keep_first)
+        disk->ops->read(disk, map[0], 1, data);
+    else if ((offset & BLK_MASK) != 0)
+        memset(data, 0, blk_size);
+    if (nblks == 1 && (offset & BLK_MASK) != 0)
+        ;                       /* the same block */
+    else if (keep_last && nblks == last - first + 1)    /* not cut short */
+        disk->ops->read(disk, map[nblks - 1], 1, last_blk);
+    else if (((offset + len) & BLK_MASK) != 0)
+        memset(last_blk, 0, blk_size);
+    memcpy(data + (offset & BLK_MASK), buf, len);
+
+    for (i = 0; i < nblks; i = j) {
+        for (j = i + 1; j < nblks && map[j] == map[j - 1] + 1; j++)
+            ;
+        disk->ops->write(disk, map[i], j - i, data + (size_t) i * blk_size);
+    }
+    free(data);
+
+    if (offset + len > inode_size(&inode))
+        set_inode_size(&inode, offset + len);
+    ret = len;
 
     cleanup:
+    // updating modified time, then write the inode and block map out
+    // once for the whole request.
+    inode.mtime = time(NULL);
+    inodes[inum] = inode;
+    mark_inode_dirty(inum);
+    write_dirty_inodes();
+    write_block_map();
+    free(map);
+    if (fi == NULL || fi->fh == 0)
+        iput(ino);
 
-    // updating modified time.
-    ut.modtime = time(NULL);
-    fs_utime(path, &ut);
+    return ret;
+}
 
-    if (block) {
-        free(block);
-    }
+static int fs_write(const char *path, const char *buf, size_t len,
+                    off_t offset, struct fuse_file_info *fi) {
 
-    if (indirect_1) {
-        free(indirect_1);
-    }
+    int inum = file_inum(path, fi);
 
-    if (indirect_2) {
-        free(indirect_2);
-    }
+    /* error-checking for path resolution */
+    if (inum == -ENOENT || inum == -ENOTDIR)
+        return inum;
 
-    return total_bytes_written;
+    op_begin();
+    lock_inode(inum, 1);
+    int ret = write_inum(inum, buf, len, offset, fi);
+    unlock_inode(inum);
+    op_end();
+    return ret;
 }
 
 
+/* open - resolve the path once and keep the result in fi->fh, so
+ * read/write/ftruncate on the open file don't do any directory work.
+ */
 static int fs_open(const char *path, struct fuse_file_info *fi) {
+    char *_path = strdupa(path);
+    int inum = translate_path_to_inum(_path);
+
+    if (inum < 0)
+        return inum;
+    lock_inode(inum, 0);
+    int isDir = S_ISDIR(inodes[inum].mode);
+    unlock_inode(inum);
+    if (isDir)
+        return -EISDIR;
+
+    struct fs_file *f = calloc(1, sizeof(*f));
+    if (f == NULL)
+        return -ENOMEM;
+    pthread_mutex_init(&f->ra_lock, NULL);
+    f->inum = inum;
+    f->inode = &inodes[inum];
+    f->ino = iget(inum);
+    fi->fh = (uint64_t) (uintptr_t) f;
     return 0;
 }
 
 static int fs_release(const char *path, struct fuse_file_info *fi) {
+    struct fs_file *f = (struct fs_file *) (uintptr_t) fi->fh;
+    if (f == NULL)              /* never opened */
+        return 0;
+    ra_wait(f);
+    iput(f->ino);
+    pthread_mutex_destroy(&f->ra_lock);
+    free(f->ra_buf);
+    free(f->ra_reqs);
+    free(f->cl_buf);
+    free(f);
+    fi->fh = 0;
+    return 0;
+}
+
+/* fsync - write back any dirty cached blocks
+ */
+static int fs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    if (disk->ops->flush(disk, 0, max_num_blocks) < 0)
+        return -EIO;
     return 0;
 }
 
+/* destroy - called once at unmount; make sure everything in the
+ * buffer cache reaches the image. With a journal, blocks still waiting
+ * for their free to commit (see free_a_block) can be released after
+ * the first flush.
+ */
+void fs_destroy(void *private_data) {
+    disk->ops->flush(disk, 0, max_num_blocks);
+    if (n_freed > 0) {
+        op_begin();
+        pthread_mutex_lock(&alloc_lock);
+        release_freed(journal_seq(journal));
+        pthread_mutex_unlock(&alloc_lock);
+        write_block_map();
+        op_end();
+        disk->ops->flush(disk, 0, max_num_blocks);
+    }
+}
+
 /* statfs - get file system statistics
  * see 'man 2 statfs' for description of 'struct statvfs'.
  * Errors - none.
@@ -1372,48 +2929,280 @@ static int fs_statfs(const char *path, struct statvfs *st) {
      *   f_bavail = f_bfree
      *   f_namelen = <whatever your max namelength is>
      *
-     * this should work fine, but you may want to add code to
-     * calculate the correct values later.
+     * the free counts are maintained by the allocator, so this is O(1).
      */
+    memset(st, 0, sizeof(*st));
+    st->f_bsize = blk_size;
+    st->f_blocks = max_num_blocks - (1 + block_map_sz + inode_map_sz + inode_reg_sz + journal_sz);
+    pthread_mutex_lock(&alloc_lock);
+    st->f_bfree = free_blocks;
+    st->f_ffree = free_inodes;
+    pthread_mutex_unlock(&alloc_lock);
+    st->f_bavail = st->f_bfree;
+    st->f_files = num_inodes - 1;
+    st->f_namemax = MAX_LENGTH_OF_DIR_NAME + 1;
 
-    int i, cnt_offset;
-    cnt_offset = 0;
-    for (i = 1; i < block_map_sz * FS_BLOCK_SIZE; i++) {
-        if (!FD_ISSET(i, block_map)) {
-            cnt_offset++;
-        }
+    return 0;
+}
+
+/* statistics. Each entry point below is timed (stats.c) on its way
+ * to the fs_ function that does the work. The counters show up as the
+ * read-only file /.stats, which isn't on disk: it's answered here,
+ * before the path ever gets looked up. Truncating it zeroes them.
+ */
+enum {OP_GETATTR, OP_OPENDIR, OP_READDIR, OP_RELEASEDIR, OP_MKNOD, OP_MKDIR,
+      OP_UNLINK, OP_RMDIR, OP_RENAME, OP_CHMOD, OP_UTIME, OP_TRUNCATE,
+      OP_FTRUNCATE, OP_OPEN, OP_READ, OP_WRITE, OP_RELEASE, OP_FSYNC,
+      OP_STATFS, OP_DESTROY, N_OPS};
+
+static const char *op_names[N_OPS] = {
+    "getattr", "opendir", "readdir", "releasedir", "mknod", "mkdir",
+    "unlink", "rmdir", "rename", "chmod", "utime", "truncate",
+    "ftruncate", "open", "read", "write", "release", "fsync", "statfs",
+    "destroy"};
+static struct op_stats *op_stats[N_OPS];
+
+#define STATS_NAME ".stats"
+#define is_stats(path) (strcmp(path, "/" STATS_NAME) == 0)
+
+static int op_done(int op, uint64_t start, int ret)
+{
+    return op_stats_done(op_stats[op], start, ret);
+}
+
+static void stats_attrs(struct stat *sb, int len)
+{
+    memset(sb, 0, sizeof(*sb));
+    sb->st_mode = S_IFREG | 0444;
+    sb->st_nlink = 1;
+    sb->st_uid = getuid();
+    sb->st_gid = getgid();
+    sb->st_size = len;
+    sb->st_atime = sb->st_mtime = sb->st_ctime = time(NULL);
+}
+
+static void *timed_init(struct fuse_conn_info *conn)
+{
+    int i;
+    if (op_stats[0] == NULL)
+        for (i = 0; i < N_OPS; i++)
+            op_stats[i] = op_stats_register(op_names[i]);
+    return fs_init(conn);
+}
+
+static int timed_getattr(const char *path, struct stat *sb)
+{
+    uint64_t t = stats_now();
+    if (is_stats(path)) {
+        char *text;
+        stats_attrs(sb, stats_format(&text));
+        free(text);
+        return op_done(OP_GETATTR, t, 0);
     }
+    return op_done(OP_GETATTR, t, fs_getattr(path, sb));
+}
 
-    st->f_bsize = FS_BLOCK_SIZE;
-    st->f_blocks = max_num_blocks - (1 + block_map_sz + inode_map_sz + inode_reg_sz);           /* probably want to */
-    st->f_bfree = st->f_blocks - cnt_offset;            /* change these */
-    st->f_bavail = st->f_bfree;           /* values */
-    st->f_namemax = MAX_LENGTH_OF_DIR_NAME + 1;
+static int timed_opendir(const char *path, struct fuse_file_info *fi)
+{
+    uint64_t t = stats_now();
+    return op_done(OP_OPENDIR, t, fs_opendir(path, fi));
+}
 
-    return 0;
+static int timed_readdir(const char *path, void *ptr, fuse_fill_dir_t filler,
+                         off_t offset, struct fuse_file_info *fi)
+{
+    uint64_t t = stats_now();
+    int val = fs_readdir(path, ptr, filler, offset, fi);
+    if (val == 0 && strcmp(path, "/") == 0) {
+        struct stat sb;
+        stats_attrs(&sb, 0);
+        filler(ptr, STATS_NAME, &sb, 0);
+    }
+    return op_done(OP_READDIR, t, val);
+}
+
+static int timed_releasedir(const char *path, struct fuse_file_info *fi)
+{
+    uint64_t t = stats_now();
+    return op_done(OP_RELEASEDIR, t, fs_releasedir(path, fi));
+}
+
+static int timed_mknod(const char *path, mode_t mode, dev_t dev)
+{
+    uint64_t t = stats_now();
+    if (is_stats(path))
+        return op_done(OP_MKNOD, t, -EEXIST);
+    return op_done(OP_MKNOD, t, fs_mknod(path, mode, dev));
+}
+
+static int timed_mkdir(const char *path, mode_t mode)
+{
+    uint64_t t = stats_now();
+    if (is_stats(path))
+        return op_done(OP_MKDIR, t, -EEXIST);
+    return op_done(OP_MKDIR, t, fs_mkdir(path, mode));
+}
+
+static int timed_unlink(const char *path)
+{
+    uint64_t t = stats_now();
+    if (is_stats(path))
+        return op_done(OP_UNLINK, t, -EPERM);
+    return op_done(OP_UNLINK, t, fs_unlink(path));
+}
+
+static int timed_rmdir(const char *path)
+{
+    uint64_t t = stats_now();
+    if (is_stats(path))
+        return op_done(OP_RMDIR, t, -ENOTDIR);
+    return op_done(OP_RMDIR, t, fs_rmdir(path));
+}
+
+static int timed_rename(const char *src_path, const char *dst_path)
+{
+    uint64_t t = stats_now();
+    if (is_stats(src_path) || is_stats(dst_path))
+        return op_done(OP_RENAME, t, -EPERM);
+    return op_done(OP_RENAME, t, fs_rename(src_path, dst_path));
+}
+
+static int timed_chmod(const char *path, mode_t mode)
+{
+    uint64_t t = stats_now();
+    if (is_stats(path))
+        return op_done(OP_CHMOD, t, -EPERM);
+    return op_done(OP_CHMOD, t, fs_chmod(path, mode));
+}
+
+static int timed_utime(const char *path, struct utimbuf *ut)
+{
+    uint64_t t = stats_now();
+    if (is_stats(path))
+        return op_done(OP_UTIME, t, -EPERM);
+    return op_done(OP_UTIME, t, fs_utime(path, ut));
+}
+
+static int timed_truncate(const char *path, off_t len)
+{
+    uint64_t t = stats_now();
+    if (is_stats(path)) {
+        stats_reset();
+        return op_done(OP_TRUNCATE, t, 0);
+    }
+    return op_done(OP_TRUNCATE, t, fs_truncate(path, len));
+}
+
+static int timed_ftruncate(const char *path, off_t len, struct fuse_file_info *fi)
+{
+    uint64_t t = stats_now();
+    if (is_stats(path)) {
+        stats_reset();
+        return op_done(OP_FTRUNCATE, t, 0);
+    }
+    return op_done(OP_FTRUNCATE, t, fs_ftruncate(path, len, fi));
+}
+
+/* opening /.stats takes a snapshot, so that reading it in pieces gives
+ * a consistent copy; fi->fh holds the text. It can be opened for
+ * writing only to truncate it (": > /.stats"), which resets the
+ * counters; writes themselves fail.
+ */
+static int timed_open(const char *path, struct fuse_file_info *fi)
+{
+    uint64_t t = stats_now();
+    if (is_stats(path)) {
+        char *text;
+        if (fi->flags & O_TRUNC)
+            stats_reset();
+        stats_format(&text);
+        fi->fh = (uint64_t) (uintptr_t) text;
+        fi->direct_io = 1;
+        return op_done(OP_OPEN, t, 0);
+    }
+    return op_done(OP_OPEN, t, fs_open(path, fi));
+}
+
+static int timed_read(const char *path, char *buf, size_t len, off_t offset,
+                      struct fuse_file_info *fi)
+{
+    uint64_t t = stats_now();
+    if (is_stats(path)) {
+        char *text = (char *) (uintptr_t) fi->fh;
+        size_t size = strlen(text);
+        if (offset >= size)
+            return op_done(OP_READ, t, 0);
+        if (len > size - offset)
+            len = size - offset;
+        memcpy(buf, text + offset, len);
+        return op_done(OP_READ, t, len);
+    }
+    return op_done(OP_READ, t, fs_read(path, buf, len, offset, fi));
+}
+
+static int timed_write(const char *path, const char *buf, size_t len,
+                       off_t offset, struct fuse_file_info *fi)
+{
+    uint64_t t = stats_now();
+    if (is_stats(path))
+        return op_done(OP_WRITE, t, -EACCES);
+    return op_done(OP_WRITE, t, fs_write(path, buf, len, offset, fi));
+}
+
+static int timed_release(const char *path, struct fuse_file_info *fi)
+{
+    uint64_t t = stats_now();
+    if (is_stats(path)) {
+        free((char *) (uintptr_t) fi->fh);
+        fi->fh = 0;
+        return op_done(OP_RELEASE, t, 0);
+    }
+    return op_done(OP_RELEASE, t, fs_release(path, fi));
+}
+
+static int timed_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    uint64_t t = stats_now();
+    return op_done(OP_FSYNC, t, fs_fsync(path, datasync, fi));
+}
+
+static int timed_statfs(const char *path, struct statvfs *st)
+{
+    uint64_t t = stats_now();
+    return op_done(OP_STATFS, t, fs_statfs(path, st));
+}
+
+static void timed_destroy(void *private_data)
+{
+    uint64_t t = stats_now();
+    fs_destroy(private_data);
+    op_done(OP_DESTROY, t, 0);
 }
 
 /* operations vector. Please don't rename it, as the skeleton code in
  * misc.c assumes it is named 'fs_ops'.
  */
 struct fuse_operations fs_ops = {
-        .init = fs_init,
-        .getattr = fs_getattr,
-        .opendir = fs_opendir,
-        .readdir = fs_readdir,
-        .releasedir = fs_releasedir,
-        .mknod = fs_mknod,
-        .mkdir = fs_mkdir,
-        .unlink = fs_unlink,
-        .rmdir = fs_rmdir,
-        .rename = fs_rename,
-        .chmod = fs_chmod,
-        .utime = fs_utime,
-        .truncate = fs_truncate,
-        .open = fs_open,
-        .read = fs_read,
-        .write = fs_write,
-        .release = fs_release,
-        .statfs = fs_statfs,
+        .init = timed_init,
+        .getattr = timed_getattr,
+        .opendir = timed_opendir,
+        .readdir = timed_readdir,
+        .releasedir = timed_releasedir,
+        .mknod = timed_mknod,
+        .mkdir = timed_mkdir,
+        .unlink = timed_unlink,
+        .rmdir = timed_rmdir,
+        .rename = timed_rename,
+        .chmod = timed_chmod,
+        .utime = timed_utime,
+        .truncate = timed_truncate,
+        .ftruncate = timed_ftruncate,
+        .open = timed_open,
+        .read = timed_read,
+        .write = timed_write,
+        .release = timed_release,
+        .fsync = timed_fsync,
+        .statfs = timed_statfs,
+        .destroy = timed_destroy,
 };
 
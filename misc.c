@@ -13,20 +13,26 @@
 #include <fuse.h>
 #include "blkdev.h"
 
-#include "fsx600.h"		/* only for BLOCK_SIZE */
-
 /*********** DO NOT MODIFY THIS FILE *************/
 
 /* All homework functions are accessed through the operations
  * structure.  
  */
 extern struct fuse_operations fs_ops;
+extern int fs_image_block_size(char *path);
+extern int compress_files;
 
 struct blkdev *disk;
 struct data {
     char *image_name;
     int   part;
     int   cmd_mode;
+    int   cache_kb;
+    int   mmap;
+    int   aio;
+    int   direct;
+    char *trace;
+    int   compress;
 } _data;
 int homework_part;
 
@@ -34,15 +40,28 @@ int homework_part;
  * See comments in /usr/include/fuse/fuse_opts.h for details of 
  * FUSE argument processing.
  * 
- *  usage: ./homework -image disk.img [-part #] directory
+ *  usage: ./homework -image disk.img [-part #] [-cache KB] [-mmap | -aio | -direct]
+ *                    [-trace file] [-compress] directory
  *              disk.img  - name of the image file to mount
  *              directory - directory to mount it on
+ *              KB        - buffer cache size (default 1024)
+ *              -mmap     - access the image through mmap, not read/write
+ *              -aio      - use io_uring (or I/O threads) for the image
+ *              -direct   - use O_DIRECT, bypassing the host's page cache
+ *              -trace    - record all image I/O to 'file' (see replay.c)
+ *              -compress - new files are compressed (FS_COMPRESS)
  */
 static struct fuse_opt opts[] = {
     {"-image %s", offsetof(struct data, image_name), 0},
     {"-cmdline", offsetof(struct data, cmd_mode), 1},
 
     {"-part %d", offsetof(struct data, part), 0},
+    {"-cache %d", offsetof(struct data, cache_kb), 0},
+    {"-mmap", offsetof(struct data, mmap), 1},
+    {"-aio", offsetof(struct data, aio), 1},
+    {"-direct", offsetof(struct data, direct), 1},
+    {"-trace %s", offsetof(struct data, trace), 0},
+    {"-compress", offsetof(struct data, compress), 1},
     FUSE_OPT_END
 };
 
@@ -122,19 +141,28 @@ int do_pwd(char *argv[])
     return 0;
 }
 
-#define DIRENTS_PER_BLOCK (FS_BLOCK_SIZE / sizeof(struct fs_dirent))
-
-char lsbuf[DIRENTS_PER_BLOCK][64];
-int  lsi;
+/* directories can be arbitrarily large, so the listing buffer grows
+ */
+char (*lsbuf)[64];
+int  lsi, lsmax;
 
 void init_ls(void)
 {
     lsi = 0;
 }
 
+static char *next_ls(void)
+{
+    if (lsi == lsmax) {
+	lsmax = lsmax ? 2*lsmax : 64;
+	lsbuf = realloc(lsbuf, lsmax * 64);
+    }
+    return lsbuf[lsi++];
+}
+
 static int filler(void *buf, const char *name, const struct stat *sb, off_t off)
 {
-    sprintf(lsbuf[lsi++], "%s\n", name);
+    sprintf(next_ls(), "%s\n", name);
     return 0;
 }
 
@@ -167,7 +195,7 @@ int do_ls1(char *argv[])
 static int dashl_filler(void *buf, const char *name, const struct stat *sb, off_t off)
 {
     char mode[16];
-    sprintf(lsbuf[lsi++], "%s %s %lld %lld %s",
+    sprintf(next_ls(), "%s %s %lld %lld %s",
             name, strmode(mode, sb->st_mode), sb->st_size, sb->st_blocks,
             ctime(&sb->st_mtime));
     return 0;
@@ -253,13 +281,18 @@ int do_put(char *argv[])
     fix_path(path);
     if ((val = fs_ops.mknod(path, 0777 | S_IFREG, 0)) != 0)
 	return val;
+
+    struct fuse_file_info fi = {0};
+    if ((val = fs_ops.open(path, &fi)) != 0)
+	return val;
     
     while ((len = read(fd, blkbuf, blksiz)) > 0) {
-	val = fs_ops.write(path, blkbuf, len, offset, NULL);
+	val = fs_ops.write(path, blkbuf, len, offset, &fi);
 	if (val != len)
 	    break;
 	offset += len;
     }
+    fs_ops.release(path, &fi);
     close(fd);
     return (val >= 0) ? 0 : val;
 }
@@ -281,14 +314,21 @@ int do_get(char *argv[])
 
     sprintf(path, "%s/%s", cwd, inside);
     fix_path(path);
+
+    struct fuse_file_info fi = {0};
+    if ((len = fs_ops.open(path, &fi)) != 0) {
+	close(fd);
+	return len;
+    }
     while (1) {
-        len = fs_ops.read(path, blkbuf, blksiz, offset, NULL);
+        len = fs_ops.read(path, blkbuf, blksiz, offset, &fi);
 	if (len > 0)
 	    len = write(fd, blkbuf, len);
         if (len <= 0)
 	    break;
 	offset += len;
     }
+    fs_ops.release(path, &fi);
     close(fd);
     return (len >= 0) ? 0 : len;
 }
@@ -299,29 +339,37 @@ int do_get1(char *argv[])
     return do_get(args2);
 }
 
-int do_show(char *argv[])
+static int show(char *path)
 {
-    char *file = argv[0];
-    char path[128];
     int len, offset = 0;
-
-    sprintf(path, "%s/%s", cwd, file);
-    fix_path(path);
-    while ((len = fs_ops.read(path, blkbuf, blksiz, offset, NULL)) > 0) {
+    struct fuse_file_info fi = {0};
+    if ((len = fs_ops.open(path, &fi)) != 0)
+	return len;
+    while ((len = fs_ops.read(path, blkbuf, blksiz, offset, &fi)) > 0) {
 	fwrite(blkbuf, len, 1, stdout);
 	offset += len;
     }
+    fs_ops.release(path, &fi);
 
     return (len >= 0) ? 0 : len;
 }
 
+int do_show(char *argv[])
+{
+    char path[128];
+    sprintf(path, "%s/%s", cwd, argv[0]);
+    return show(fix_path(path));
+}
+
 int do_statfs(char *argv[])
 {
     struct statvfs st;
     int retval = fs_ops.statfs("/", &st);
     if (retval == 0)
-	printf("max name length: %ld\nblock size: %ld\n",
-	       st.f_namemax, st.f_bsize);
+	printf("max name length: %ld\nblock size: %ld\n"
+	       "blocks: %ld free of %ld\ninodes: %ld free of %ld\n",
+	       st.f_namemax, st.f_bsize, (long)st.f_bfree, (long)st.f_blocks,
+	       (long)st.f_ffree, (long)st.f_files);
     return retval;
 }
 
@@ -356,6 +404,20 @@ static int do_utime(char *argv[])
     ut.modtime = time(NULL);
     return fs_ops.utime(fix_path(path), &ut);
 }
+
+/* the file system's counters, from its virtual file /.stats
+ */
+static int do_stats0(char *argv[])
+{
+    return show("/.stats");
+}
+
+static int do_stats1(char *argv[])
+{
+    if (strcmp(argv[0], "reset") != 0)
+        return -EINVAL;
+    return fs_ops.truncate("/.stats", 0);
+}
     
 struct {
     char *name;
@@ -383,6 +445,8 @@ struct {
     {"blksiz", 1, do_blksiz, "blksiz - set read/write block size"},
     {"truncate", 1, do_truncate, "truncate <file> - truncate to zero length"},
     {"utime", 1, do_utime, "utime <file> - set modified time to current time"},
+    {"stats", 0, do_stats0, "stats - show operation and device statistics"},
+    {"stats", 1, do_stats1, "stats reset - zero the statistics"},
     {0, 0, 0}
 };
 
@@ -462,19 +526,43 @@ int main(int argc, char **argv)
         printf("bad image file (must end in .img): %s\n", file);
         exit(1);
     }
-    if ((disk = image_create(file)) == NULL) {
+    int bsize = fs_image_block_size(file);
+    if (_data.mmap)
+        disk = image_mmap_create(file, bsize);
+    else if (_data.aio)
+        disk = image_aio_create(file, bsize);
+    else if (_data.direct)
+        disk = image_direct_create(file, bsize);
+    else
+        disk = image_create(file, bsize);
+    if (disk == NULL) {
         printf("cannot open image file '%s': %s\n", file, strerror(errno));
         exit(1);
     }
+    if (_data.trace != NULL && (disk = trace_create(disk, _data.trace)) == NULL)
+        exit(1);
+    disk = stats_create(disk, "image");
+
+    /* all file system access goes through the buffer cache
+     */
+    if (_data.cache_kb == 0)
+        _data.cache_kb = 1024;
+    if ((disk = bcache_create(disk, _data.cache_kb * 1024 / bsize)) == NULL)
+        exit(1);
 
     homework_part = _data.part;
+    compress_files = _data.compress;
 
     if (_data.cmd_mode) {
         fs_ops.init(NULL);
         _blksiz(1000);
         cmdloop();
+        fs_ops.destroy(NULL);
+        disk->ops->close(disk);
         return 0;
     }
 
-    return fuse_main(args.argc, args.argv, &fs_ops, NULL);
+    int retval = fuse_main(args.argc, args.argv, &fs_ops, NULL);
+    disk->ops->close(disk);
+    return retval;
 }
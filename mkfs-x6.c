@@ -8,40 +8,104 @@
 #include <sys/select.h>
 #include <ctype.h>
 #include <time.h>
-#include <assert.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "fsx600.h"
 
-char *disk;
-
-/* handle K/M
+/* handle K/M/G/T
  */
-int parseint(char *s)
+long long parseint(char *s)
 {
-    int n = strtol(s, &s, 0);
+    long long n = strtoll(s, &s, 0);
     if (tolower(*s) == 'k')
         return n * 1024;
     if (tolower(*s) == 'm')
         return n * 1024 * 1024;
+    if (tolower(*s) == 'g')
+        return n * 1024 * 1024 * 1024;
+    if (tolower(*s) == 't')
+        return n * 1024 * 1024 * 1024 * 1024;
     return n;
 }
 
 #define DIV_ROUND_UP(n, m) ((n) + (m) - 1) / (m)
 
-/* usage: mkfs-x6 [-size #] file.img
- * If file doesn't exist, create with size '#' (K and M suffixes allowed)
+int fd;
+int bs = FS_BLOCK_SIZE;
+
+/* write block 'blk' of the image, which is otherwise left as a hole
+ */
+void put_block(long long blk, void *buf)
+{
+    if (pwrite(fd, buf, bs, blk * bs) != bs) {
+        perror("write");
+        exit(1);
+    }
+}
+
+/* usage: mkfs-x6 [-size #] [-block #] [-index] [-journal #] [-inode #]
+ *                [-compress] file.img
+ * If file doesn't exist, create with size '#' (K, M, G and T suffixes allowed)
+ * -block sets the block size, a power of two from 1K (the default) to
+ *    64K (FS_FEAT_BLKSIZE if it isn't 1K)
+ * -index creates the root directory in hashed (multi-block) format
+ * -journal reserves '#' blocks for the metadata journal (0 for none);
+ *    the default is 1/64 of the disk, between 16 blocks and 8MB
+ * -inode sets the size of an inode on disk, a power of two from 64
+ *    (the default) to the block size. Anything past the first 64 bytes
+ *    holds the data of files that small (FS_FEAT_INLINE).
+ * -compress allows compressed files (FS_FEAT_COMPRESS), which are
+ *    created when it is mounted with -compress
+ *
+ * The image is truncated and extended to size, so everything starts
+ * out as zeros without being written: only the blocks that aren't all
+ * zero are, a block at a time, and the rest stays sparse.
  */
 int main(int argc, char **argv)
 {
-    int i, fd = -1, size = 0;
-    if (!strcmp(argv[1], "-size") && argc >= 3) {
-        size = parseint(argv[2]);
-        argv += 2;
-        argc -= 2;
+    long long i, size = 0;
+    int index_root = 0, n_journal = -1, inode_size = sizeof(struct fs_inode);
+    int compress = 0;
+
+    fd = -1;
+    while (argc > 2) {
+        if (!strcmp(argv[1], "-size") && argc >= 3) {
+            size = parseint(argv[2]);
+            argv += 2;
+            argc -= 2;
+        }
+        else if (!strcmp(argv[1], "-journal") && argc >= 3) {
+            n_journal = parseint(argv[2]);
+            argv += 2;
+            argc -= 2;
+        }
+        else if (!strcmp(argv[1], "-block") && argc >= 3) {
+            bs = parseint(argv[2]);
+            argv += 2;
+            argc -= 2;
+        }
+        else if (!strcmp(argv[1], "-inode") && argc >= 3) {
+            inode_size = parseint(argv[2]);
+            argv += 2;
+            argc -= 2;
+        }
+        else if (!strcmp(argv[1], "-index")) {
+            index_root = 1;
+            argv++;
+            argc--;
+        }
+        else if (!strcmp(argv[1], "-compress")) {
+            compress = 1;
+            argv++;
+            argc--;
+        }
+        else
+            break;
     }
 
     if (argc == 2) {
-        fd = open(argv[1], O_WRONLY | O_CREAT, 0777);
+        fd = open(argv[1], O_RDWR | O_CREAT, 0777);
         if (fd >= 0 && size == 0) {
             struct stat sb;
             fstat(fd, &sb);
@@ -49,54 +113,119 @@ int main(int argc, char **argv)
         }
     }
     if (fd < 0) {
-        printf("usage: mkfs-x6 [-size #] file.img\n");
+        printf("usage: mkfs-x6 [-size #] [-block #] [-index] [-journal #] [-inode #]\n"
+               "    [-compress] file.img\n");
+        exit(1);
+    }
+    if (bs < FS_BLOCK_SIZE || bs > FS_MAX_BLOCK_SIZE || (bs & (bs - 1)) != 0) {
+        printf("bad block size %d: a power of two from %d to %d\n", bs,
+               FS_BLOCK_SIZE, FS_MAX_BLOCK_SIZE);
+        exit(1);
+    }
+    if (inode_size < sizeof(struct fs_inode) || inode_size > bs ||
+        (inode_size & (inode_size - 1)) != 0) {
+        printf("bad inode size %d: a power of two from %d to %d\n", inode_size,
+               (int)sizeof(struct fs_inode), bs);
         exit(1);
     }
+    char *blk = malloc(bs);
 
-    if (size % FS_BLOCK_SIZE != 0)
-        printf("WARNING: disk size not a multiple of block size: %d (0x%x)\n",
+    if (size % bs != 0)
+        printf("WARNING: disk size not a multiple of block size: %lld (0x%llx)\n",
                size, size);
-    int n_blks = size / FS_BLOCK_SIZE;
-    int n_map_blks = DIV_ROUND_UP(n_blks, 8*FS_BLOCK_SIZE);
+    long long n_blks = size / bs;
+    if (n_blks > INT32_MAX) {
+        printf("too big: at most %d blocks\n", INT32_MAX);
+        exit(1);
+    }
+    int n_map_blks = DIV_ROUND_UP(n_blks, 8*bs);
     int n_inos = n_blks / 4;
-    int n_ino_map_blks = DIV_ROUND_UP(n_inos, 8*FS_BLOCK_SIZE);
-    int n_ino_blks = DIV_ROUND_UP(n_inos*sizeof(struct fs_inode),
-                                  FS_BLOCK_SIZE);
-
-    disk = malloc(n_blks * FS_BLOCK_SIZE);
-    memset(disk, 0, n_blks * FS_BLOCK_SIZE);
-
-    struct fs_super *sb = (void*)disk;
+    int n_ino_map_blks = DIV_ROUND_UP(n_inos, 8*bs);
+    int n_ino_blks = DIV_ROUND_UP((long long)n_inos*inode_size, bs);
+    if (n_journal < 0) {
+        n_journal = n_blks / 64;
+        if (n_journal < 16)
+            n_journal = 16;
+        if (n_journal > (8 << 20) / bs)
+            n_journal = (8 << 20) / bs;
+    }
 
     int inode_map_base = 1;
-    fd_set *inode_map = (void*)(disk + inode_map_base*FS_BLOCK_SIZE);
-
     int block_map_base = inode_map_base + n_ino_map_blks;
-    fd_set *block_map = (void*)(disk + block_map_base*FS_BLOCK_SIZE);
-    
     int inode_base = block_map_base + n_map_blks;
-    struct fs_inode *inodes = (void*)(disk + inode_base*FS_BLOCK_SIZE);
+    int journal_base = inode_base + n_ino_blks;
+    int rootdir_base = journal_base + n_journal;
 
-    int rootdir_base = inode_base + n_ino_blks;
-    struct fs_dirent *de = (void*)(disk + rootdir_base*FS_BLOCK_SIZE);
+    /* all zeros, none of it allocated */
+    if (ftruncate(fd, 0) < 0 || ftruncate(fd, n_blks * bs) < 0) {
+        perror("ftruncate");
+        exit(1);
+    }
 
     /* superblock */
+    struct fs_super *sb = (void*)blk;
+    memset(blk, 0, bs);
     *sb = (struct fs_super){.magic = FS_MAGIC, .inode_map_sz = n_ino_map_blks,
                             .inode_region_sz = n_ino_blks,
                             .block_map_sz = n_map_blks,
-                            .num_blocks = n_blks, .root_inode = 1};
-
-    /* bitmaps */
-    FD_SET(0, inode_map);
-    FD_SET(1, inode_map);
-    for (i = 0; i <= rootdir_base; i++)
-        FD_SET(i, block_map);
+                            .num_blocks = n_blks, .root_inode = 1,
+                            .journal_sz = n_journal,
+                            .features = FS_FEAT_SIZE64 | FS_FEAT_EXTENTS};
+    if (inode_size > sizeof(struct fs_inode)) {
+        sb->features |= FS_FEAT_INLINE;
+        sb->inode_size = inode_size;
+    }
+    if (bs != FS_BLOCK_SIZE) {
+        sb->features |= FS_FEAT_BLKSIZE;
+        sb->block_size = bs;
+    }
+    if (compress)
+        sb->features |= FS_FEAT_COMPRESS;
+    put_block(0, blk);
+
+    /* bitmaps: inodes 0 and 1, and everything up to the root directory */
+    memset(blk, 0, bs);
+    FD_SET(0, (fd_set*)blk);
+    FD_SET(1, (fd_set*)blk);
+    put_block(inode_map_base, blk);
+
+    long long n_used = rootdir_base + index_root + 1;
+    for (i = 0; i < n_used; i += 8*bs) {
+        long long j;
+        memset(blk, 0, bs);
+        for (j = 0; j < 8*bs && i + j < n_used; j++)
+            FD_SET(j, (fd_set*)blk);
+        put_block(block_map_base + i / (8*bs), blk);
+    }
 
+    /* the root directory */
+    memset(blk, 0, bs);
+    struct fs_inode *root_ino = (void*)(blk + inode_size % bs);
     int t  = time(NULL);
-    inodes[1] = (struct fs_inode){.uid = 1001, .gid = 125, .mode = 0040777, 
-                                  .ctime = t, .mtime = t, .size = 1024,
+    *root_ino = (struct fs_inode){.uid = 1001, .gid = 125, .mode = 0040777, 
+                                  .ctime = t, .mtime = t, .size = bs,
                                   .direct = {rootdir_base, 0, 0, 0, 0, 0},
-                                  .indir_1 = 0, .indir_2 = 0};
+                                  .indir_1 = 0, .indir_2 = 0, .flags = 0};
+
+    /* hashed root: index node in block 0 of the directory, a single
+     * empty leaf (logical block 1) covering all hashes.
+     */
+    if (index_root) {
+        root_ino->direct[1] = rootdir_base + 1;
+        root_ino->size = 2 * bs;
+        root_ino->flags = FS_DIR_INDEX;
+    }
+    put_block(inode_base + inode_size / bs, blk);
+
+    if (index_root) {
+        memset(blk, 0, bs);
+        struct fs_dx_node *root = (void*)blk;
+        root->magic = FS_DX_MAGIC;
+        root->count = 1;
+        root->levels = 0;
+        root->entries[0] = (struct fs_dx_entry){.hash = 0, .block = 1};
+        put_block(rootdir_base, blk);
+    }
 
     /* remember (from /usr/include/i386-linux-gnu/bits/stat.h)
      *    S_IFDIR = 0040000 - directory
@@ -106,12 +235,13 @@ int main(int argc, char **argv)
      *       1 - inode map
      *       2 - block map
      *       3,4,5,6 - inodes
-     *       7 - root directory (inode 1)
+     *       7..22 - journal (16 blocks by default; the log starts out
+     *               all zeros, i.e. empty)
+     *       23 - root directory (inode 1)
+     *      [24 - root directory leaf, with -index]
      */
-                      
 
-    assert(size == n_blks* FS_BLOCK_SIZE);
-    write(fd, disk, size);
+    free(blk);
     close(fd);
 
     return 0;
@@ -6,10 +6,127 @@
 #include <fcntl.h>
 #include <sys/select.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <time.h>
 
 #include "fsx600.h"
 
+void *disk;
+fd_set *blkmap, *block_map;
+int size64;
+int bs = FS_BLOCK_SIZE;         /* from the superblock */
+
+/* block numbers go to 2^32 and images past 4GB, so do the arithmetic
+ * in size_t
+ */
+#define BLK(n) (disk + (size_t)(n) * bs)
+#define PTRS (bs / 4)           /* block numbers per pointer block */
+#define DIRENTS (int)(bs / sizeof(struct fs_dirent))
+
+/* 64-bit file size with FS_FEAT_SIZE64, else the old signed 32 bits
+ */
+long long file_size(struct fs_inode *in)
+{
+    if (!size64)
+        return in->size;
+    return ((long long)in->size_hi << 32) | (uint32_t)in->size;
+}
+
+/* disk block holding block 'idx' of a file, or 0
+ */
+int file_block(struct fs_inode *in, int idx)
+{
+    int *buf;
+    if (idx < N_DIRECT)
+        return in->direct[idx];
+    idx -= N_DIRECT;
+    if (idx < PTRS) {
+        if (!in->indir_1)
+            return 0;
+        buf = BLK(in->indir_1);
+        return buf[idx];
+    }
+    idx -= PTRS;
+    if (!in->indir_2)
+        return 0;
+    buf = BLK(in->indir_2);
+    if (!buf[idx / PTRS])
+        return 0;
+    buf = BLK(buf[idx / PTRS]);
+    return buf[idx % PTRS];
+}
+
+/* note that a block is in use, complaining if the map says it's free
+ */
+void use_block(int blk)
+{
+    FD_SET(blk, blkmap);
+    if (!FD_ISSET(blk, block_map))
+        printf("\n***ERROR*** block %d marked free\n", blk);
+}
+
+/* mark the pointer blocks of a file in use
+ */
+void use_indirect_blocks(struct fs_inode *in)
+{
+    int i;
+    if (in->indir_1)
+        use_block(in->indir_1);
+    if (in->indir_2) {
+        int *buf2 = BLK(in->indir_2);
+        use_block(in->indir_2);
+        for (i = 0; i < PTRS; i++)
+            if (buf2[i])
+                use_block(buf2[i]);
+    }
+}
+
+/* print the extents under an extent tree node, marking their blocks
+ * and the tree's own in use
+ */
+void use_extents(struct fs_extent_hdr *h, struct fs_extent *e)
+{
+    int i, j;
+    if (h->magic != FS_EXT_MAGIC || h->count > h->max) {
+        printf("\n***ERROR*** bad extent node\n");
+        return;
+    }
+    for (i = 0; i < h->count; i++) {
+        if (h->depth == 0) {
+            printf("%u:%u+%u ", e[i].lblk, e[i].pblk, e[i].len);
+            for (j = 0; j < e[i].len; j++)
+                use_block(e[i].pblk + j);
+            continue;
+        }
+        struct fs_extent_node *node = BLK(e[i].pblk);
+        use_block(e[i].pblk);
+        use_extents(&node->hdr, node->e);
+    }
+}
+
+/* the leaf blocks (logical block numbers) of a hashed directory
+ */
+int dir_leaves(struct fs_inode *in, int *leaves)
+{
+    struct fs_dx_node *root = BLK(in->direct[0]);
+    int i, j, n = 0;
+
+    if (root->magic != FS_DX_MAGIC) {
+        printf("***ERROR*** bad directory index in block %d\n", in->direct[0]);
+        return 0;
+    }
+    for (i = 0; i < root->count; i++) {
+        if (!root->levels) {
+            leaves[n++] = root->entries[i].block;
+            continue;
+        }
+        struct fs_dx_node *node = BLK(file_block(in, root->entries[i].block));
+        for (j = 0; j < node->count; j++)
+            leaves[n++] = node->entries[j].block;
+    }
+    return n;
+}
+
 int main(int argc, char **argv)
 {
     int i, j, fd = open(argv[1], O_RDONLY);
@@ -18,27 +135,33 @@ int main(int argc, char **argv)
     struct stat _sb;
     if (fstat(fd, &_sb) < 0)
         perror("fstat"), exit(1);
-    int size = _sb.st_size;
+    off_t size = _sb.st_size;
 
-    void *disk = malloc(size);
-    if (read(fd, disk, size) != size)
-        perror("read"), exit(1);
-    fd_set *blkmap = calloc(size/8192, 1);
+    disk = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (disk == MAP_FAILED)
+        perror("mmap"), exit(1);
+    blkmap = calloc(size/8192, 1);
     fd_set *imap = calloc(size/8192, 1);
 
     struct fs_super *sb = (void*)disk;
+    bs = FS_BLKSIZE(sb);
     printf("superblock: magic:  %08x\n"
            "            imap:   %d blocks\n" 
            "            bmap:   %d blocks\n"
            "            inodes: %d blocks\n" 
            "            blocks: %d\n"
-           "            root inode: %d\n\n", sb->magic, sb->inode_map_sz,
-           sb->block_map_sz, sb->inode_region_sz, sb->num_blocks, sb->root_inode);
+           "            root inode: %d\n"
+           "            journal: %d blocks\n"
+           "            features: %x\n"
+           "            block size: %d\n\n", sb->magic, sb->inode_map_sz,
+           sb->block_map_sz, sb->inode_region_sz, sb->num_blocks, sb->root_inode,
+           sb->journal_sz, sb->features, bs);
+    size64 = (sb->features & FS_FEAT_SIZE64) != 0;
 
     printf("allocated inodes: ");
-    fd_set *inode_map = (void*)disk + FS_BLOCK_SIZE;
+    fd_set *inode_map = (void*)disk + bs;
     char *comma = "";
-    for (i = 0; i < sb->inode_map_sz * 8192; i++)
+    for (i = 0; i < sb->inode_map_sz * 8 * bs; i++)
         if (FD_ISSET(i, inode_map)) {
             printf("%s %d", comma, i);
             comma = ",";
@@ -46,43 +169,61 @@ int main(int argc, char **argv)
     printf("\n\n");
 
     printf("allocated blocks: ");
-    fd_set *block_map = (void*)inode_map + sb->inode_map_sz * FS_BLOCK_SIZE;
-    for (comma = "", i = 0; i < sb->block_map_sz * 8192; i++)
+    block_map = (void*)inode_map + sb->inode_map_sz * bs;
+    for (comma = "", i = 0; i < sb->block_map_sz * 8 * bs; i++)
         if (FD_ISSET(i, block_map)) {
             printf("%s %d", comma, i);
             comma = ",";
         }
         printf("\n\n");
 
-    struct fs_inode *inodes = (void*)block_map + sb->block_map_sz * FS_BLOCK_SIZE;
+    char *inodes = (void*)block_map + sb->block_map_sz * bs;
+    int isize = FS_INODE_SIZE(sb);
+#define INODE(n) ((struct fs_inode *)(inodes + (size_t)(n) * isize))
 
-    int max_inodes = sb->inode_region_sz * INODES_PER_BLK;
-    struct entry { int dir; int inum;} inode_list[max_inodes + 100];
+    int max_inodes = sb->inode_region_sz * (bs / isize);
+    struct entry { int dir; int inum;} *inode_list =
+        malloc((max_inodes + 100) * sizeof(struct entry));
     int head = 0, tail = 0;
 
     inode_list[head++] = (struct entry){.dir=1, .inum=1};
     FD_SET(1, imap);
     while (head != tail) {
         struct entry e = inode_list[tail++];
-        struct fs_inode *in = inodes + e.inum;
+        struct fs_inode *in = INODE(e.inum);
         if (!e.dir) {
             printf("file: inode %d\n"
                    "      uid/gid %d/%d\n"
                    "      mode %08o\n"
-                   "      size  %d\n",
-                   e.inum, in->uid, in->gid, in->mode, in->size);
+                   "      size  %lld\n",
+                   e.inum, in->uid, in->gid, in->mode, file_size(in));
+            if (in->flags & FS_INLINE) {
+                printf("inline data, %lld bytes\n\n", file_size(in));
+                continue;
+            }
+            if (in->flags & FS_EXTENTS) {
+                printf("extents (file:disk+len, depth %d): ", in->eh.depth);
+                use_extents(&in->eh, in->ext);
+                printf("\n\n");
+                continue;
+            }
+            /* in a compressed file, '*' starts a compressed cluster */
             printf("blocks: ");
             for (i = 0; i < 6; i++)
-                if (in->direct[i]) {
+                if (in->direct[i] == FS_CLUSTER_MARK)
+                    printf("* ");
+                else if (in->direct[i]) {
                     printf("%d ", in->direct[i]);
                     FD_SET(in->direct[i], blkmap);
                     if (!FD_ISSET(in->direct[i], block_map))
                         printf("\n***ERROR*** block %d marked free\n", in->direct[i]);
                 }
             if (in->indir_1) {
-                int *buf = disk + in->indir_1 * FS_BLOCK_SIZE;
-                for (i = 0; i < 256; i++)
-                    if (buf[i]) {
+                int *buf = BLK(in->indir_1);
+                for (i = 0; i < PTRS; i++)
+                    if (buf[i] == (int) FS_CLUSTER_MARK)
+                        printf("* ");
+                    else if (buf[i]) {
                         printf("%d ", buf[i]);
                         FD_SET(buf[i], blkmap);
                         if (!FD_ISSET(buf[i], block_map))
@@ -90,13 +231,15 @@ int main(int argc, char **argv)
                     }
             }
             if (in->indir_2) {
-                int *buf2 = disk + in->indir_2 * FS_BLOCK_SIZE;
-                for (i = 0; i < 256; i++) {
+                int *buf2 = BLK(in->indir_2);
+                for (i = 0; i < PTRS; i++) {
                     if (buf2[i])
                     {
-                        int *buf = disk + buf2[i] * FS_BLOCK_SIZE;
-                        for (j = 0; j < 256; j++) {
-                            if (buf[j]) {
+                        int *buf = BLK(buf2[i]);
+                        for (j = 0; j < PTRS; j++) {
+                            if (buf[j] == (int) FS_CLUSTER_MARK)
+                                printf("* ");
+                            else if (buf[j]) {
                                 printf("%d ", buf[j]);
                                 FD_SET(buf[j], blkmap);
                                 if (!FD_ISSET(buf[j], block_map))
@@ -106,6 +249,7 @@ int main(int argc, char **argv)
                     }
                 }
             }
+            use_indirect_blocks(in);
             printf("\n\n");
         }
         else {
@@ -114,42 +258,56 @@ int main(int argc, char **argv)
                 continue;
             }
             printf("directory: inode %d (block %d)\n", e.inum, in->direct[0]);
-            struct fs_dirent *de = disk + in->direct[0] * FS_BLOCK_SIZE;
-            if (!FD_ISSET(in->direct[0], block_map))
-                printf("\n***ERROR*** block %d marked free\n", in->direct[0]);
-            FD_SET(in->direct[0], blkmap);
-            
-            for (i = 0; i < 32; i++)
-                if (de[i].valid) {
-                    printf("  %s %d %s\n", de[i].isDir ? "D" : "F", de[i].inode,
-                           de[i].name);
-                    int j = de[i].inode;
-                    if (j < 0 || j >= sb->inode_region_sz * 16) {
-                        printf("***ERROR*** invalid inode %d\n", j);
-                        continue;
-                    }
-                    if (FD_ISSET(j, imap)) {
-                        printf("***ERROR*** loop found (inode %d)\n", e.inum);
-                        goto fail;
+            int n_leaves = 1, *leaves = malloc(sizeof(int) * (file_size(in) / bs + 1));
+            leaves[0] = -1;
+            if (in->flags & FS_DIR_INDEX) {
+                for (i = 0; i < file_size(in) / bs; i++)
+                    if (file_block(in, i))
+                        use_block(file_block(in, i));
+                use_indirect_blocks(in);
+                n_leaves = dir_leaves(in, leaves);
+                printf("  hashed: %d blocks, %d leaves\n",
+                       (int)(file_size(in) / bs), n_leaves);
+            }
+            else
+                use_block(in->direct[0]);
+
+            for (int l = 0; l < n_leaves; l++) {
+                int blk = leaves[l] < 0 ? in->direct[0] : file_block(in, leaves[l]);
+                struct fs_dirent *de = BLK(blk);
+                for (i = 0; i < DIRENTS; i++)
+                    if (de[i].valid) {
+                        printf("  %s %d %s\n", de[i].isDir ? "D" : "F", de[i].inode,
+                               de[i].name);
+                        int j = de[i].inode;
+                        if (j < 0 || j >= max_inodes) {
+                            printf("***ERROR*** invalid inode %d\n", j);
+                            continue;
+                        }
+                        if (FD_ISSET(j, imap)) {
+                            printf("***ERROR*** loop found (inode %d)\n", e.inum);
+                            goto fail;
+                        }
+                        FD_SET(j, imap);
+                        if (!FD_ISSET(j, inode_map))
+                            printf("***ERROR*** inode %d is marked free\n", j);
+                        inode_list[head++] = (struct entry) {.dir = de[i].isDir, j};
                     }
-                    FD_SET(j, imap);
-                    if (!FD_ISSET(j, inode_map))
-                        printf("***ERROR*** inode %d is marked free\n", j);
-                    inode_list[head++] = (struct entry) {.dir = de[i].isDir, j};
-                }
+            }
+            free(leaves);
             printf("\n");
         }
     }
 
     printf("unreachable inodes: ");
-    for (i = 1; i < sb->inode_region_sz * 16; i++)
+    for (i = 1; i < max_inodes; i++)
         if (!FD_ISSET(i, imap) && FD_ISSET(i, inode_map))
             printf("%d ", i);
     printf("\n");
 
     printf("unreachable blocks: ");
-    for (i = 1 + sb->inode_map_sz + sb->block_map_sz + sb->inode_region_sz;
-         i < sb->num_blocks; i++)
+    for (i = 1 + sb->inode_map_sz + sb->block_map_sz + sb->inode_region_sz +
+             sb->journal_sz; i < sb->num_blocks; i++)
         if (FD_ISSET(i, blkmap) && !FD_ISSET(i, block_map))
             printf("%d ", i);
     printf("\n");
@@ -0,0 +1,323 @@
+/*
+ * replay.c - play a block I/O trace (see trace.c) against a device
+ *
+ *   gcc -O2 -o replay replay.c image.c image-aio.c bcache.c stats.c -lpthread
+ *
+ * usage: replay [options] trace image.img
+ *   -mmap | -aio | -direct     image backend, as for homework
+ *   -cache KB     put a buffer cache of this size on top (default none:
+ *                 traces are normally taken below the cache)
+ *   -fast         issue requests as fast as possible, instead of at the
+ *                 times they were recorded
+ *   -depth #      requests in flight at once, if the backend can do
+ *                 asynchronous I/O (default 1)
+ *
+ * The image is scratch: reads and writes go to the blocks in the trace,
+ * and what is written is a fill pattern, not the original data. It is
+ * opened with the trace's block size, and must be at least as large as
+ * the traced device; requests past its end are skipped. Flushes wait for everything in flight before they start.
+ *
+ * Results go to stdout as JSON: for each of read, write and flush the
+ * number of requests, blocks, MB/s over the whole run, and p50/p99/p99.9
+ * latency in microseconds, next to the same percentiles from the trace.
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <errno.h>
+
+#include "blkdev.h"
+
+struct opts {
+    int  cache_kb;
+    int  mmap, aio, direct;
+    int  fast;
+    int  depth;
+} o = {.depth = 1};
+
+static long parseint(char *s)
+{
+    long n = strtol(s, &s, 0);
+    if (tolower(*s) == 'k')
+        return n * 1024;
+    if (tolower(*s) == 'm')
+        return n * 1024 * 1024;
+    return n;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* per operation type: replayed and recorded latencies (ns), and
+ * blocks moved (a flush's range doesn't count)
+ */
+struct result {
+    const char *name;
+    double *lat, *orig;
+    int  n, max;
+    long blocks;
+} results[] = {
+    [TRACE_READ] = {.name = "read"},
+    [TRACE_WRITE] = {.name = "write"},
+    [TRACE_FLUSH] = {.name = "flush"},
+};
+#define N_RESULTS (sizeof(results) / sizeof(results[0]))
+
+static void add(int op, uint64_t lat, struct trace_rec *r)
+{
+    struct result *res = &results[op];
+    if (res->n == res->max) {
+        res->max = res->max ? 2 * res->max : 1024;
+        res->lat = realloc(res->lat, res->max * sizeof(double));
+        res->orig = realloc(res->orig, res->max * sizeof(double));
+    }
+    res->lat[res->n] = lat;
+    res->orig[res->n++] = r->lat_ns;
+    if (op != TRACE_FLUSH)
+        res->blocks += r->num_blks;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(double *)a, y = *(double *)b;
+    return (x > y) - (x < y);
+}
+
+static double pct(double *v, int n, double p)
+{
+    int i = (int)(p * n);
+    return n ? v[i < n ? i : n - 1] / 1000 : 0;
+}
+
+/* requests in flight, with -depth. Each slot has its own buffer, and
+ * its copy of the record for the results.
+ */
+struct slot {
+    struct blkdev_req req;
+    struct trace_rec rec;
+    uint64_t start;
+    char *buf;
+    int  bufsz;
+};
+
+static struct slot *slots;
+static struct slot **free_slots;
+static int n_free, in_flight;
+static long errors;
+static int bsize;               /* the trace's block size */
+
+static char *grow(char **buf, int *size, int nblks)
+{
+    if (nblks * bsize > *size) {
+        *size = nblks * bsize;
+        *buf = realloc(*buf, *size);
+        memset(*buf, 0xa5, *size);
+    }
+    return *buf;
+}
+
+// wait for at least 'min' requests to complete
+static void reap(struct blkdev *dev, int min)
+{
+    struct blkdev_req *done[64];
+    int i, n;
+
+    do {
+        n = dev->ops->complete(dev, done, min < 64 ? min : 64, 64);
+        uint64_t t = now_ns();
+        for (i = 0; i < n; i++) {
+            struct slot *s = done[i]->priv;
+            if (done[i]->result < 0)
+                errors++;
+            add(s->rec.op, t - s->start, &s->rec);
+            free_slots[n_free++] = s;
+        }
+        in_flight -= n;
+        min -= n;
+    } while (min > 0 && n > 0);
+}
+
+static void issue(struct blkdev *dev, struct trace_rec *r)
+{
+    static char *buf;
+    static int bufsz;
+    uint64_t t;
+    int val;
+
+    if (r->op == TRACE_FLUSH) {
+        if (in_flight > 0)
+            reap(dev, in_flight);
+        t = now_ns();
+        val = dev->ops->flush(dev, r->first_blk, r->num_blks);
+    } else if (o.depth > 1) {
+        if (n_free == 0)
+            reap(dev, 1);
+        struct slot *s = free_slots[--n_free];
+        s->rec = *r;
+        s->req.write = (r->op == TRACE_WRITE);
+        s->req.first_blk = r->first_blk;
+        s->req.num_blks = r->num_blks;
+        s->req.buf = grow(&s->buf, &s->bufsz, r->num_blks);
+        s->req.priv = s;
+        struct blkdev_req *rp = &s->req;
+        s->start = now_ns();
+        if ((val = dev->ops->submit(dev, &rp, 1)) < 0) {
+            errors++;
+            free_slots[n_free++] = s;
+        } else
+            in_flight++;
+        return;
+    } else {
+        grow(&buf, &bufsz, r->num_blks);
+        t = now_ns();
+        if (r->op == TRACE_WRITE)
+            val = dev->ops->write(dev, r->first_blk, r->num_blks, buf);
+        else
+            val = dev->ops->read(dev, r->first_blk, r->num_blks, buf);
+    }
+    if (val < 0)
+        errors++;
+    add(r->op, now_ns() - t, r);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: replay [-mmap | -aio | -direct] [-cache KB] [-fast]\n"
+            "    [-depth #] trace image.img\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    struct trace_hdr h;
+    struct trace_rec recs[1024];
+    struct blkdev *dev;
+    long n_recs = 0, skipped = 0;
+    uint64_t last = 0;
+    int i, n;
+
+    for (argv++, argc--; argc > 2; argv++, argc--) {
+        char *a = argv[0];
+        if (!strcmp(a, "-mmap"))
+            o.mmap = 1;
+        else if (!strcmp(a, "-aio"))
+            o.aio = 1;
+        else if (!strcmp(a, "-direct"))
+            o.direct = 1;
+        else if (!strcmp(a, "-fast"))
+            o.fast = 1;
+        else if (argc < 4)
+            usage();
+        else {
+            char *v = *++argv;
+            argc--;
+            if (!strcmp(a, "-cache"))
+                o.cache_kb = parseint(v);
+            else if (!strcmp(a, "-depth"))
+                o.depth = parseint(v);
+            else
+                usage();
+        }
+    }
+    if (argc != 2 || o.depth < 1)
+        usage();
+    char *trace = argv[0], *image = argv[1];
+
+    FILE *fp = fopen(trace, "r");
+    if (fp == NULL) {
+        perror(trace);
+        exit(1);
+    }
+    if (fread(&h, sizeof(h), 1, fp) != 1 || h.magic != TRACE_MAGIC ||
+        h.version != TRACE_VERSION) {
+        fprintf(stderr, "%s: not a version %d trace\n", trace, TRACE_VERSION);
+        exit(1);
+    }
+    bsize = h.block_size;
+
+    if (o.mmap)
+        dev = image_mmap_create(image, bsize);
+    else if (o.aio)
+        dev = image_aio_create(image, bsize);
+    else if (o.direct)
+        dev = image_direct_create(image, bsize);
+    else
+        dev = image_create(image, bsize);
+    if (dev == NULL || (o.cache_kb > 0 &&
+                        (dev = bcache_create(dev, o.cache_kb * 1024 / bsize)) == NULL)) {
+        fprintf(stderr, "cannot open image file '%s': %s\n", image, strerror(errno));
+        exit(1);
+    }
+    int64_t nblks = dev->ops->num_blocks(dev);
+    if (nblks < h.num_blocks)
+        fprintf(stderr, "warning: %s has %lld blocks, the traced device had %lld\n",
+                image, (long long)nblks, (long long)h.num_blocks);
+
+    if (o.depth > 1 && dev->ops->submit == NULL) {
+        fprintf(stderr, "warning: no asynchronous I/O on this backend, using -depth 1\n");
+        o.depth = 1;
+    }
+    slots = calloc(o.depth, sizeof(*slots));
+    free_slots = malloc(o.depth * sizeof(*free_slots));
+    for (i = 0; i < o.depth; i++)
+        free_slots[n_free++] = &slots[i];
+
+    uint64_t t0 = now_ns();
+    while ((n = fread(recs, sizeof(recs[0]), 1024, fp)) > 0)
+        for (i = 0; i < n; i++) {
+            struct trace_rec *r = &recs[i];
+            n_recs++;
+            if (r->op < TRACE_READ || r->op > TRACE_FLUSH || r->first_blk < 0 ||
+                r->num_blks < 0 || r->first_blk + r->num_blks > nblks) {
+                skipped++;
+                continue;
+            }
+            if (!o.fast && r->time_ns > now_ns() - t0) {
+                uint64_t t = t0 + r->time_ns;
+                struct timespec ts = {.tv_sec = t / 1000000000, .tv_nsec = t % 1000000000};
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+            }
+            if (r->time_ns > last)
+                last = r->time_ns;
+            issue(dev, r);
+        }
+    fclose(fp);
+    if (in_flight > 0)
+        reap(dev, in_flight);
+    double secs = (now_ns() - t0) * 1e-9;
+
+    printf("{\"trace\": \"%s\", \"backend\": \"%s\", \"block_size\": %d, "
+           "\"cache_kb\": %d, \"depth\": %d, \"fast\": %d,\n \"records\": %ld, "
+           "\"skipped\": %ld, \"errors\": %ld, \"secs\": %.6f, \"trace_secs\": %.6f,\n"
+           " \"ops\": [\n", trace,
+           o.mmap ? "mmap" : o.aio ? "aio" : o.direct ? "direct" : "image", bsize,
+           o.cache_kb, o.depth, o.fast, n_recs, skipped, errors, secs, last * 1e-9);
+    for (i = n = 0; i < N_RESULTS; i++) {
+        struct result *r = &results[i];
+        if (r->name == NULL)
+            continue;
+        qsort(r->lat, r->n, sizeof(double), cmp_double);
+        qsort(r->orig, r->n, sizeof(double), cmp_double);
+        printf("%s    {\"op\": \"%s\", \"count\": %d, \"blocks\": %ld, "
+               "\"mb_per_sec\": %.2f, \"p50_us\": %.2f, \"p99_us\": %.2f, "
+               "\"p999_us\": %.2f, \"orig_p50_us\": %.2f, \"orig_p99_us\": %.2f, "
+               "\"orig_p999_us\": %.2f}", n++ ? ",\n" : "", r->name, r->n,
+               r->blocks, r->blocks * (double)bsize / secs / (1 << 20),
+               pct(r->lat, r->n, 0.50), pct(r->lat, r->n, 0.99),
+               pct(r->lat, r->n, 0.999), pct(r->orig, r->n, 0.50),
+               pct(r->orig, r->n, 0.99), pct(r->orig, r->n, 0.999));
+    }
+    printf("\n]}\n");
+
+    dev->ops->close(dev);
+    return errors ? 1 : 0;
+}
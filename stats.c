@@ -0,0 +1,315 @@
+/*
+ * stats.c - run-time counters
+ *
+ * Two kinds: per file system operation, the number of calls and
+ * errors and a histogram of latencies in power-of-two buckets; and per
+ * device, calls and blocks for reads, writes and flushes, and for a
+ * cache, hits and misses. Both are registered once and then updated
+ * with relaxed atomic adds, so they cost next to nothing when nobody
+ * is looking.
+ *
+ * stats_create stacks a counting layer on any blkdev; bcache.c and
+ * journal.c keep counters of their own. stats_format renders it all
+ * as text (main.c serves it as the file /.stats).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "blkdev.h"
+
+#define N_BUCKETS 40            /* bucket i: latency < 2^i ns */
+
+struct op_stats {
+    const char *name;
+    unsigned long calls, errors;
+    unsigned long total_ns;
+    unsigned long hist[N_BUCKETS];
+    struct op_stats *next;
+};
+
+static struct op_stats *ops, **ops_tail = &ops;
+static struct blkdev_stats *devs, **devs_tail = &devs;
+static pthread_mutex_t reg_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define ADD(field, n) __atomic_fetch_add(&(field), (n), __ATOMIC_RELAXED)
+#define GET(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+#define ZERO(field) __atomic_store_n(&(field), 0, __ATOMIC_RELAXED)
+
+uint64_t stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// counters for the operation 'name', listed in the order registered
+struct op_stats *op_stats_register(const char *name)
+{
+    struct op_stats *s = calloc(1, sizeof(*s));
+    s->name = name;
+    pthread_mutex_lock(&reg_lock);
+    *ops_tail = s;
+    ops_tail = &s->next;
+    pthread_mutex_unlock(&reg_lock);
+    return s;
+}
+
+// an operation that started at 'start' (stats_now) returned 'ret'
+int op_stats_done(struct op_stats *s, uint64_t start, int ret)
+{
+    uint64_t ns = stats_now() - start;
+    int b = ns ? 64 - __builtin_clzll(ns) : 0;
+
+    ADD(s->calls, 1);
+    if (ret < 0)
+        ADD(s->errors, 1);
+    ADD(s->total_ns, ns);
+    ADD(s->hist[b < N_BUCKETS ? b : N_BUCKETS - 1], 1);
+    return ret;
+}
+
+struct blkdev_stats *blkdev_stats_register(const char *name, int block_size)
+{
+    struct blkdev_stats *s = calloc(1, sizeof(*s));
+    snprintf(s->name, sizeof(s->name), "%s", name);
+    s->block_size = block_size;
+    pthread_mutex_lock(&reg_lock);
+    *devs_tail = s;
+    devs_tail = &s->next;
+    pthread_mutex_unlock(&reg_lock);
+    return s;
+}
+
+void blkdev_stats_io(struct blkdev_stats *s, int write, int nblks)
+{
+    if (write) {
+        ADD(s->writes, 1);
+        ADD(s->blks_written, nblks);
+    } else {
+        ADD(s->reads, 1);
+        ADD(s->blks_read, nblks);
+    }
+}
+
+void blkdev_stats_flush(struct blkdev_stats *s)
+{
+    ADD(s->flushes, 1);
+}
+
+void blkdev_stats_hit(struct blkdev_stats *s, int hit)
+{
+    if (hit)
+        ADD(s->hits, 1);
+    else
+        ADD(s->misses, 1);
+}
+
+void stats_reset(void)
+{
+    struct op_stats *o;
+    struct blkdev_stats *d;
+    int i;
+
+    pthread_mutex_lock(&reg_lock);
+    for (o = ops; o != NULL; o = o->next) {
+        ZERO(o->calls);
+        ZERO(o->errors);
+        ZERO(o->total_ns);
+        for (i = 0; i < N_BUCKETS; i++)
+            ZERO(o->hist[i]);
+    }
+    for (d = devs; d != NULL; d = d->next) {
+        ZERO(d->reads);
+        ZERO(d->writes);
+        ZERO(d->flushes);
+        ZERO(d->blks_read);
+        ZERO(d->blks_written);
+        ZERO(d->hits);
+        ZERO(d->misses);
+    }
+    pthread_mutex_unlock(&reg_lock);
+}
+
+// upper bound of histogram bucket 'b', for printing
+static char *bucket_str(char *buf, int b)
+{
+    uint64_t ns = 1ull << b;
+    if (ns < 1000)
+        sprintf(buf, "%lluns", (unsigned long long)ns);
+    else if (ns < 1000000)
+        sprintf(buf, "%lluus", (unsigned long long)ns / 1000);
+    else if (ns < 1000000000)
+        sprintf(buf, "%llums", (unsigned long long)ns / 1000000);
+    else
+        sprintf(buf, "%llus", (unsigned long long)ns / 1000000000);
+    return buf;
+}
+
+// the bucket holding the p'th fraction of the calls
+static int percentile(unsigned long *hist, unsigned long calls, double p)
+{
+    unsigned long want = p * calls, seen = 0;
+    int b;
+    for (b = 0; b < N_BUCKETS - 1; b++)
+        if ((seen += hist[b]) > want)
+            break;
+    return b;
+}
+
+/* everything as text, in a malloc'd buffer. Percentiles are the upper
+ * bounds of their buckets. Returns the length.
+ */
+int stats_format(char **text)
+{
+    char *buf = NULL, b1[16], b2[16], b3[16];
+    size_t size = 0;
+    FILE *fp = open_memstream(&buf, &size);
+    struct op_stats *o;
+    struct blkdev_stats *d;
+    int i;
+
+    pthread_mutex_lock(&reg_lock);
+    fprintf(fp, "%-10s %10s %8s %10s %7s %7s %7s  histogram (<bound:calls)\n",
+            "op", "calls", "errors", "avg_us", "p50", "p99", "p99.9");
+    for (o = ops; o != NULL; o = o->next) {
+        unsigned long hist[N_BUCKETS], calls = GET(o->calls);
+        if (calls == 0)
+            continue;
+        for (i = 0; i < N_BUCKETS; i++)
+            hist[i] = GET(o->hist[i]);
+        fprintf(fp, "%-10s %10lu %8lu %10.2f %7s %7s %7s ", o->name, calls,
+                GET(o->errors), GET(o->total_ns) / 1000.0 / calls,
+                bucket_str(b1, percentile(hist, calls, 0.50)),
+                bucket_str(b2, percentile(hist, calls, 0.99)),
+                bucket_str(b3, percentile(hist, calls, 0.999)));
+        for (i = 0; i < N_BUCKETS; i++)
+            if (hist[i])
+                fprintf(fp, " <%s:%lu", bucket_str(b1, i), hist[i]);
+        fprintf(fp, "\n");
+    }
+
+    fprintf(fp, "\n%-10s %10s %10s %8s %12s %12s %10s %10s\n", "device",
+            "reads", "writes", "flushes", "kb_read", "kb_written", "hits", "misses");
+    for (d = devs; d != NULL; d = d->next)
+        fprintf(fp, "%-10s %10lu %10lu %8lu %12lu %12lu %10lu %10lu\n", d->name,
+                GET(d->reads), GET(d->writes), GET(d->flushes),
+                GET(d->blks_read) * d->block_size / 1024,
+                GET(d->blks_written) * d->block_size / 1024,
+                GET(d->hits), GET(d->misses));
+    pthread_mutex_unlock(&reg_lock);
+
+    fclose(fp);
+    *text = buf;
+    return size;
+}
+
+/* counting layer: passes everything through to the device below,
+ * counting calls and blocks as it goes.
+ */
+struct stats_dev {
+    struct blkdev *lower;
+    struct blkdev_stats *st;
+};
+
+static int64_t stats_num_blocks(struct blkdev *dev)
+{
+    struct stats_dev *sd = dev->private;
+    return sd->lower->ops->num_blocks(sd->lower);
+}
+
+static int stats_read(struct blkdev *dev, int64_t first, int n, void *buf)
+{
+    struct stats_dev *sd = dev->private;
+    blkdev_stats_io(sd->st, 0, n);
+    return sd->lower->ops->read(sd->lower, first, n, buf);
+}
+
+static int stats_write(struct blkdev *dev, int64_t first, int n, void *buf)
+{
+    struct stats_dev *sd = dev->private;
+    blkdev_stats_io(sd->st, 1, n);
+    return sd->lower->ops->write(sd->lower, first, n, buf);
+}
+
+static int stats_flush(struct blkdev *dev, int64_t first, int64_t n)
+{
+    struct stats_dev *sd = dev->private;
+    blkdev_stats_flush(sd->st);
+    return sd->lower->ops->flush(sd->lower, first, n);
+}
+
+static void *stats_map(struct blkdev *dev, int64_t blk)
+{
+    struct stats_dev *sd = dev->private;
+    void *p = NULL;
+    if (sd->lower->ops->map != NULL)
+        p = sd->lower->ops->map(sd->lower, blk);
+    if (p != NULL)
+        blkdev_stats_io(sd->st, 0, 1);
+    return p;
+}
+
+static int stats_submit(struct blkdev *dev, struct blkdev_req **reqs, int n)
+{
+    struct stats_dev *sd = dev->private;
+    int i;
+    for (i = 0; i < n; i++)
+        blkdev_stats_io(sd->st, reqs[i]->write, reqs[i]->num_blks);
+    return sd->lower->ops->submit(sd->lower, reqs, n);
+}
+
+static int stats_complete(struct blkdev *dev, struct blkdev_req **done,
+                          int min, int max)
+{
+    struct stats_dev *sd = dev->private;
+    return sd->lower->ops->complete(sd->lower, done, min, max);
+}
+
+static void stats_close(struct blkdev *dev)
+{
+    struct stats_dev *sd = dev->private;
+    sd->lower->ops->close(sd->lower);
+    free(sd);
+    dev->private = NULL;
+    free(dev);
+}
+
+struct blkdev_ops stats_ops = {
+    .num_blocks = stats_num_blocks,
+    .read = stats_read,
+    .write = stats_write,
+    .flush = stats_flush,
+    .close = stats_close,
+    .map = stats_map
+};
+
+struct blkdev_ops stats_async_ops = {
+    .num_blocks = stats_num_blocks,
+    .read = stats_read,
+    .write = stats_write,
+    .flush = stats_flush,
+    .close = stats_close,
+    .map = stats_map,
+    .submit = stats_submit,
+    .complete = stats_complete
+};
+
+struct blkdev *stats_create(struct blkdev *lower, const char *name)
+{
+    struct blkdev *dev = malloc(sizeof(*dev));
+    struct stats_dev *sd = malloc(sizeof(*sd));
+
+    if (dev == NULL || sd == NULL)
+        return NULL;
+    sd->lower = lower;
+    sd->st = blkdev_stats_register(name, lower->block_size);
+    dev->private = sd;
+    dev->ops = (lower->ops->submit != NULL) ? &stats_async_ops : &stats_ops;
+    dev->block_size = lower->block_size;
+    return dev;
+}
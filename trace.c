@@ -0,0 +1,232 @@
+/*
+ * trace.c - block I/O trace recording
+ *
+ * A pass-through blkdev that appends one fixed-size record (see
+ * struct trace_rec in blkdev.h) to a trace file for every read, write
+ * and flush, including asynchronous requests and blocks lent out by
+ * 'map'. Records are buffered and written out a batch at a time, and
+ * on every flush, so a trace is complete up to the last fsync even if
+ * the process dies. 'replay' plays a trace back against any backend.
+ *
+ * Records are in order of completion; each has the time its request
+ * started, so with requests overlapping, times can go backwards a bit.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "blkdev.h"
+
+#define TRACE_BATCH 4096        /* records buffered before writing */
+
+struct pending {
+    struct blkdev_req *req;
+    uint64_t start;
+};
+
+struct trace_dev {
+    struct blkdev *lower;
+    FILE *fp;
+    uint64_t t0;
+    pthread_mutex_t lock;
+    struct trace_rec *recs;
+    int   n;
+    struct pending *pend;       /* submitted, not yet completed */
+    int   npend, maxpend;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// write out the buffered records, with td->lock held
+static void drain(struct trace_dev *td)
+{
+    if (td->n > 0 && fwrite(td->recs, sizeof(*td->recs), td->n, td->fp) != td->n)
+        perror("trace");
+    td->n = 0;
+}
+
+static void record(struct trace_dev *td, int op, int64_t first, int64_t n,
+                   uint64_t start, int val)
+{
+    uint64_t end = now_ns();
+    pthread_mutex_lock(&td->lock);
+    struct trace_rec *r = &td->recs[td->n++];
+    r->time_ns = start - td->t0;
+    r->lat_ns = (end - start > UINT32_MAX) ? UINT32_MAX : end - start;
+    r->first_blk = first;
+    r->num_blks = (n > INT32_MAX) ? INT32_MAX : n;     /* a flush can be bigger */
+    r->op = op;
+    r->error = (val < 0);
+    memset(r->pad, 0, sizeof(r->pad));
+    if (td->n == TRACE_BATCH)
+        drain(td);
+    pthread_mutex_unlock(&td->lock);
+}
+
+static int64_t trace_num_blocks(struct blkdev *dev)
+{
+    struct trace_dev *td = dev->private;
+    return td->lower->ops->num_blocks(td->lower);
+}
+
+static int trace_read(struct blkdev *dev, int64_t first, int n, void *buf)
+{
+    struct trace_dev *td = dev->private;
+    uint64_t t = now_ns();
+    int val = td->lower->ops->read(td->lower, first, n, buf);
+    record(td, TRACE_READ, first, n, t, val);
+    return val;
+}
+
+static int trace_write(struct blkdev *dev, int64_t first, int n, void *buf)
+{
+    struct trace_dev *td = dev->private;
+    uint64_t t = now_ns();
+    int val = td->lower->ops->write(td->lower, first, n, buf);
+    record(td, TRACE_WRITE, first, n, t, val);
+    return val;
+}
+
+static int trace_flush(struct blkdev *dev, int64_t first, int64_t n)
+{
+    struct trace_dev *td = dev->private;
+    uint64_t t = now_ns();
+    int val = td->lower->ops->flush(td->lower, first, n);
+    record(td, TRACE_FLUSH, first, n, t, val);
+    pthread_mutex_lock(&td->lock);
+    drain(td);
+    fflush(td->fp);
+    pthread_mutex_unlock(&td->lock);
+    return val;
+}
+
+// a mapped block is a read that takes no time
+static void *trace_map(struct blkdev *dev, int64_t blk)
+{
+    struct trace_dev *td = dev->private;
+    uint64_t t = now_ns();
+    void *p = NULL;
+    if (td->lower->ops->map != NULL)
+        p = td->lower->ops->map(td->lower, blk);
+    if (p != NULL)
+        record(td, TRACE_READ, blk, 1, t, SUCCESS);
+    return p;
+}
+
+/* asynchronous requests are remembered with their start time until
+ * they come back from 'complete'. There are only ever a queue's worth
+ * of them, so a plain array does.
+ */
+static int trace_submit(struct blkdev *dev, struct blkdev_req **reqs, int n)
+{
+    struct trace_dev *td = dev->private;
+    uint64_t t = now_ns();
+    int i;
+
+    pthread_mutex_lock(&td->lock);
+    if (td->npend + n > td->maxpend) {
+        td->maxpend = 2 * (td->npend + n);
+        td->pend = realloc(td->pend, td->maxpend * sizeof(*td->pend));
+    }
+    for (i = 0; i < n; i++) {
+        td->pend[td->npend].req = reqs[i];
+        td->pend[td->npend++].start = t;
+    }
+    pthread_mutex_unlock(&td->lock);
+    return td->lower->ops->submit(td->lower, reqs, n);
+}
+
+static int trace_complete(struct blkdev *dev, struct blkdev_req **done,
+                          int min, int max)
+{
+    struct trace_dev *td = dev->private;
+    int i, k, n = td->lower->ops->complete(td->lower, done, min, max);
+
+    for (i = 0; i < n; i++) {
+        uint64_t start = 0;
+        pthread_mutex_lock(&td->lock);
+        for (k = 0; k < td->npend; k++)
+            if (td->pend[k].req == done[i]) {
+                start = td->pend[k].start;
+                td->pend[k] = td->pend[--td->npend];
+                break;
+            }
+        pthread_mutex_unlock(&td->lock);
+        record(td, done[i]->write ? TRACE_WRITE : TRACE_READ,
+               done[i]->first_blk, done[i]->num_blks, start, done[i]->result);
+    }
+    return n;
+}
+
+static void trace_close(struct blkdev *dev)
+{
+    struct trace_dev *td = dev->private;
+    td->lower->ops->close(td->lower);
+    drain(td);
+    fclose(td->fp);
+    pthread_mutex_destroy(&td->lock);
+    free(td->recs);
+    free(td->pend);
+    free(td);
+    dev->private = NULL;
+    free(dev);
+}
+
+struct blkdev_ops trace_ops = {
+    .num_blocks = trace_num_blocks,
+    .read = trace_read,
+    .write = trace_write,
+    .flush = trace_flush,
+    .close = trace_close,
+    .map = trace_map
+};
+
+struct blkdev_ops trace_async_ops = {
+    .num_blocks = trace_num_blocks,
+    .read = trace_read,
+    .write = trace_write,
+    .flush = trace_flush,
+    .close = trace_close,
+    .map = trace_map,
+    .submit = trace_submit,
+    .complete = trace_complete
+};
+
+/* trace all I/O to 'lower' into the file 'path', which is overwritten.
+ * Closing the device finishes the trace and closes 'lower' as well.
+ */
+struct blkdev *trace_create(struct blkdev *lower, const char *path)
+{
+    struct blkdev *dev = malloc(sizeof(*dev));
+    struct trace_dev *td = calloc(1, sizeof(*td));
+    struct trace_hdr h = {.magic = TRACE_MAGIC, .version = TRACE_VERSION,
+                          .block_size = lower->block_size};
+
+    if (dev == NULL || td == NULL)
+        return NULL;
+    if ((td->fp = fopen(path, "w")) == NULL) {
+        perror(path);
+        return NULL;
+    }
+    h.num_blocks = lower->ops->num_blocks(lower);
+    h.start_time = time(NULL);
+    fwrite(&h, sizeof(h), 1, td->fp);
+
+    td->lower = lower;
+    td->t0 = now_ns();
+    td->recs = malloc(TRACE_BATCH * sizeof(*td->recs));
+    pthread_mutex_init(&td->lock, NULL);
+    dev->private = td;
+    dev->ops = (lower->ops->submit != NULL) ? &trace_async_ops : &trace_ops;
+    dev->block_size = lower->block_size;
+    return dev;
+}